@@ -34,11 +34,15 @@
 #include <map>
 #include <set>
 #include <valarray>
+#include <fstream>
 
 #include <opencv2/opencv.hpp>
 
 namespace of2 {
 
+class FabMapModel;
+class WordOrder;
+
 
 /*
 	Return data format of a FABMAP compare call
@@ -78,13 +82,21 @@ public:
 		SAMPLED = 2,
 		NAIVE_BAYES = 4,
 		CHOW_LIU = 8,
-		MOTION_MODEL = 16
+		MOTION_MODEL = 16,
+		INCREMENTAL = 32
 	};
 
 	FabMap(const cv::Mat& clTree, double PzGe, double PzGNe, int flags,
 			int numSamples = 0);
+	//the Chow-Liu tree, detector model and Bayes method are taken from a
+	//compiled model
+	FabMap(const cv::Ptr<FabMapModel>& model, int flags, int numSamples = 0);
 	virtual ~FabMap();
 
+	//image descriptors are 1 x nWords CV_32F word counts, or for large
+	//vocabularies 1 x n CV_32S lists of the words present in the image.
+	//FabMap2 stores word lists as given, the other methods expand them
+
 	//methods to add training data for **sampling** method
 	virtual void addTraining(const cv::Mat& queryImgDescriptor);
 	virtual void addTraining(const std::vector<cv::Mat>& queryImgDescriptors);
@@ -97,6 +109,11 @@ public:
 	const std::vector<cv::Mat>& getTrainingImgDescriptors() const;
 	const std::vector<cv::Mat>& getTestImgDescriptors() const;
 
+	//the fraction of words whose (zq, zpq) state may change between
+	//consecutive queries before INCREMENTAL scoring falls back to scoring
+	//every location from scratch
+	void setIncrementalThreshold(double threshold);
+
 	//Main FabMap image comparison
 	void compare(const cv::Mat& queryImgDescriptor,
 			std::vector<IMatch>& matches, bool addQuery = false,
@@ -122,16 +139,54 @@ protected:
 
 	void addImgDescriptor(const cv::Mat& queryImgDescriptor);
 
+	//descriptor formats
+	void checkImgDescriptor(const cv::Mat& imgDescriptor) const;
+	cv::Mat denseImgDescriptor(const cv::Mat& imgDescriptor) const;
+	void getPresentWords(const cv::Mat& imgDescriptor,
+			std::vector<int>& words) const;
+
 	//the getLikelihoods method is overwritten for each different FabMap
 	//method.
 	virtual void getLikelihoods(const cv::Mat& queryImgDescriptor,
 			const std::vector<cv::Mat>& testImgDescriptors,
 			std::vector<IMatch>& matches);
 	virtual double getNewPlaceLikelihood(const cv::Mat& queryImgDescriptor);
+	//likelihoods of several independent queries, one vector of matches per
+	//query. Only FabMapLUT overrides this to score blocks of queries
+	//together; the other engines score each query in turn
+	virtual void getBatchLikelihoods(
+			const std::vector<cv::Mat>& queryImgDescriptors,
+			const std::vector<cv::Mat>& testImgDescriptors,
+			std::vector<std::vector<IMatch> >& matches);
 	
 	//turn likelihoods into probabilities (also add in motion model if used)
 	void normaliseDistribution(std::vector<IMatch>& matches);
 
+	//location log-likelihoods of the last query against a set of images
+	//and the state (zq << 1 | zpq) of each word in that query
+	struct LikelihoodCache {
+		LikelihoodCache() : imgDescriptors(NULL) {
+		}
+
+		const std::vector<cv::Mat>* imgDescriptors;
+		std::vector<uchar> wordStates;
+		std::vector<double> likelihoods;
+	};
+
+	//INCREMENTAL scoring: corrects the cached likelihoods for the words
+	//whose state changed since the last query
+	void getIncrementalLikelihoods(const cv::Mat& queryImgDescriptor,
+			const std::vector<cv::Mat>& testImgDescriptors,
+			LikelihoodCache& cache, std::vector<IMatch>& matches);
+	virtual void updateLikelihoods(
+			const std::vector<cv::Mat>& testImgDescriptors,
+			const std::vector<int>& changedWords,
+			const std::vector<uchar>& oldStates,
+			const std::vector<uchar>& newStates,
+			std::vector<double>& likelihoods);
+	//the log-likelihood contribution of word q to a location
+	virtual double wordLikelihood(int q, int state, bool Lzq);
+
 	//Chow-Liu Tree
 	int pq(int q);
 	double Pzq(int q, bool zq);
@@ -145,10 +200,12 @@ protected:
 	double (FabMap::*PzGL)(int q, bool zq, bool zpq, bool Lzq);
 
 	//data
+	cv::Ptr<FabMapModel> model;
 	cv::Mat clTree;
 	std::vector<cv::Mat> trainingImgDescriptors;
 	std::vector<cv::Mat> testImgDescriptors;
 	std::vector<IMatch> priorMatches;
+	LikelihoodCache testCache;
 
 	//parameters
 	double PzGe;
@@ -157,10 +214,14 @@ protected:
 
 	double mBias;
 	double sFactor;
+	double incrementalThreshold;
 
 	int flags;
 	int numSamples;
 
+private:
+	void init();
+
 };
 
 /*
@@ -171,6 +232,8 @@ class FabMap1: public FabMap {
 public:
 	FabMap1(const cv::Mat& clTree, double PzGe, double PzGNe, int flags,
 			int numSamples = 0);
+	FabMap1(const cv::Ptr<FabMapModel>& model, int flags,
+			int numSamples = 0);
 	virtual ~FabMap1();
 protected:
 
@@ -185,20 +248,45 @@ protected:
 */
 class FabMapLUT: public FabMap {
 public:
+	//tableType selects the storage of the look-up-table: CV_32S (default),
+	//CV_32F, CV_16S or CV_8S. Reduced precision tables trade a bounded
+	//likelihood error for a smaller cache footprint.
 	FabMapLUT(const cv::Mat& clTree, double PzGe, double PzGNe,
-			int flags, int numSamples = 0, int precision = 6);
+			int flags, int numSamples = 0, int precision = 6,
+			int tableType = CV_32S);
+	//the table precision and type are those the model was compiled with
+	FabMapLUT(const cv::Ptr<FabMapModel>& model, int flags,
+			int numSamples = 0);
 	virtual ~FabMapLUT();
+
+	//the maximum absolute log-likelihood deviation of the look-up-table
+	//from the double precision calculation over a set of queries
+	double precisionError(const std::vector<cv::Mat>& queryImgDescriptors,
+			const std::vector<cv::Mat>& testImgDescriptors);
+
 protected:
 
 	//FabMap look-up-table implementation of the likelihood comparison
 	void getLikelihoods(const cv::Mat& queryImgDescriptor, const std::vector<
 			cv::Mat>& testImgDescriptors, std::vector<IMatch>& matches);
+	//cache-blocked comparison of many queries against many test images
+	void getBatchLikelihoods(const std::vector<cv::Mat>& queryImgDescriptors,
+			const std::vector<cv::Mat>& testImgDescriptors,
+			std::vector<std::vector<IMatch> >& matches);
+	double wordLikelihood(int q, int state, bool Lzq);
+
+	//the table index bits zq << 1 | zpq of each word of a query
+	void getQueryIndices(const cv::Mat& queryImgDescriptor,
+			std::vector<uchar>& queryIdx);
 
-	//procomputed data
-	int (*table)[8];
+	//procomputed data: nWords x 8 entries of -log(P(zq|zpq,Lzq)) * tableScale
+	cv::Mat table;
+	double tableScale;
 
 	//data precision
 	int precision;
+
+	friend class FabMapModel;
 };
 
 /*
@@ -210,6 +298,10 @@ public:
 	FabMapFBO(const cv::Mat& clTree, double PzGe, double PzGNe, int flags,
 			int numSamples = 0, double rejectionThreshold = 1e-8, double PsGd =
 					1e-8, int bisectionStart = 512, int bisectionIts = 9);
+	FabMapFBO(const cv::Ptr<FabMapModel>& model, int flags,
+			int numSamples = 0, double rejectionThreshold = 1e-8, 
+			double PsGd = 1e-8, int bisectionStart = 512,
+			int bisectionIts = 9);
 	virtual ~FabMapFBO();
 
 protected:
@@ -250,11 +342,17 @@ protected:
 	double bennettInequality(double v, double m, double delta);
 	static bool compInfo(const WordStats& first, const WordStats& second);
 
+	//precomputed data: nWords x 8 entries of log(P(zq|zpq,Lzq)), indexed
+	//as the FabMapLUT table
+	cv::Mat logTable;
+
 	//parameters
 	double PsGd; // P(S > delta) in equation 4.9
 	double rejectionThreshold;
 	int bisectionStart;
 	int bisectionIts;
+
+	friend class FabMapModel;
 };
 
 /*
@@ -265,6 +363,7 @@ class FabMap2: public FabMap {
 public:
 
 	FabMap2(const cv::Mat& clTree, double PzGe, double PzGNe, int flags);
+	FabMap2(const cv::Ptr<FabMapModel>& model, int flags);
 	virtual ~FabMap2();
 
 	//FabMap2 builds the inverted index and requires an additional training/test
@@ -285,6 +384,14 @@ protected:
 	void getLikelihoods(const cv::Mat& queryImgDescriptor, const std::vector<
 			cv::Mat>& testImgDescriptors, std::vector<IMatch>& matches);
 	double getNewPlaceLikelihood(const cv::Mat& queryImgDescriptor);
+
+	//INCREMENTAL scoring through the inverted index
+	void updateLikelihoods(const std::vector<cv::Mat>& testImgDescriptors,
+			const std::vector<int>& changedWords,
+			const std::vector<uchar>& oldStates,
+			const std::vector<uchar>& newStates,
+			std::vector<double>& likelihoods);
+	double wordLikelihood(int q, int state, bool Lzq);
 	
 	//the likelihood function using the inverted index
 	void getIndexLikelihoods(const cv::Mat& queryImgDescriptor, std::vector<
@@ -296,12 +403,14 @@ protected:
 
 	//data
 
-	    // d1: log( P(zq=F|zpq=F, Lzq=T) / P(zq=F|zpq=F, Lzq=F) )
-	    // d2: log( P(zq=F|zpq=T, Lzq=T) / P(zq=F|zpq=T, Lzq=F) ) - d1
-		// d3: log( P(zq=T|zpq=F, Lzq=T) / P(zq=T|zpq=F, Lzq=F) ) - d1
-	    // d4: log( P(zq=T|zpq=T, Lzq=T) / P(zq=T|zpq=T, Lzq=F) ) - d1
-	std::vector<double> d1, d2, d3, d4;  // pre-computing terms
-	std::vector<std::vector<int> > children;  // records children of each node in clTree
+	    // row 0, d1: log( P(zq=F|zpq=F, Lzq=T) / P(zq=F|zpq=F, Lzq=F) )
+	    // row 1, d2: log( P(zq=F|zpq=T, Lzq=T) / P(zq=F|zpq=T, Lzq=F) ) - d1
+		// row 2, d3: log( P(zq=T|zpq=F, Lzq=T) / P(zq=T|zpq=F, Lzq=F) ) - d1
+	    // row 3, d4: log( P(zq=T|zpq=T, Lzq=T) / P(zq=T|zpq=T, Lzq=F) ) - d1
+	cv::Mat d;  // pre-computing terms, 4 x nWords
+	// records children of each node in clTree: the children of q are
+	// childList[childIndex[q]] to childList[childIndex[q+1]-1]
+	cv::Mat childIndex, childList;
 
 	// TODO: inverted map a vector?
 
@@ -311,7 +420,174 @@ protected:
 	std::vector<double> testDefaults;  // stores the default log-likelihood of each location for testing location
 	std::map<int, std::vector<int> > testInvertedMap;  // stores word -> location maps used for testing location
 
+	LikelihoodCache trainingCache;  // INCREMENTAL new place likelihoods
+
+	friend class FabMapModel;
+};
+
+/*
+	A compiled FabMap model holds the Chow-Liu tree, detector model and the
+	tables each FabMap method precomputes from them. Saved models are mapped
+	into memory when loaded, so starting an engine needs no table building
+	and the pages are shared by every process using the same file.
+*/
+class FabMapModel {
+public:
+	//compile the tables of every FabMap method from a Chow-Liu tree.
+	//Only the NAIVE_BAYES/CHOW_LIU option of flags is used.
+	FabMapModel(const cv::Mat& clTree, double PzGe, double PzGNe, int flags,
+			int lutPrecision = 6, int lutTableType = CV_32S);
+	//map a model previously written with save()
+	FabMapModel(const std::string& filename);
+	virtual ~FabMapModel();
+
+	void save(const std::string& filename) const;
+
+	//accessors
+	const cv::Mat& getTree() const { return clTree; }
+	double getPzGe() const { return PzGe; }
+	double getPzGNe() const { return PzGNe; }
+	int getFlags() const { return flags; }
+	int getLUTPrecision() const { return lutPrecision; }
+	int getLUTTableType() const { return lutTable.type(); }
+
+	//whether the model was compiled from this Chow-Liu tree. A model
+	//compiled before the tree was retrained or renumbered gives wrong
+	//likelihoods
+	bool matchesTree(const cv::Mat& clTree) const;
+
+protected:
+
+	//detector model and Bayes method
+	double PzGe;
+	double PzGNe;
+	int flags;
+
+	//4 x nWords Chow-Liu tree, one row per field
+	cv::Mat clTree;
+
+	//FabMapLUT
+	cv::Mat lutTable;
+	double lutScale;
+	int lutPrecision;
+
+	//FabMapFBO
+	cv::Mat fboLogTable;
+
+	//FabMap2
+	cv::Mat fabmap2Terms;
+	cv::Mat childIndex, childList;
+
+	//memory mapping of a loaded model
+	void *mappedData;
+	size_t mappedSize;
+	void *fileHandle;
+	void *mapHandle;
+
+	friend class FabMapLUT;
+	friend class FabMapFBO;
+	friend class FabMap2;
+
+private:
+	void unmap();
+	bool validTree() const;
+
+	FabMapModel(const FabMapModel&);
+	FabMapModel& operator=(const FabMapModel&);
+};
+
+/*
+	A binary file of named matrices, a compact alternative to YAML for
+	vocabularies, Chow-Liu trees and descriptors. Each matrix is stored as
+	a header giving its shape and type followed by its raw rows, or for
+	sparse matrices such as bag-of-words descriptors, by each row's count,
+	columns and values of its non-zero entries. Files are little-endian
+	whatever the machine, so they can be shared between machines.
+*/
+class MatrixFile {
+public:
+	enum {
+		READ = 0,
+		WRITE = 1
+	};
+
+	MatrixFile();
+	MatrixFile(const std::string& filename, int flags);
+	virtual ~MatrixFile();
+
+	//returns false if the file could not be opened or, when reading, is
+	//not a matrix file
+	bool open(const std::string& filename, int flags);
+	bool isOpened() const;
+	void release();
+
+	//appends a matrix to a file opened for writing
+	void write(const std::string& name, const cv::Mat& mat,
+			bool sparse = false);
+
+	//the whole matrix stored under name, empty if there is none
+	void read(const std::string& name, cv::Mat& mat);
+
+	//finds a matrix to be read a chunk at a time by readRows, returning
+	//false if the file holds none under name
+	bool find(const std::string& name, int& rows, int& cols, int& type);
+	//the next maxRows rows of the matrix found or fewer, false once all
+	//have been read
+	bool readRows(cv::Mat& rows, int maxRows);
+
+	//whether a file begins with the header of a matrix file
+	static bool isMatrixFile(const std::string& filename);
+
+private:
+	std::ifstream in;
+	std::ofstream out;
+
+	//the matrix found for reading
+	int rows;
+	int cols;
+	int type;
+	bool sparse;
+	int rowsRead;
+
+	MatrixFile(const MatrixFile&);
+	MatrixFile& operator=(const MatrixFile&);
+};
+
+/*
+	Reads the rows of a bag-of-words or feature descriptor matrix saved by
+	cv::FileStorage to a plain YAML or XML file, or saved to a MatrixFile,
+	a chunk at a time, so training data larger than memory can be streamed.
+*/
+class BOWDescriptorReader {
+public:
+	BOWDescriptorReader();
+	BOWDescriptorReader(const std::string& filename,
+			const std::string& nodeName = "BOWImageDescs");
+	virtual ~BOWDescriptorReader();
+
+	//returns false if the file or the CV_32F matrix could not be found
+	bool open(const std::string& filename,
+			const std::string& nodeName = "BOWImageDescs");
+	bool isOpened() const;
+
+	//the next maxRows descriptors or fewer, false once all have been read
+	bool read(cv::Mat& imgDescriptors, int maxRows);
+	//start reading from the first descriptor again
+	void rewind();
+
+	int getRows() const { return rows; }
+	int getCols() const { return cols; }
+
+private:
+	std::ifstream file;
+	std::streampos dataStart;
+	MatrixFile matrixFile;
+	std::string nodeName;
+	int rows;
+	int cols;
+	int rowsRead;
 };
+
 /*
 	A Chow-Liu tree is required by FAB-MAP. The Chow-Liu tree provides an 
 	estimate of the	full distribution of visual words using a minimum spanning 
@@ -319,20 +595,75 @@ protected:
 */
 class ChowLiuTree {
 public:
-	ChowLiuTree();
+	//maxPartners > 0 learns an approximate tree for very large vocabularies:
+	//only the maxPartners words most often seen with each word are counted,
+	//and the tree is spanned over those pairs rather than every pair
+	ChowLiuTree(int maxPartners = 0);
 	virtual ~ChowLiuTree();
 
 	//add data to the chow-liu tree before calling make
 	void add(const cv::Mat& imgDescriptor);
 	void add(const std::vector<cv::Mat>& imgDescriptors);
 
+	//the descriptors added since the statistics were last updated
 	const std::vector<cv::Mat>& getImgDescriptors() const;
 
-	cv::Mat make(double infoThreshold = 0.0);
+	//count the added descriptors into the running word occurrence
+	//statistics and release them. make() calls this itself
+	void updateStatistics(int numThreads = 0);
+	//count every descriptor of a reader, chunkRows at a time, without
+	//holding them all in memory
+	void updateStatistics(BOWDescriptorReader& reader, int chunkRows = 1000,
+			int numThreads = 0);
+	//add the statistics and descriptors of a tree trained on another shard
+	void merge(const ChowLiuTree& other);
+
+	//save/load the statistics. Descriptors must be counted before saving.
+	//Only the pairs of words seen together are saved. read returns false,
+	//leaving the tree unchanged, if the statistics were counted with
+	//another maxPartners
+	void write(cv::FileStorage& fs) const;
+	bool read(const cv::FileNode& fn);
+	void write(MatrixFile& file) const;
+	bool read(MatrixFile& file);
+
+	//renumber the counted statistics as the vocabulary is renumbered.
+	//Descriptors must be counted first
+	void permuteWords(const WordOrder& order);
+
+	//numThreads sets the threads scoring word pairs when built with OpenMP,
+	//0 uses every available core. The tree does not depend on it
+	cv::Mat make(double infoThreshold = 0.0, int numThreads = 0);
 
 private:
 	std::vector<cv::Mat> imgDescriptors;
-	cv::Mat mergedImgDescriptors;
+
+	//running occurrence counts of every image counted so far: the images
+	//each word is present in, and the images each pair of words is present
+	//in. Only the pairs seen together are kept, as the (word, count) of the
+	//higher words paired with each word, in word order
+	int nWords;
+	int nImages;
+	std::vector<int> wordCounts;
+	std::vector<std::vector<std::pair<int, int> > > pairCounts;
+
+	//in the approximate mode the pair counts are kept as the (word, count)
+	//of the partners of each word, in word order
+	int maxPartners;
+	std::vector<std::vector<std::pair<int, int> > > partnerCounts;
+	void addPartnerCounts(int q,
+		const std::vector<std::pair<int, int> >& counts);
+	void countPairs(int numThreads);
+	void countPartners(int numThreads);
+
+	//the pair or partner counts as a list of (word, count) per word
+	void getPairLists(cv::Mat& offsets, cv::Mat& words,
+		cv::Mat& counts) const;
+	void setPairLists(const cv::Mat& offsets, const cv::Mat& words,
+		const cv::Mat& counts);
+
+	int countJoint(int a, int b);
+	int count(int a, bool za, int b, bool zb, int countAB);
 
 	// data structure for edge of the complete graph
 	// word1: index of word in the vocabulary
@@ -341,47 +672,233 @@ private:
 
 	typedef struct info {
 		float score;
-		short word1;
-		short word2;
+		int word1;
+		int word2;
 	} info;
 
-	//probabilities extracted from mergedImgDescriptors
+	//probabilities extracted from the occurrence counts
 	double P(int a, bool za);
-	double JP(int a, bool za, int b, bool zb); //a & b
+	double JP(int a, bool za, int b, bool zb, int countAB); //a & b
 	double CP(int a, bool za, int b, bool zb); // a | b
 
-	//calculating mutual information of all edges
-	void createBaseEdges(std::list<info>& edges, double infoThreshold);
-	double calcMutInfo(int word1, int word2);
+	//calculating mutual information of edges
+	double calcMutInfo(int word1, int word2, int count12);
 	static bool sortInfoScores(const info& first, const info& second);
 
 	//selecting minimum spanning egdges with maximum information
-	bool reduceEdgesToMinSpan(std::list<info>& edges);
+	bool createMaxSpanningTree(std::list<info>& edges, double infoThreshold,
+		int numThreads);
+	void createPartnerSpanningTree(std::list<info>& edges,
+		double infoThreshold);
 	
 	//building the tree sctructure
 	cv::Mat buildTree(int root_word, std::list<info> &edges);
-	void recAddToTree(cv::Mat &cltree, int q, int pq, 
-		std::list<info> &remaining_edges);
-	std::vector<int> extractChildren(std::list<info> &remaining_edges, int q);
+	void addToTree(cv::Mat &cltree, int q, int pq);
+
+};
+
+/*
+	Renumbers the words of a vocabulary into breadth or depth first order of
+	its Chow-Liu tree, so parents and children sit close together in memory
+	and the tree can be traversed linearly. The same renumbering must be
+	applied to the vocabulary, the tree and every image descriptor.
+*/
+class WordOrder {
+public:
+
+	enum {
+		BREADTH_FIRST = 0,
+		DEPTH_FIRST = 1
+	};
+
+	WordOrder();
+	WordOrder(const cv::Mat& clTree, int order = BREADTH_FIRST);
+	virtual ~WordOrder();
+
+	//renumber a 4 x nWords Chow-Liu tree
+	cv::Mat permuteTree(const cv::Mat& clTree) const;
+	//renumber the rows of a vocabulary
+	cv::Mat permuteVocabulary(const cv::Mat& vocabulary) const;
+	//renumber the columns of bag-of-words image descriptors
+	cv::Mat permuteImgDescriptors(const cv::Mat& imgDescriptors) const;
+
+	//newToOld[i] is the original index of renumbered word i
+	const std::vector<int>& getNewToOld() const;
+	const std::vector<int>& getOldToNew() const;
+
+	void write(cv::FileStorage& fs) const;
+	void read(const cv::FileNode& fn);
+	void write(MatrixFile& file) const;
+	//returns false if the file holds no word order
+	bool read(MatrixFile& file);
+
+private:
+	std::vector<int> newToOld;
+	std::vector<int> oldToNew;
+};
+
+/*
+	Projects descriptors onto their first principal components, so that
+	vocabulary training and quantisation work on fewer dimensions. The
+	projection is learned from the vocabulary training data, is stored with
+	the vocabulary and must be applied to every descriptor quantised against
+	it. The covariance is accumulated chunk by chunk, so the training data
+	can be streamed.
+*/
+class PCAProjection {
+public:
+	PCAProjection();
+	virtual ~PCAProjection();
+
+	//learns the projection onto the first dims principal components of
+	//CV_32F descriptors
+	void train(const cv::Mat& descriptors, int dims);
+	//learns from several batches of descriptors as if they were one
+	void train(const std::vector<cv::Mat>& descriptors, int dims);
+	void train(BOWDescriptorReader& reader, int dims, int chunkRows = 10000);
+
+	bool empty() const;
+	int getInputDims() const;
+	int getDims() const;
+
+	//the projection of each row of descriptors, less the projected mean
+	void project(const cv::Mat& descriptors, cv::Mat& projected) const;
+
+	void write(cv::FileStorage& fs) const;
+	//leaves the projection empty if the node holds none
+	void read(const cv::FileNode& fn);
+	void write(MatrixFile& file) const;
+	//leaves the projection empty if the file holds none
+	void read(MatrixFile& file);
+
+private:
+	void learn(const cv::Mat& sum, const cv::Mat& products, int count,
+		int dims);
+
+	cv::Mat mean;
+	//a principal component in each row, the largest first
+	cv::Mat components;
+	//the projection of the mean
+	cv::Mat offset;
+};
+
+/*
+	Exact nearest-word quantisation against a flat vocabulary. The squared
+	distances of a block of descriptors to every word are found as
+	|w|^2 - 2 z.w, one tiled matrix product per block, with each word's
+	squared norm precomputed. A CV_8U vocabulary of binary words, such as
+	ORB or BRIEF descriptors, is searched by hamming distance instead.
+	Ties go to the lower word.
+*/
+class BOWQuantiser {
+public:
+	BOWQuantiser();
+	BOWQuantiser(const cv::Mat& vocabulary);
+	virtual ~BOWQuantiser();
+
+	void setVocabulary(const cv::Mat& vocabulary);
+	bool empty() const;
+	int getVocabularySize() const;
+
+	//the word of each row of descriptors
+	void quantise(const cv::Mat& descriptors, std::vector<int>& words) const;
+	//a bag-of-words image descriptor as cv::BOWImgDescriptorExtractor
+	//computes it: the count of each word over the number of descriptors
+	void compute(const cv::Mat& descriptors, cv::Mat& imgDescriptor) const;
+	//the words present as a 1 x n CV_32S word list in word order, the
+	//sparse image descriptor accepted by FabMap
+	void computeWordList(const cv::Mat& descriptors, cv::Mat& wordList) const;
+
+private:
+	//the words in panels of 16, each stored dimension by dimension so the
+	//16 words are scored side by side
+	cv::Mat panels;
+	std::vector<float> wordNorms;
+	//or the binary words as given
+	cv::Mat binaryWords;
+	int vocabularySize;
+	int dims;
+};
 
+/*
+	A hierarchical vocabulary tree over the words of a flat vocabulary, such
+	as one trained by BOWMSCTrainer. The words are split into branching
+	clusters by k-means, level by level, so a descriptor is quantised by
+	descending to the nearest child at each level: O(branching log K)
+	comparisons rather than K. The descent is approximate, a descriptor may
+	reach a word other than its nearest. Words keep their vocabulary index.
+*/
+class VocabularyTree {
+public:
+	VocabularyTree();
+	VocabularyTree(const cv::Mat& vocabulary, int branching = 10);
+	virtual ~VocabularyTree();
+
+	void build(const cv::Mat& vocabulary, int branching = 10);
+	bool empty() const;
+	int getVocabularySize() const;
+	//whether the tree was built over this vocabulary, with the same words
+	//in the same order
+	bool matches(const cv::Mat& vocabulary) const;
+	//renumber the words of the leaves as the vocabulary is renumbered
+	void permuteWords(const WordOrder& order);
+
+	//the word of each row of descriptors
+	void quantise(const cv::Mat& descriptors, std::vector<int>& words) const;
+	//a bag-of-words image descriptor as cv::BOWImgDescriptorExtractor
+	//computes it: the count of each word over the number of descriptors
+	void compute(const cv::Mat& descriptors, cv::Mat& imgDescriptor) const;
+
+	void write(cv::FileStorage& fs) const;
+	void read(const cv::FileNode& fn);
+
+private:
+	int nearestChild(int node, const float *descriptor) const;
+
+	//node n has the centre in row n and the children firstChild[n] to
+	//firstChild[n] + childCount[n] - 1. Leaves hold their vocabulary word
+	//in nodeWords[n], the other nodes -1. Node 0 is the root
+	cv::Mat centres;
+	std::vector<int> firstChild;
+	std::vector<int> childCount;
+	std::vector<int> nodeWords;
+	int vocabularySize;
 };
 
 /*
 	A custom vocabulary training method based on:
 	http://www.springerlink.com/content/d1h6j8x552532003/
+	CV_32F descriptors are clustered by euclidean distance. CV_8U binary
+	descriptors, such as ORB or BRIEF, are clustered by hamming distance,
+	with clusterSize in bits, and each word is the bitwise majority vote of
+	its descriptors.
 */
 class BOWMSCTrainer: public cv::BOWTrainer {
 public:
-	BOWMSCTrainer(double clusterSize = 0.4);
+	//numThreads sets the threads comparing descriptors with the centres
+	//when built with OpenMP, 0 uses every available core
+	BOWMSCTrainer(double clusterSize = 0.4, int numThreads = 0);
 	virtual ~BOWMSCTrainer();
 
 	// Returns trained vocabulary (i.e. cluster centers).
 	virtual cv::Mat cluster() const;
 	virtual cv::Mat cluster(const cv::Mat& descriptors) const;
+	// clusters several batches of descriptors as if they were one
+	cv::Mat cluster(const std::vector<cv::Mat>& descriptors) const;
+	// clusters descriptors streamed from disk chunkRows at a time, reading
+	// the next chunk while the current one is processed
+	cv::Mat cluster(BOWDescriptorReader& reader, int chunkRows = 10000) const;
+	// clusters the projections of streamed descriptors, each chunk being
+	// projected as it is read. An empty projection leaves them as read
+	cv::Mat cluster(BOWDescriptorReader& reader,
+		const PCAProjection& projection, int chunkRows = 10000) const;
 
 protected:
 
+	int getNumThreads() const;
+
 	double clusterSize;
+	int numThreads;
 
 };
 
@@ -30,6 +30,9 @@
 
 #include "../include/openfabmap.hpp"
 #include <fstream>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #ifdef OPENCV2P4
 #include <opencv2/nonfree/nonfree.hpp>
 #endif
@@ -42,22 +45,54 @@ int showFeatures(std::string trainPath,
 				 cv::Ptr<cv::FeatureDetector> &detector);
 int generateVocabTrainData(std::string trainPath,
 						   std::string vocabTrainDataPath,
-						   cv::Ptr<cv::FeatureDetector> &detector,
-						   cv::Ptr<cv::DescriptorExtractor> &extractor);
+						   cv::FileStorage &settings,
+						   std::string featureCachePath,
+						   const cv::FileNode &featureOptions,
+						   int numThreads,
+						   int batchFrames,
+						   bool headless);
 int trainVocabulary(std::string vocabPath,
 					std::string vocabTrainDataPath,
-					double clusterRadius);
+					double clusterRadius,
+					double binaryClusterRadius,
+					int pcaDims,
+					int numThreads);
 
 int generateBOWImageDescs(std::string dataPath,
 							std::string bowImageDescPath,
 							std::string vocabPath,
-							cv::Ptr<cv::FeatureDetector> &detector,
-							cv::Ptr<cv::DescriptorExtractor> &extractor,
-							int minWords);
+							cv::FileStorage &settings,
+							std::string featureCachePath,
+							const cv::FileNode &featureOptions,
+							int minWords,
+							std::string quantiser,
+							std::string vocabTreePath,
+							int treeBranching,
+							int numThreads,
+							int batchFrames);
 
 int trainChowLiuTree(std::string chowliutreePath,
 					 std::string fabmapTrainDataPath,
-					 double lowerInformationBound);
+					 std::string chowliuStatisticsPath,
+					 double lowerInformationBound,
+					 int numThreads,
+					 int maxPartners);
+
+int trainFromVideo(cv::FileStorage &settings);
+
+int renumberWords(std::string vocabPath,
+				  std::string chowliutreePath,
+				  std::string fabmapTrainDataPath,
+				  std::string fabmapTestDataPath,
+				  std::string chowliuStatisticsPath,
+				  std::string vocabTreePath,
+				  std::string modelPath,
+				  int maxPartners,
+				  std::string wordOrder);
+
+int compileFabMapModel(std::string modelPath,
+					   std::string chowliutreePath,
+					   cv::FileStorage &settings);
 
 int openFABMAP(std::string testPath,
 			   of2::FabMap *openFABMAP,
@@ -69,8 +104,174 @@ int openFABMAP(std::string testPath,
 helper functions
 */
 of2::FabMap *generateFABMAPInstance(cv::FileStorage &settings);
+int generateFABMAPOptions(cv::FileStorage &settings);
+int generateLUTTableType(cv::FileStorage &settings);
+bool checkFabMapModel(const of2::FabMapModel &model, const cv::Mat &clTree,
+					  cv::FileStorage &settings);
 cv::Ptr<cv::FeatureDetector> generateDetector(cv::FileStorage &fs);
 cv::Ptr<cv::DescriptorExtractor> generateExtractor(cv::FileStorage &fs);
+int clusterVocabulary(std::vector<cv::Mat> &descriptors,
+					  double clusterRadius,
+					  double binaryClusterRadius,
+					  int pcaDims,
+					  int numThreads,
+					  cv::Mat &vocab,
+					  of2::PCAProjection &projection);
+int loadVocabularyTree(of2::VocabularyTree &vocabTree,
+					   const cv::Mat &vocab,
+					   std::string quantiser,
+					   std::string vocabTreePath,
+					   int treeBranching);
+
+/*
+matrices are saved to paths ending in ".bin" as binary matrix files, and to
+other paths as YAML. Either format is loaded
+*/
+bool isBinaryPath(const std::string &path);
+cv::Mat loadMatrix(const std::string &path, const std::string &name);
+void saveMatrix(const std::string &path, const std::string &name,
+				const cv::Mat &mat, bool sparse = false);
+cv::Mat loadVocabulary(const std::string &vocabPath,
+					   of2::PCAProjection &projection);
+void saveVocabulary(const std::string &vocabPath, const cv::Mat &vocab,
+					const of2::PCAProjection &projection);
+bool loadChowLiuStatistics(const std::string &statisticsPath,
+						   of2::ChowLiuTree &tree);
+void saveChowLiuStatistics(const std::string &statisticsPath,
+						   const of2::ChowLiuTree &tree);
+void addBOWImageDesc(const cv::Mat &bow, int minWords,
+					 cv::Mat &fabmapTrainData, std::ofstream &maskw);
+
+/*
+The work done on each video frame, called from several threads at once
+*/
+class FrameStage {
+public:
+	virtual ~FrameStage() {}
+	virtual void process(const cv::Mat& frame,
+		std::vector<cv::KeyPoint>& kpts, cv::Mat& result) const = 0;
+};
+
+/*
+Runs a stage over the frames of a video in batches. One thread decodes the
+next batch while the others process the current one, and the results are
+handed back in frame order
+*/
+class FramePipeline {
+public:
+	FramePipeline(cv::VideoCapture &movie, int numThreads, int batchFrames);
+
+	//processes the next batch, false once the video has ended
+	bool next(const FrameStage &stage);
+
+	int getNumThreads() const { return numThreads; }
+
+	size_t size() const { return frames.size(); }
+	const cv::Mat& frame(size_t i) const { return frames[i]; }
+	const std::vector<cv::KeyPoint>& keypoints(size_t i) const {
+		return kpts[i];
+	}
+	const cv::Mat& result(size_t i) const { return results[i]; }
+
+private:
+	void readBatch();
+
+	cv::VideoCapture &movie;
+	int numThreads;
+	int batchFrames;
+	bool started;
+	std::vector<cv::Mat> frames, nextFrames;
+	std::vector<std::vector<cv::KeyPoint> > kpts;
+	std::vector<cv::Mat> results;
+};
+
+/*
+the descriptors of each frame. OpenCV does not promise that a detector or
+extractor can be shared between threads, so each thread uses its own, made
+from the settings file
+*/
+class DescriptorStage : public FrameStage {
+public:
+	void create(cv::FileStorage &settings, int numThreads);
+	void process(const cv::Mat& frame, std::vector<cv::KeyPoint>& kpts,
+		cv::Mat& result) const;
+
+private:
+	std::vector<cv::Ptr<cv::FeatureDetector> > detectors;
+	std::vector<cv::Ptr<cv::DescriptorExtractor> > extractors;
+};
+
+/*
+the bag-of-words image descriptor of a frame's descriptors, projected if a
+projection is set and quantised by whichever of the quantisers is set
+*/
+class BOWStage {
+public:
+	BOWStage(cv::Ptr<cv::DescriptorMatcher> &_matcher, int _vocabSize,
+		const of2::PCAProjection &_projection,
+		const of2::VocabularyTree &_vocabTree,
+		const of2::BOWQuantiser &_exactQuantiser) :
+		matcher(_matcher), vocabSize(_vocabSize), projection(_projection),
+		vocabTree(_vocabTree), exactQuantiser(_exactQuantiser) {}
+	//the image descriptor of descriptors as extracted
+	void compute(const cv::Mat& descriptors, cv::Mat& result) const;
+	//the image descriptor of descriptors already projected
+	void quantise(const cv::Mat& descriptors, cv::Mat& result) const;
+
+private:
+	cv::Ptr<cv::DescriptorMatcher> matcher;
+	int vocabSize;
+	const of2::PCAProjection &projection;
+	const of2::VocabularyTree &vocabTree;
+	const of2::BOWQuantiser &exactQuantiser;
+};
+
+/*
+The keypoints and descriptors of each frame of a video, in batches. They are
+read from the feature cache when it holds the video for the same feature
+options, and are otherwise extracted by a FramePipeline and added to the
+cache. Cache files are named by a hash of the video and the FeatureOptions
+settings, so changing any feature option starts a new cache file
+*/
+class FeatureSource {
+public:
+	FeatureSource(cv::FileStorage &settings, int numThreads,
+		int batchFrames);
+	~FeatureSource();
+
+	//false if the video is neither cached nor can be opened. An empty
+	//cacheDir turns the cache off
+	bool open(const std::string &videoPath, const std::string &cacheDir,
+		const cv::FileNode &featureOptions);
+	//reads or extracts the next batch, false once the video has ended
+	bool next();
+
+	size_t size() const;
+	//the decoded frame, empty when the features come from the cache
+	const cv::Mat& frame(size_t i) const;
+	const std::vector<cv::KeyPoint>& keypoints(size_t i) const;
+	const cv::Mat& descriptors(size_t i) const;
+	//the percentage of the video done
+	double progress();
+
+private:
+	FeatureSource(const FeatureSource &);
+	FeatureSource& operator=(const FeatureSource &);
+
+	cv::FileStorage &settings;
+	DescriptorStage stage;
+	int batchFrames;
+	cv::VideoCapture movie;
+	FramePipeline pipeline;
+	std::ifstream cacheIn;
+	std::ofstream cacheOut;
+	std::string cacheFile;
+	int frameCount;
+	int framesDone;
+	std::vector<std::vector<cv::KeyPoint> > kpts;
+	std::vector<cv::Mat> descs;
+	cv::Mat noFrame;
+};
 			   
 /*
 Advanced tools for keypoint manipulation. These tools are not currently in the
@@ -146,7 +347,12 @@ int main(int argc, char * argv[])
 	//run desired function
 	int result = 0;
 	std::string function = fs["Function"];
-	if (function == "ShowFeatures") {
+	if (function == "ShowFeatures" &&
+		(int)fs["FrameOptions"]["Headless"] > 0) {
+		std::cerr << "ShowFeatures needs a display" << std::endl;
+		result = -1;
+
+	} else if (function == "ShowFeatures") {
 		result = showFeatures(
 			fs["FilePaths"]["TrainPath"],
 			detector);
@@ -154,29 +360,72 @@ int main(int argc, char * argv[])
 	} else if (function == "GenerateVocabTrainData") {
 		result = generateVocabTrainData(fs["FilePaths"]["TrainPath"],
 			fs["FilePaths"]["TrainFeatDesc"], 
-			detector, extractor);
+			fs,
+			fs["FilePaths"]["FeatureCache"],
+			fs["FeatureOptions"],
+			fs["FrameOptions"]["NumThreads"],
+			fs["FrameOptions"]["BatchFrames"],
+			(int)fs["FrameOptions"]["Headless"] > 0);
 
 	} else if (function == "TrainVocabulary") {
 		result = trainVocabulary(fs["FilePaths"]["Vocabulary"],
 			fs["FilePaths"]["TrainFeatDesc"],
-			fs["VocabTrainOptions"]["ClusterSize"]);
+			fs["VocabTrainOptions"]["ClusterSize"],
+			fs["VocabTrainOptions"]["BinaryClusterSize"],
+			fs["VocabTrainOptions"]["PCADims"],
+			fs["VocabTrainOptions"]["NumThreads"]);
 
 	} else if (function == "GenerateFABMAPTrainData") {
 		result = generateBOWImageDescs(fs["FilePaths"]["TrainPath"],
 			fs["FilePaths"]["TrainImagDesc"], 
-			fs["FilePaths"]["Vocabulary"], detector, extractor,
-			fs["BOWOptions"]["MinWords"]);
+			fs["FilePaths"]["Vocabulary"], fs,
+			fs["FilePaths"]["FeatureCache"],
+			fs["FeatureOptions"],
+			fs["BOWOptions"]["MinWords"],
+			fs["BOWOptions"]["Quantiser"],
+			fs["FilePaths"]["VocabularyTree"],
+			fs["BOWOptions"]["TreeBranching"],
+			fs["FrameOptions"]["NumThreads"],
+			fs["FrameOptions"]["BatchFrames"]);
 
 	} else if (function == "TrainChowLiuTree") {
 		result = trainChowLiuTree(fs["FilePaths"]["ChowLiuTree"],
 			fs["FilePaths"]["TrainImagDesc"],
-			fs["ChowLiuOptions"]["LowerInfoBound"]);
+			fs["FilePaths"]["ChowLiuStatistics"],
+			fs["ChowLiuOptions"]["LowerInfoBound"],
+			fs["ChowLiuOptions"]["NumThreads"],
+			fs["ChowLiuOptions"]["MaxPartners"]);
+
+	} else if (function == "TrainFromVideo") {
+		result = trainFromVideo(fs);
+
+	} else if (function == "RenumberWords") {
+		result = renumberWords(fs["FilePaths"]["Vocabulary"],
+			fs["FilePaths"]["ChowLiuTree"],
+			fs["FilePaths"]["TrainImagDesc"],
+			fs["FilePaths"]["TestImageDesc"],
+			fs["FilePaths"]["ChowLiuStatistics"],
+			fs["FilePaths"]["VocabularyTree"],
+			fs["FilePaths"]["CompiledModel"],
+			fs["ChowLiuOptions"]["MaxPartners"],
+			fs["ChowLiuOptions"]["WordOrder"]);
 
 	} else if (function == "GenerateFABMAPTestData") {
 		result = generateBOWImageDescs(fs["FilePaths"]["TestPath"],
 			fs["FilePaths"]["TestImageDesc"],
-			fs["FilePaths"]["Vocabulary"], detector, extractor,
-			fs["BOWOptions"]["MinWords"]);
+			fs["FilePaths"]["Vocabulary"], fs,
+			fs["FilePaths"]["FeatureCache"],
+			fs["FeatureOptions"],
+			fs["BOWOptions"]["MinWords"],
+			fs["BOWOptions"]["Quantiser"],
+			fs["FilePaths"]["VocabularyTree"],
+			fs["BOWOptions"]["TreeBranching"],
+			fs["FrameOptions"]["NumThreads"],
+			fs["FrameOptions"]["BatchFrames"]);
+
+	} else if (function == "CompileFabMapModel") {
+		result = compileFabMapModel(fs["FilePaths"]["CompiledModel"],
+			fs["FilePaths"]["ChowLiuTree"], fs);
 
 	} else if (function == "RunOpenFABMAP") {
 		std::string placeAddOption = fs["FabMapPlaceAddition"];
@@ -254,8 +503,12 @@ generate the data needed to train a codebook/vocabulary for bag-of-words methods
 */
 int generateVocabTrainData(std::string trainPath,
 						   std::string vocabTrainDataPath,
-						   cv::Ptr<cv::FeatureDetector> &detector,
-						   cv::Ptr<cv::DescriptorExtractor> &extractor)
+						   cv::FileStorage &settings,
+						   std::string featureCachePath,
+						   const cv::FileNode &featureOptions,
+						   int numThreads,
+						   int batchFrames,
+						   bool headless)
 {
 
 	//Do not overwrite any files
@@ -268,10 +521,9 @@ int generateVocabTrainData(std::string trainPath,
 		return -1;
 	}
 
-	//load training movie
-	cv::VideoCapture movie;
-	movie.open(trainPath);
-	if (!movie.isOpened()) {
+	//load training movie, or its cached features
+	FeatureSource features(settings, numThreads, batchFrames);
+	if (!features.open(trainPath, featureCachePath, featureOptions)) {
 		std::cerr << trainPath << ": training movie not found" << std::endl;
 		return -1;
 	}
@@ -279,30 +531,34 @@ int generateVocabTrainData(std::string trainPath,
 	//extract data
 	std::cout << "Extracting Descriptors" << std::endl;
 	cv::Mat vocabTrainData;
-	cv::Mat frame, descs, feats;
-	std::vector<cv::KeyPoint> kpts;
+	cv::Mat feats;
 	
 	std::cout.setf(std::ios_base::fixed); 
 	std::cout.precision(0);
 	
-	while(movie.read(frame)) {
-
-		//detect & extract features
-		detector->detect(frame, kpts);
-		extractor->compute(frame, kpts, descs);
-
-		//add all descriptors to the training data 
-		vocabTrainData.push_back(descs);
+	//frames are detected & extracted in parallel. Cached features have
+	//no frames to show
+	bool shown = false;
+	while(features.next()) {
+
+		//add all descriptors to the training data, in frame order
+		for (size_t i = 0; i < features.size(); i++) {
+			vocabTrainData.push_back(features.descriptors(i));
+		}
 
 		//show progress
-		cv::drawKeypoints(frame, kpts, feats);
-		cv::imshow("Training Data", feats);
-		
-		std::cout << 100.0*(movie.get(CV_CAP_PROP_POS_FRAMES) / 
-			movie.get(CV_CAP_PROP_FRAME_COUNT)) << "%. " << 
+		std::cout << features.progress() << "%. " << 
 			vocabTrainData.rows << " descriptors         \r";
 		fflush(stdout); 
 		
+		size_t last = features.size() - 1;
+		if (headless || features.frame(last).empty()) {
+			continue;
+		}
+		shown = true;
+		cv::drawKeypoints(features.frame(last), features.keypoints(last),
+			feats);
+		cv::imshow("Training Data", feats);
 		if(cv::waitKey(5) == 27) {
 			cv::destroyWindow("Training Data");
 			std::cout << std::endl;
@@ -310,14 +566,13 @@ int generateVocabTrainData(std::string trainPath,
 		}
 
 	}
-	cv::destroyWindow("Training Data");
+	if (shown) {
+		cv::destroyWindow("Training Data");
+	}
 	std::cout << "Done: " << vocabTrainData.rows << " Descriptors" << std::endl;
 
 	//save the training data
-	cv::FileStorage fs;	
-	fs.open(vocabTrainDataPath, cv::FileStorage::WRITE);
-	fs << "VocabTrainData" << vocabTrainData;
-	fs.release();
+	saveMatrix(vocabTrainDataPath, "VocabTrainData", vocabTrainData);
 
 	return 0;
 }
@@ -327,7 +582,10 @@ use training data to build a codebook/vocabulary
 */
 int trainVocabulary(std::string vocabPath,
 					std::string vocabTrainDataPath,
-					double clusterRadius)
+					double clusterRadius,
+					double binaryClusterRadius,
+					int pcaDims,
+					int numThreads)
 {
 
 	//ensure not overwriting a vocabulary
@@ -340,33 +598,47 @@ int trainVocabulary(std::string vocabPath,
 		return -1;
 	}
 
-	std::cout << "Loading vocabulary training data" << std::endl;
-	
-	cv::FileStorage fs;	
+	cv::Mat vocab;
 
-	//load in vocab training data
-	fs.open(vocabTrainDataPath, cv::FileStorage::READ);
-	cv::Mat vocabTrainData;
-	fs["VocabTrainData"] >> vocabTrainData;
-	if (vocabTrainData.empty()) {
-		std::cerr << vocabTrainDataPath << ": Training Data not found" <<
-			std::endl;
-		return -1;
-	}
-	fs.release();
+	//the vocab training data is streamed rather than loaded. Compressed
+	//files and binary descriptors cannot be streamed and are loaded whole
+	of2::PCAProjection projection;
+	of2::BOWDescriptorReader vocabTrainData(vocabTrainDataPath,
+		"VocabTrainData");
+	if (vocabTrainData.isOpened()) {
+		//the projection is learned in one pass over the data, and each
+		//chunk is projected as it is clustered
+		if (pcaDims > 0) {
+			std::cout << "Learning descriptor projection" << std::endl;
+			projection.train(vocabTrainData, pcaDims);
+		}
 
-	std::cout << "Performing clustering" << std::endl;
+		//uses Modified Sequential Clustering to train a vocabulary
+		of2::BOWMSCTrainer trainer(clusterRadius, numThreads);
+		std::cout << "Performing clustering" << std::endl;
+		vocab = trainer.cluster(vocabTrainData, projection);
+	} else {
+		std::cout << "Loading vocabulary training data" << std::endl;
+
+		//load in vocab training data
+		cv::Mat vocabTrainMat = loadMatrix(vocabTrainDataPath,
+			"VocabTrainData");
+		if (vocabTrainMat.empty()) {
+			std::cerr << vocabTrainDataPath << ": Training Data not found" <<
+				std::endl;
+			return -1;
+		}
 
-	//uses Modified Sequential Clustering to train a vocabulary
-	of2::BOWMSCTrainer trainer(clusterRadius);
-	trainer.add(vocabTrainData);
-	cv::Mat vocab = trainer.cluster();
+		std::vector<cv::Mat> batches(1, vocabTrainMat);
+		if (clusterVocabulary(batches, clusterRadius, binaryClusterRadius,
+			pcaDims, numThreads, vocab, projection) < 0) {
+			return -1;
+		}
+	}
 
 	//save the vocabulary
 	std::cout << "Saving vocabulary" << std::endl;
-	fs.open(vocabPath, cv::FileStorage::WRITE);
-	fs << "Vocabulary" << vocab;
-	fs.release();
+	saveVocabulary(vocabPath, vocab, projection);
 
 	return 0;
 }
@@ -377,12 +649,16 @@ generate FabMap bag-of-words data : an image descriptor for each frame
 int generateBOWImageDescs(std::string dataPath,
 							std::string bowImageDescPath,
 							std::string vocabPath,
-							cv::Ptr<cv::FeatureDetector> &detector,
-							cv::Ptr<cv::DescriptorExtractor> &extractor,
-							int minWords)
+							cv::FileStorage &settings,
+							std::string featureCachePath,
+							const cv::FileNode &featureOptions,
+							int minWords,
+							std::string quantiser,
+							std::string vocabTreePath,
+							int treeBranching,
+							int numThreads,
+							int batchFrames)
 {
-	
-	cv::FileStorage fs;	
 
 	//ensure not overwriting training data
 	std::ifstream checker;
@@ -394,28 +670,41 @@ int generateBOWImageDescs(std::string dataPath,
 		return -1;
 	}
 
-	//load vocabulary
+	//load vocabulary. Descriptors are projected as the vocabulary
+	//training data was
 	std::cout << "Loading Vocabulary" << std::endl;
-	fs.open(vocabPath, cv::FileStorage::READ);
-	cv::Mat vocab;
-	fs["Vocabulary"] >> vocab;
+	of2::PCAProjection projection;
+	cv::Mat vocab = loadVocabulary(vocabPath, projection);
 	if (vocab.empty()) {
 		std::cerr << vocabPath << ": Vocabulary not found" << std::endl;
 		return -1;
 	}
-	fs.release();
 
-	//use a FLANN matcher to generate bag-of-words representations
+	//use a FLANN matcher to generate bag-of-words representations, or a
+	//brute force hamming matcher for binary words
 	cv::Ptr<cv::DescriptorMatcher> matcher = 
-		cv::DescriptorMatcher::create("FlannBased");
-	cv::BOWImgDescriptorExtractor bide(extractor, matcher);
-	bide.setVocabulary(vocab);
+		cv::DescriptorMatcher::create(vocab.type() == CV_8U ?
+		"BruteForce-Hamming" : "FlannBased");
+	matcher->add(std::vector<cv::Mat>(1, vocab));
+	//trained up front, as the frames are matched on several threads
+	matcher->train();
+
+	//or a vocabulary tree, loaded if present and built otherwise
+	of2::VocabularyTree vocabTree;
+	if (loadVocabularyTree(vocabTree, vocab, quantiser, vocabTreePath,
+		treeBranching) < 0) {
+		return -1;
+	}
 
-	//load movie
-	cv::VideoCapture movie;
-	movie.open(dataPath);
+	//or an exact search of every word
+	of2::BOWQuantiser exactQuantiser;
+	if (quantiser == "Exact") {
+		exactQuantiser.setVocabulary(vocab);
+	}
 
-	if(!movie.isOpened()) {
+	//load movie, or its cached features
+	FeatureSource features(settings, numThreads, batchFrames);
+	if (!features.open(dataPath, featureCachePath, featureOptions)) {
 		std::cerr << dataPath << ": movie not found" << std::endl;
 		return -1;
 	}
@@ -432,53 +721,51 @@ int generateBOWImageDescs(std::string dataPath,
 		maskw.open(std::string(bowImageDescPath + "mask.txt").c_str());
 	}
 
-	cv::Mat frame, bow;
-	std::vector<cv::KeyPoint> kpts;
+	//frames are detected, extracted and quantised in parallel
+	BOWStage stage(matcher, vocab.rows, projection, vocabTree,
+		exactQuantiser);
+	std::vector<cv::Mat> bows;
 	
-	while(movie.read(frame)) {
-		detector->detect(frame, kpts);
-		bide.compute(frame, kpts, bow);
+	while(features.next()) {
 
-		if(minWords) {
-			//writing a mask file
-			if(cv::countNonZero(bow) < minWords) {
-				//frame masked
-				maskw << "0" << std::endl;
-			} else {
-				//frame accepted
-				maskw << "1" << std::endl;
-				fabmapTrainData.push_back(bow);
-			}
-		} else {
-			fabmapTrainData.push_back(bow);
+		int nFrames = (int)features.size();
+		bows.resize(nFrames);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+		for (int i = 0; i < nFrames; i++) {
+			stage.compute(features.descriptors(i), bows[i]);
+		}
+
+		//the results are written in frame order
+		for (int i = 0; i < nFrames; i++) {
+			addBOWImageDesc(bows[i], minWords, fabmapTrainData, maskw);
 		}
 		
-		std::cout << 100.0 * (movie.get(CV_CAP_PROP_POS_FRAMES) / 
-			movie.get(CV_CAP_PROP_FRAME_COUNT)) << "%    \r";
+		std::cout << features.progress() << "%    \r";
 		fflush(stdout); 
 	}
 	std::cout << "Done                                       " << std::endl;
-	
-	movie.release();
 
-	//save training data
-	fs.open(bowImageDescPath, cv::FileStorage::WRITE);
-	fs << "BOWImageDescs" << fabmapTrainData;
-	fs.release();
+	//save training data, storing only the words present in binary files
+	saveMatrix(bowImageDescPath, "BOWImageDescs", fabmapTrainData, true);
 
 	return 0;	
 }
 
 /*
-generate a Chow-Liu tree from FabMap Training data
+generate a Chow-Liu tree from FabMap Training data. If a statistics file is
+given the training data is added to the statistics of earlier batches, and
+the tree is made from all of them
 */
 int trainChowLiuTree(std::string chowliutreePath,
 					 std::string fabmapTrainDataPath,
-					 double lowerInformationBound)
+					 std::string chowliuStatisticsPath,
+					 double lowerInformationBound,
+					 int numThreads,
+					 int maxPartners)
 {
 
-	cv::FileStorage fs;	
-
 	//ensure not overwriting training data
 	std::ifstream checker;
 	checker.open(chowliutreePath.c_str());
@@ -489,34 +776,410 @@ int trainChowLiuTree(std::string chowliutreePath,
 		return -1;
 	}
 
+	of2::ChowLiuTree tree(maxPartners);
+	if (!chowliuStatisticsPath.empty()) {
+		checker.open(chowliuStatisticsPath.c_str());
+		if(checker.is_open()) {
+			checker.close();
+			std::cout << "Loading Chow-Liu Statistics" << std::endl;
+			if (!loadChowLiuStatistics(chowliuStatisticsPath, tree)) {
+				std::cerr << chowliuStatisticsPath << ": Chow-Liu Statistics "
+					"were counted with another MaxPartners, remove them to "
+					"start over" << std::endl;
+				return -1;
+			}
+		}
+	}
+
+	//the FabMap training data is streamed rather than loaded. Compressed
+	//files cannot be streamed and are loaded whole
+	of2::BOWDescriptorReader fabmapTrainData(fabmapTrainDataPath);
+	if (!fabmapTrainData.isOpened()) {
+		std::cout << "Loading FabMap Training Data" << std::endl;
+		cv::Mat fabmapTrainMat = loadMatrix(fabmapTrainDataPath,
+			"BOWImageDescs");
+		if (fabmapTrainMat.empty()) {
+			std::cerr << fabmapTrainDataPath << ": FabMap Training Data not "
+				"found" << std::endl;
+			return -1;
+		}
+		tree.add(fabmapTrainMat);
+	}
+
+	std::cout << "Counting FabMap Training Data" << std::endl;
+	tree.updateStatistics(fabmapTrainData, 1000, numThreads);
+
+	//generate the tree from the data
+	std::cout << "Making Chow-Liu Tree" << std::endl;
+	cv::Mat clTree = tree.make(lowerInformationBound, numThreads);
+
+	if (!chowliuStatisticsPath.empty()) {
+		std::cout << "Saving Chow-Liu Statistics" << std::endl;
+		saveChowLiuStatistics(chowliuStatisticsPath, tree);
+	}
+
+	//save the resulting tree
+	std::cout <<"Saving Chow-Liu Tree" << std::endl;
+	saveMatrix(chowliutreePath, "ChowLiuTree", clTree);
+
+	return 0;
+
+}
+
+/*
+trains the vocabulary, the FabMap training data and the Chow-Liu tree in one
+go, decoding the training video and extracting its features only once. The
+descriptors of every frame are kept in memory for the later stages
+*/
+int trainFromVideo(cv::FileStorage &settings)
+{
+	std::string trainPath = settings["FilePaths"]["TrainPath"];
+	std::string vocabPath = settings["FilePaths"]["Vocabulary"];
+	std::string bowImageDescPath = settings["FilePaths"]["TrainImagDesc"];
+	std::string chowliutreePath = settings["FilePaths"]["ChowLiuTree"];
+	int minWords = settings["BOWOptions"]["MinWords"];
+	bool headless = (int)settings["FrameOptions"]["Headless"] > 0;
+
+	//ensure not overwriting anything before the video is decoded
+	std::string outputs[] = {vocabPath, bowImageDescPath, chowliutreePath};
+	for (int i = 0; i < 3; i++) {
+		std::ifstream checker;
+		checker.open(outputs[i].c_str());
+		if(checker.is_open()) {
+			std::cerr << outputs[i] << ": already present" << std::endl;
+			checker.close();
+			return -1;
+		}
+	}
+
+	FeatureSource features(settings,
+		settings["FrameOptions"]["NumThreads"],
+		settings["FrameOptions"]["BatchFrames"]);
+	if (!features.open(trainPath, settings["FilePaths"]["FeatureCache"],
+		settings["FeatureOptions"])) {
+		std::cerr << trainPath << ": training movie not found" << std::endl;
+		return -1;
+	}
+
+	//detect & extract the features of each frame once
+	std::cout << "Extracting Descriptors" << std::endl;
+	std::cout.setf(std::ios_base::fixed);
+	std::cout.precision(0);
+	std::vector<cv::Mat> frameDescs;
+	size_t nDescs = 0;
+	bool shown = false;
+	while(features.next()) {
+		for (size_t i = 0; i < features.size(); i++) {
+			frameDescs.push_back(features.descriptors(i));
+			nDescs += features.descriptors(i).rows;
+		}
+		std::cout << features.progress() << "%. " << nDescs <<
+			" descriptors         \r";
+		fflush(stdout);
+
+		size_t last = features.size() - 1;
+		if (headless || features.frame(last).empty()) {
+			continue;
+		}
+		shown = true;
+		cv::Mat feats;
+		cv::drawKeypoints(features.frame(last), features.keypoints(last),
+			feats);
+		cv::imshow("Training Data", feats);
+		if(cv::waitKey(5) == 27) {
+			cv::destroyWindow("Training Data");
+			std::cout << std::endl;
+			return -1;
+		}
+	}
+	if (shown) {
+		cv::destroyWindow("Training Data");
+	}
+	std::cout << "Done: " << nDescs << " Descriptors" << std::endl;
+
+	//frames without features take no part in the clustering
+	std::vector<cv::Mat> vocabTrainData;
+	for (size_t i = 0; i < frameDescs.size(); i++) {
+		if (!frameDescs[i].empty()) {
+			vocabTrainData.push_back(frameDescs[i]);
+		}
+	}
+	if (vocabTrainData.empty()) {
+		std::cerr << trainPath << ": no features found" << std::endl;
+		return -1;
+	}
+
+	cv::Mat vocab;
+	of2::PCAProjection projection;
+	if (clusterVocabulary(vocabTrainData,
+		settings["VocabTrainOptions"]["ClusterSize"],
+		settings["VocabTrainOptions"]["BinaryClusterSize"],
+		settings["VocabTrainOptions"]["PCADims"],
+		settings["VocabTrainOptions"]["NumThreads"],
+		vocab, projection) < 0) {
+		return -1;
+	}
+	//the projected descriptors replace those of each frame
+	for (size_t i = 0, j = 0; i < frameDescs.size(); i++) {
+		if (!frameDescs[i].empty()) {
+			frameDescs[i] = vocabTrainData[j++];
+		}
+	}
+	vocabTrainData.clear();
+
+	std::cout << "Saving vocabulary" << std::endl;
+	saveVocabulary(vocabPath, vocab, projection);
+
+	//quantise the cached descriptors as GenerateFABMAPTrainData would
+	cv::Ptr<cv::DescriptorMatcher> matcher =
+		cv::DescriptorMatcher::create(vocab.type() == CV_8U ?
+		"BruteForce-Hamming" : "FlannBased");
+	matcher->add(std::vector<cv::Mat>(1, vocab));
+	matcher->train();
+
+	std::string quantiser = settings["BOWOptions"]["Quantiser"];
+	of2::VocabularyTree vocabTree;
+	if (loadVocabularyTree(vocabTree, vocab, quantiser,
+		settings["FilePaths"]["VocabularyTree"],
+		settings["BOWOptions"]["TreeBranching"]) < 0) {
+		return -1;
+	}
+	of2::BOWQuantiser exactQuantiser;
+	if (quantiser == "Exact") {
+		exactQuantiser.setVocabulary(vocab);
+	}
+	BOWStage bowStage(matcher, vocab.rows, projection, vocabTree,
+		exactQuantiser);
+
+	std::cout << "Extracting Bag-of-words Image Descriptors" << std::endl;
+	std::vector<cv::Mat> bows(frameDescs.size());
+	int nFrames = (int)frameDescs.size();
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (int i = 0; i < nFrames; i++) {
+		bowStage.quantise(frameDescs[i], bows[i]);
+	}
+	frameDescs.clear();
+
+	std::ofstream maskw;
+	if(minWords) {
+		maskw.open(std::string(bowImageDescPath + "mask.txt").c_str());
+	}
+	cv::Mat fabmapTrainData;
+	for (size_t i = 0; i < bows.size(); i++) {
+		addBOWImageDesc(bows[i], minWords, fabmapTrainData, maskw);
+	}
+	bows.clear();
+
+	saveMatrix(bowImageDescPath, "BOWImageDescs", fabmapTrainData, true);
+
+	//the Chow-Liu tree reads back the FabMap training data just written
+	return trainChowLiuTree(chowliutreePath, bowImageDescPath,
+		settings["FilePaths"]["ChowLiuStatistics"],
+		settings["ChowLiuOptions"]["LowerInfoBound"],
+		settings["ChowLiuOptions"]["NumThreads"],
+		settings["ChowLiuOptions"]["MaxPartners"]);
+}
+
+
+/*
+renumber the vocabulary, Chow-Liu tree and FabMap training data into tree
+order so parent and child words are stored close together, along with the
+Chow-Liu statistics and vocabulary tree when present. This rewrites the
+files in place and must be run before generating the test data or
+compiling a model
+*/
+int renumberWords(std::string vocabPath,
+				  std::string chowliutreePath,
+				  std::string fabmapTrainDataPath,
+				  std::string fabmapTestDataPath,
+				  std::string chowliuStatisticsPath,
+				  std::string vocabTreePath,
+				  std::string modelPath,
+				  int maxPartners,
+				  std::string wordOrder)
+{
+
+	//test data quantised with the old numbering would no longer match
+	std::ifstream checker;
+	checker.open(fabmapTestDataPath.c_str());
+	if(checker.is_open()) {
+		std::cerr << fabmapTestDataPath << ": FabMap Testing Data already "
+			"present, renumber before generating it" << std::endl;
+		checker.close();
+		return -1;
+	}
+
+	//as would a model compiled from the old tree
+	if (!modelPath.empty()) {
+		checker.open(modelPath.c_str());
+		if(checker.is_open()) {
+			std::cerr << modelPath << ": Compiled Model already present, "
+				"remove it and compile again after renumbering" << std::endl;
+			checker.close();
+			return -1;
+		}
+	}
+
+	//load the chow-liu tree
+	std::cout << "Loading Chow-Liu Tree" << std::endl;
+	cv::Mat clTree = loadMatrix(chowliutreePath, "ChowLiuTree");
+	if (clTree.empty()) {
+		std::cerr << chowliutreePath << ": Chow-Liu tree not found" << 
+			std::endl;
+		return -1;
+	}
+	if (!loadMatrix(chowliutreePath, "WordOrder").empty()) {
+		std::cerr << chowliutreePath << ": words already renumbered" << 
+			std::endl;
+		return -1;
+	}
+
+	//load the vocabulary, keeping its projection
+	std::cout << "Loading Vocabulary" << std::endl;
+	of2::PCAProjection projection;
+	cv::Mat vocab = loadVocabulary(vocabPath, projection);
+	if (vocab.empty()) {
+		std::cerr << vocabPath << ": Vocabulary not found" << std::endl;
+		return -1;
+	}
+
 	//load FabMap training data
 	std::cout << "Loading FabMap Training Data" << std::endl;
-	fs.open(fabmapTrainDataPath, cv::FileStorage::READ);
-	cv::Mat fabmapTrainData;
-	fs["BOWImageDescs"] >> fabmapTrainData;
+	cv::Mat fabmapTrainData = loadMatrix(fabmapTrainDataPath,
+		"BOWImageDescs");
 	if (fabmapTrainData.empty()) {
 		std::cerr << fabmapTrainDataPath << ": FabMap Training Data not found" 
 			<< std::endl;
 		return -1;
 	}
-	fs.release();
 
-	//generate the tree from the data
-	std::cout << "Making Chow-Liu Tree" << std::endl;
-	of2::ChowLiuTree tree;
-	tree.add(fabmapTrainData);
-	cv::Mat clTree = tree.make(lowerInformationBound);
+	//the running statistics and the vocabulary tree, when present, are
+	//renumbered with the rest
+	cv::FileStorage fs;
+	of2::ChowLiuTree statistics(maxPartners);
+	bool hasStatistics = false;
+	if (!chowliuStatisticsPath.empty()) {
+		checker.open(chowliuStatisticsPath.c_str());
+		if(checker.is_open()) {
+			checker.close();
+			std::cout << "Loading Chow-Liu Statistics" << std::endl;
+			hasStatistics = loadChowLiuStatistics(chowliuStatisticsPath,
+				statistics);
+			if (!hasStatistics) {
+				std::cerr << chowliuStatisticsPath << ": Chow-Liu Statistics "
+					"were counted with another MaxPartners" << std::endl;
+				return -1;
+			}
+		}
+	}
 
-	//save the resulting tree
-	std::cout <<"Saving Chow-Liu Tree" << std::endl;
-	fs.open(chowliutreePath, cv::FileStorage::WRITE);
-	fs << "ChowLiuTree" << clTree;
-	fs.release();
+	of2::VocabularyTree vocabTree;
+	if (!vocabTreePath.empty()) {
+		checker.open(vocabTreePath.c_str());
+		if(checker.is_open()) {
+			checker.close();
+			std::cout << "Loading Vocabulary Tree" << std::endl;
+			fs.open(vocabTreePath, cv::FileStorage::READ);
+			vocabTree.read(fs.root());
+			fs.release();
+			if (!vocabTree.matches(vocab)) {
+				std::cerr << vocabTreePath << ": Vocabulary Tree was not "
+					"built over this vocabulary, remove it to build it again"
+					<< std::endl;
+				return -1;
+			}
+		}
+	}
 
-	return 0;
+	std::cout << "Renumbering words" << std::endl;
+	of2::WordOrder order(clTree, wordOrder == "DepthFirst" ? 
+		of2::WordOrder::DEPTH_FIRST : of2::WordOrder::BREADTH_FIRST);
+
+	std::cout << "Saving renumbered data" << std::endl;
+	saveVocabulary(vocabPath, order.permuteVocabulary(vocab), projection);
+	saveMatrix(fabmapTrainDataPath, "BOWImageDescs",
+		order.permuteImgDescriptors(fabmapTrainData), true);
+
+	if (isBinaryPath(chowliutreePath)) {
+		of2::MatrixFile file(chowliutreePath, of2::MatrixFile::WRITE);
+		file.write("ChowLiuTree", order.permuteTree(clTree));
+		order.write(file);
+	} else {
+		fs.open(chowliutreePath, cv::FileStorage::WRITE);
+		fs << "ChowLiuTree" << order.permuteTree(clTree);
+		order.write(fs);
+		fs.release();
+	}
+
+	if (hasStatistics) {
+		statistics.permuteWords(order);
+		saveChowLiuStatistics(chowliuStatisticsPath, statistics);
+	}
+
+	if (!vocabTree.empty()) {
+		vocabTree.permuteWords(order);
+		fs.open(vocabTreePath, cv::FileStorage::WRITE);
+		vocabTree.write(fs);
+		fs.release();
+	}
 
+	return 0;
 }
 
+/*
+precompute the tables of every FabMap version into a binary model file that
+can be memory mapped when running FabMap
+*/
+int compileFabMapModel(std::string modelPath,
+					   std::string chowliutreePath,
+					   cv::FileStorage &settings)
+{
+
+	if (modelPath.empty()) {
+		std::cerr << "No CompiledModel path in the settings file" <<
+			std::endl;
+		return -1;
+	}
+
+	//ensure not overwriting a model
+	std::ifstream checker;
+	checker.open(modelPath.c_str());
+	if(checker.is_open()) {
+		std::cerr << modelPath << ": Compiled model already present" << 
+			std::endl;
+		checker.close();
+		return -1;
+	}
+
+	//load the chow-liu tree
+	std::cout << "Loading Chow-Liu Tree" << std::endl;
+	cv::Mat clTree = loadMatrix(chowliutreePath, "ChowLiuTree");
+	if (clTree.empty()) {
+		std::cerr << chowliutreePath << ": Chow-Liu tree not found" << 
+			std::endl;
+		return -1;
+	}
+
+	int tableType = generateLUTTableType(settings);
+	if (tableType < 0) {
+		return -1;
+	}
+
+	std::cout << "Compiling FabMap model" << std::endl;
+	of2::FabMapModel model(clTree,
+		settings["openFabMapOptions"]["PzGe"],
+		settings["openFabMapOptions"]["PzGne"],
+		generateFABMAPOptions(settings),
+		settings["openFabMapOptions"]["FabMapLUT"]["Precision"],
+		tableType);
+
+	std::cout << "Saving compiled model" << std::endl;
+	model.save(modelPath);
+
+	return 0;
+}
 
 /*
 Run FabMap on a test dataset
@@ -528,8 +1191,6 @@ int openFABMAP(std::string testPath,
 			   bool addNewOnly)
 {
 
-	cv::FileStorage fs;	
-
 	//ensure not overwriting results
 	std::ifstream checker;
 	checker.open(resultsPath.c_str());
@@ -541,24 +1202,19 @@ int openFABMAP(std::string testPath,
 
 	//load the vocabulary
 	std::cout << "Loading Vocabulary" << std::endl;
-	fs.open(vocabPath, cv::FileStorage::READ);
-	cv::Mat vocab;
-	fs["Vocabulary"] >> vocab;
+	of2::PCAProjection projection;
+	cv::Mat vocab = loadVocabulary(vocabPath, projection);
 	if (vocab.empty()) {
 		std::cerr << vocabPath << ": Vocabulary not found" << std::endl;
 		return -1;
 	}
-	fs.release();
 
 	//load the test data
-	fs.open(testPath, cv::FileStorage::READ);
-	cv::Mat testImageDescs;
-	fs["BOWImageDescs"] >> testImageDescs;
+	cv::Mat testImageDescs = loadMatrix(testPath, "BOWImageDescs");
 	if(testImageDescs.empty()) {
 		std::cerr << testPath << ": Test data not found" << std::endl;
 		return -1;
 	}
-	fs.release();
 
 	//running openFABMAP
 	std::cout << "Running openFABMAP" << std::endl;
@@ -700,6 +1356,18 @@ cv::Ptr<cv::FeatureDetector> generateDetector(cv::FileStorage &fs) {
 			detector = new cv::SiftFeatureDetector(
 				fs["FeatureOptions"]["SiftDetector"]["ContrastThreshold"],
 				fs["FeatureOptions"]["SiftDetector"]["EdgeThreshold"]);
+#endif
+		} else if(detectorType == "ORB") {
+#ifdef OPENCV2P4
+			detector = new cv::ORB(
+				fs["FeatureOptions"]["OrbDetector"]["NumFeatures"],
+				(float)fs["FeatureOptions"]["OrbDetector"]["ScaleFactor"],
+				fs["FeatureOptions"]["OrbDetector"]["NumLevels"],
+				fs["FeatureOptions"]["OrbDetector"]["EdgeThreshold"],
+				0, 2, cv::ORB::HARRIS_SCORE,
+				fs["FeatureOptions"]["OrbDetector"]["PatchSize"]);
+#else
+			detector = cv::FeatureDetector::create("ORB");
 #endif
 		} else if(detectorType == "MSER") {
 
@@ -764,8 +1432,27 @@ cv::Ptr<cv::DescriptorExtractor> generateExtractor(cv::FileStorage &fs)
 			(int)fs["FeatureOptions"]["SurfDetector"]["Upright"] > 0);
 #endif
 
-	} else {
-		std::cerr << "Could not create Descriptor Extractor. Please specify "
+	} else if(extractorType == "ORB") {
+
+#ifdef OPENCV2P4
+		extractor = new cv::ORB(
+			fs["FeatureOptions"]["OrbDetector"]["NumFeatures"],
+			(float)fs["FeatureOptions"]["OrbDetector"]["ScaleFactor"],
+			fs["FeatureOptions"]["OrbDetector"]["NumLevels"],
+			fs["FeatureOptions"]["OrbDetector"]["EdgeThreshold"],
+			0, 2, cv::ORB::HARRIS_SCORE,
+			fs["FeatureOptions"]["OrbDetector"]["PatchSize"]);
+#else
+		extractor = cv::DescriptorExtractor::create("ORB");
+#endif
+
+	} else if(extractorType == "BRIEF") {
+
+		extractor = new cv::BriefDescriptorExtractor(
+			fs["FeatureOptions"]["BriefExtractor"]["Bytes"]);
+
+	} else {
+		std::cerr << "Could not create Descriptor Extractor. Please specify "
 			"extractor type in settings file" << std::endl;
 	}
 
@@ -781,40 +1468,150 @@ create an instance of a FabMap class with the options given in the settings file
 of2::FabMap *generateFABMAPInstance(cv::FileStorage &settings)
 {
 
-	cv::FileStorage fs;
-
 	//load FabMap training data
 	std::string fabmapTrainDataPath = settings["FilePaths"]["TrainImagDesc"];
 	std::string chowliutreePath = settings["FilePaths"]["ChowLiuTree"];
 
 	std::cout << "Loading FabMap Training Data" << std::endl;
-	fs.open(fabmapTrainDataPath, cv::FileStorage::READ);
-	cv::Mat fabmapTrainData;
-	fs["BOWImageDescs"] >> fabmapTrainData;
+	cv::Mat fabmapTrainData = loadMatrix(fabmapTrainDataPath,
+		"BOWImageDescs");
 	if (fabmapTrainData.empty()) {
 		std::cerr << fabmapTrainDataPath << ": FabMap Training Data not found" 
 			<< std::endl;
 		return NULL;
 	}
-	fs.release();
 
-	//load a chow-liu tree
+	//use a compiled model if one is given, otherwise the chow-liu tree
+	cv::Ptr<of2::FabMapModel> model;
+	std::string modelPath = settings["FilePaths"]["CompiledModel"];
 	std::cout << "Loading Chow-Liu Tree" << std::endl;
-	fs.open(chowliutreePath, cv::FileStorage::READ);
-	cv::Mat clTree;
-	fs["ChowLiuTree"] >> clTree;
-	if (clTree.empty()) {
+	cv::Mat clTree = loadMatrix(chowliutreePath, "ChowLiuTree");
+	if(!modelPath.empty()) {
+		std::ifstream checker;
+		checker.open(modelPath.c_str());
+		if(!checker.is_open()) {
+			std::cerr << modelPath << ": Compiled model not found, run "
+				"CompileFabMapModel or leave CompiledModel empty" << std::endl;
+			return NULL;
+		}
+		checker.close();
+		std::cout << "Mapping Compiled Model" << std::endl;
+		model = new of2::FabMapModel(modelPath);
+		if(!checkFabMapModel(*model, clTree, settings)) {
+			std::cerr << modelPath << ": Compiled model does not match, "
+				"run CompileFabMapModel again" << std::endl;
+			return NULL;
+		}
+		if(clTree.empty()) {
+			std::cout << chowliutreePath << ": Chow-Liu tree not found, "
+				"the compiled model could not be checked against it" <<
+				std::endl;
+		}
+	} else if (clTree.empty()) {
 		std::cerr << chowliutreePath << ": Chow-Liu tree not found" << 
 			std::endl;
 		return NULL;
 	}
-	fs.release();
 
 	//create options flags
+	int options = generateFABMAPOptions(settings);
+
+	of2::FabMap *fabmap;
+
+	//create an instance of the desired type of FabMap
+	std::string fabMapVersion = settings["openFabMapOptions"]["FabMapVersion"];
+	if(fabMapVersion == "FABMAP1") {
+		if(!model.empty()) {
+			fabmap = new of2::FabMap1(model, options,
+				settings["openFabMapOptions"]["NumSamples"]);
+		} else {
+			fabmap = new of2::FabMap1(clTree, 
+				settings["openFabMapOptions"]["PzGe"],
+				settings["openFabMapOptions"]["PzGne"],
+				options,
+				settings["openFabMapOptions"]["NumSamples"]);
+		}
+	} else if(fabMapVersion == "FABMAPLUT") {
+		if(!model.empty()) {
+			fabmap = new of2::FabMapLUT(model, options,
+				settings["openFabMapOptions"]["NumSamples"]);
+		} else {
+			int tableType = generateLUTTableType(settings);
+			if(tableType < 0) {
+				return NULL;
+			}
+			fabmap = new of2::FabMapLUT(clTree,
+				settings["openFabMapOptions"]["PzGe"],
+				settings["openFabMapOptions"]["PzGne"],
+				options,
+				settings["openFabMapOptions"]["NumSamples"],
+				settings["openFabMapOptions"]["FabMapLUT"]["Precision"],
+				tableType);
+		}
+	} else if(fabMapVersion == "FABMAPFBO") {
+		if(options & of2::FabMap::INCREMENTAL) {
+			std::cerr << "Incremental scoring is not available with "
+				"FABMAPFBO, set Incremental to 0 in the settings file" <<
+				std::endl;
+			return NULL;
+		}
+		if(!model.empty()) {
+			fabmap = new of2::FabMapFBO(model, options,
+				settings["openFabMapOptions"]["NumSamples"],
+				settings["openFabMapOptions"]["FabMapFBO"]["RejectionThreshold"],
+				settings["openFabMapOptions"]["FabMapFBO"]["PsGd"],
+				settings["openFabMapOptions"]["FabMapFBO"]["BisectionStart"],
+				settings["openFabMapOptions"]["FabMapFBO"]["BisectionIts"]);
+		} else {
+			fabmap = new of2::FabMapFBO(clTree, 
+				settings["openFabMapOptions"]["PzGe"],
+				settings["openFabMapOptions"]["PzGne"],
+				options,
+				settings["openFabMapOptions"]["NumSamples"],
+				settings["openFabMapOptions"]["FabMapFBO"]["RejectionThreshold"],
+				settings["openFabMapOptions"]["FabMapFBO"]["PsGd"],
+				settings["openFabMapOptions"]["FabMapFBO"]["BisectionStart"],
+				settings["openFabMapOptions"]["FabMapFBO"]["BisectionIts"]);
+		}
+	} else if(fabMapVersion == "FABMAP2") {
+		if(!model.empty()) {
+			fabmap = new of2::FabMap2(model, options);
+		} else {
+			fabmap = new of2::FabMap2(clTree, 
+				settings["openFabMapOptions"]["PzGe"],
+				settings["openFabMapOptions"]["PzGne"],
+				options);
+		}
+	} else {
+		std::cerr << "Could not identify openFABMAPVersion from settings"
+			" file" << std::endl;
+		return NULL;
+	}
+
+	if(!settings["openFabMapOptions"]["IncrementalThreshold"].empty()) {
+		fabmap->setIncrementalThreshold(
+			settings["openFabMapOptions"]["IncrementalThreshold"]);
+	}
+
+	//add the training data for use with the sampling method
+	fabmap->addTraining(fabmapTrainData);
+
+	return fabmap;
+
+}
+
+
+
+/*
+creates the FabMap options flags from the settings file
+*/
+int generateFABMAPOptions(cv::FileStorage &settings)
+{
 	std::string newPlaceMethod = 
 		settings["openFabMapOptions"]["NewPlaceMethod"];
 	std::string bayesMethod = settings["openFabMapOptions"]["BayesMethod"];
 	int simpleMotionModel = settings["openFabMapOptions"]["SimpleMotion"];
+	int incremental = settings["openFabMapOptions"]["Incremental"];
 	int options = 0;
 	if(newPlaceMethod == "Sampled") {
 		options |= of2::FabMap::SAMPLED;
@@ -829,53 +1626,705 @@ of2::FabMap *generateFABMAPInstance(cv::FileStorage &settings)
 	if(simpleMotionModel) {
 		options |= of2::FabMap::MOTION_MODEL;
 	}
+	if(incremental) {
+		options |= of2::FabMap::INCREMENTAL;
+	}
+	return options;
+}
 
-	of2::FabMap *fabmap;
+/*
+the storage type of the FabMapLUT look-up-table given in the settings file,
+int32 if none is given and -1 if the type is not recognised
+*/
+int generateLUTTableType(cv::FileStorage &settings)
+{
+	std::string tableTypeName = 
+		settings["openFabMapOptions"]["FabMapLUT"]["TableType"];
+	int tableType = -1;
+	if(tableTypeName.empty() || tableTypeName == "int32") {
+		tableType = CV_32S;
+	} else if(tableTypeName == "float32") {
+		tableType = CV_32F;
+	} else if(tableTypeName == "int16") {
+		tableType = CV_16S;
+	} else if(tableTypeName == "int8") {
+		tableType = CV_8S;
+	} else {
+		std::cerr << tableTypeName << ": Could not identify FabMapLUT "
+			"TableType from settings file" << std::endl;
+	}
+	return tableType;
+}
 
-	//create an instance of the desired type of FabMap
+/*
+whether a compiled model was made from the given Chow-Liu tree, unless it is
+empty, and with the detector model, Bayes method and look-up-table of the
+settings file. Each difference is reported
+*/
+bool checkFabMapModel(const of2::FabMapModel &model, const cv::Mat &clTree,
+					  cv::FileStorage &settings)
+{
+	bool matches = true;
+	if(!clTree.empty() && !model.matchesTree(clTree)) {
+		std::cerr << "The Chow-Liu tree has changed since the model was "
+			"compiled" << std::endl;
+		matches = false;
+	}
+	if(model.getPzGe() != (double)settings["openFabMapOptions"]["PzGe"] ||
+		model.getPzGNe() != (double)settings["openFabMapOptions"]["PzGne"]) {
+		std::cerr << "The model was compiled with PzGe " << model.getPzGe() <<
+			" and PzGne " << model.getPzGNe() << std::endl;
+		matches = false;
+	}
+	int bayesFlags = of2::FabMap::NAIVE_BAYES | of2::FabMap::CHOW_LIU;
+	if((model.getFlags() & bayesFlags) !=
+		(generateFABMAPOptions(settings) & bayesFlags)) {
+		std::cerr << "The model was compiled with a different BayesMethod" <<
+			std::endl;
+		matches = false;
+	}
 	std::string fabMapVersion = settings["openFabMapOptions"]["FabMapVersion"];
-	if(fabMapVersion == "FABMAP1") {
-		fabmap = new of2::FabMap1(clTree, 
-			settings["openFabMapOptions"]["PzGe"],
-			settings["openFabMapOptions"]["PzGne"],
-			options,
-			settings["openFabMapOptions"]["NumSamples"]);
-	} else if(fabMapVersion == "FABMAPLUT") {
-		fabmap = new of2::FabMapLUT(clTree,
-			settings["openFabMapOptions"]["PzGe"],
-			settings["openFabMapOptions"]["PzGne"],
-			options,
-			settings["openFabMapOptions"]["NumSamples"],
-			settings["openFabMapOptions"]["FabMapLUT"]["Precision"]);
-	} else if(fabMapVersion == "FABMAPFBO") {
-		fabmap = new of2::FabMapFBO(clTree, 
-			settings["openFabMapOptions"]["PzGe"],
-			settings["openFabMapOptions"]["PzGne"],
-			options,
-			settings["openFabMapOptions"]["NumSamples"],
-			settings["openFabMapOptions"]["FabMapFBO"]["RejectionThreshold"],
-			settings["openFabMapOptions"]["FabMapFBO"]["PsGd"],
-			settings["openFabMapOptions"]["FabMapFBO"]["BisectionStart"],
-			settings["openFabMapOptions"]["FabMapFBO"]["BisectionIts"]);
-	} else if(fabMapVersion == "FABMAP2") {
-		fabmap = new of2::FabMap2(clTree, 
-			settings["openFabMapOptions"]["PzGe"],
-			settings["openFabMapOptions"]["PzGne"],
-			options);
+	if(fabMapVersion == "FABMAPLUT" && (model.getLUTPrecision() !=
+		(int)settings["openFabMapOptions"]["FabMapLUT"]["Precision"] ||
+		model.getLUTTableType() != generateLUTTableType(settings))) {
+		std::cerr << "The model was compiled with a different FabMapLUT "
+			"Precision or TableType" << std::endl;
+		matches = false;
+	}
+	return matches;
+}
+
+/*
+clusters batches of descriptors into a vocabulary as if they were one. With
+pcaDims > 0 a projection is first learned from the descriptors, and the
+batches are replaced by their projections before clustering
+*/
+int clusterVocabulary(std::vector<cv::Mat> &descriptors,
+					  double clusterRadius,
+					  double binaryClusterRadius,
+					  int pcaDims,
+					  int numThreads,
+					  cv::Mat &vocab,
+					  of2::PCAProjection &projection)
+{
+	bool binary = descriptors[0].type() == CV_8U;
+	if (pcaDims > 0) {
+		if (binary) {
+			std::cerr << "Binary descriptors cannot be projected" <<
+				std::endl;
+			return -1;
+		}
+		std::cout << "Learning descriptor projection" << std::endl;
+		projection.train(descriptors, pcaDims);
+		for (size_t i = 0; i < descriptors.size(); i++) {
+			cv::Mat projected;
+			projection.project(descriptors[i], projected);
+			descriptors[i] = projected;
+		}
+	}
+
+	//binary descriptors are clustered by hamming distance
+	of2::BOWMSCTrainer trainer(binary ? binaryClusterRadius : clusterRadius,
+		numThreads);
+	std::cout << "Performing clustering" << std::endl;
+	vocab = trainer.cluster(descriptors);
+	return 0;
+}
+
+/*
+the vocabulary tree when it is the chosen quantiser, loaded if present and
+built and saved otherwise
+*/
+int loadVocabularyTree(of2::VocabularyTree &vocabTree,
+					   const cv::Mat &vocab,
+					   std::string quantiser,
+					   std::string vocabTreePath,
+					   int treeBranching)
+{
+	if (quantiser != "VocabularyTree") {
+		return 0;
+	}
+	if (vocab.type() == CV_8U) {
+		std::cerr << "A Vocabulary Tree cannot be built over binary words"
+			<< std::endl;
+		return -1;
+	}
+
+	cv::FileStorage fs;
+	std::ifstream checker;
+	checker.open(vocabTreePath.c_str());
+	if (checker.is_open()) {
+		checker.close();
+		std::cout << "Loading Vocabulary Tree" << std::endl;
+		fs.open(vocabTreePath, cv::FileStorage::READ);
+		vocabTree.read(fs.root());
+		fs.release();
+		if (!vocabTree.matches(vocab)) {
+			std::cerr << vocabTreePath << ": Vocabulary Tree was not built "
+				"over this vocabulary, remove it to build it again" <<
+				std::endl;
+			return -1;
+		}
 	} else {
-		std::cerr << "Could not identify openFABMAPVersion from settings"
-			" file" << std::endl;
-		return NULL;
+		std::cout << "Building Vocabulary Tree" << std::endl;
+		vocabTree.build(vocab, treeBranching > 1 ? treeBranching : 10);
+		if (!vocabTreePath.empty()) {
+			fs.open(vocabTreePath, cv::FileStorage::WRITE);
+			vocabTree.write(fs);
+			fs.release();
+		}
 	}
+	return 0;
+}
 
-	//add the training data for use with the sampling method
-	fabmap->addTraining(fabmapTrainData);
+/*
+adds a frame's bag-of-words image descriptor to the FabMap data, unless it
+has fewer than minWords different words. With minWords set the mask file
+records which frames were kept
+*/
+void addBOWImageDesc(const cv::Mat &bow, int minWords,
+					 cv::Mat &fabmapTrainData, std::ofstream &maskw)
+{
+	if(minWords) {
+		//writing a mask file
+		if(cv::countNonZero(bow) < minWords) {
+			//frame masked
+			maskw << "0" << std::endl;
+		} else {
+			//frame accepted
+			maskw << "1" << std::endl;
+			fabmapTrainData.push_back(bow);
+		}
+	} else {
+		fabmapTrainData.push_back(bow);
+	}
+}
 
-	return fabmap;
+bool isBinaryPath(const std::string &path)
+{
+	return path.size() >= 4 && path.compare(path.size() - 4, 4, ".bin") == 0;
+}
+
+cv::Mat loadMatrix(const std::string &path, const std::string &name)
+{
+	cv::Mat mat;
+	if (of2::MatrixFile::isMatrixFile(path)) {
+		of2::MatrixFile file(path, of2::MatrixFile::READ);
+		file.read(name, mat);
+	} else {
+		cv::FileStorage fs(path, cv::FileStorage::READ);
+		if (fs.isOpened()) {
+			fs[name] >> mat;
+		}
+	}
+	return mat;
+}
+
+void saveMatrix(const std::string &path, const std::string &name,
+				const cv::Mat &mat, bool sparse)
+{
+	if (isBinaryPath(path)) {
+		of2::MatrixFile file(path, of2::MatrixFile::WRITE);
+		file.write(name, mat, sparse);
+	} else {
+		cv::FileStorage fs(path, cv::FileStorage::WRITE);
+		fs << name << mat;
+	}
+}
+
+/*
+the projection is stored with the vocabulary it was trained with
+*/
+cv::Mat loadVocabulary(const std::string &vocabPath,
+					   of2::PCAProjection &projection)
+{
+	cv::Mat vocab;
+	if (of2::MatrixFile::isMatrixFile(vocabPath)) {
+		of2::MatrixFile file(vocabPath, of2::MatrixFile::READ);
+		file.read("Vocabulary", vocab);
+		projection.read(file);
+	} else {
+		cv::FileStorage fs(vocabPath, cv::FileStorage::READ);
+		if (fs.isOpened()) {
+			fs["Vocabulary"] >> vocab;
+			projection.read(fs.root());
+		}
+	}
+	return vocab;
+}
+
+void saveVocabulary(const std::string &vocabPath, const cv::Mat &vocab,
+					const of2::PCAProjection &projection)
+{
+	if (isBinaryPath(vocabPath)) {
+		of2::MatrixFile file(vocabPath, of2::MatrixFile::WRITE);
+		file.write("Vocabulary", vocab);
+		if (!projection.empty()) {
+			projection.write(file);
+		}
+	} else {
+		cv::FileStorage fs(vocabPath, cv::FileStorage::WRITE);
+		fs << "Vocabulary" << vocab;
+		if (!projection.empty()) {
+			projection.write(fs);
+		}
+	}
+}
+
+/*
+false if the statistics were counted with another MaxPartners than the tree
+*/
+bool loadChowLiuStatistics(const std::string &statisticsPath,
+						   of2::ChowLiuTree &tree)
+{
+	if (of2::MatrixFile::isMatrixFile(statisticsPath)) {
+		of2::MatrixFile file(statisticsPath, of2::MatrixFile::READ);
+		return tree.read(file);
+	}
+	cv::FileStorage fs(statisticsPath, cv::FileStorage::READ);
+	return tree.read(fs.root());
+}
+
+void saveChowLiuStatistics(const std::string &statisticsPath,
+						   const of2::ChowLiuTree &tree)
+{
+	if (isBinaryPath(statisticsPath)) {
+		of2::MatrixFile file(statisticsPath, of2::MatrixFile::WRITE);
+		tree.write(file);
+	} else {
+		cv::FileStorage fs(statisticsPath, cv::FileStorage::WRITE);
+		tree.write(fs);
+	}
+}
+
+FramePipeline::FramePipeline(cv::VideoCapture &_movie, int _numThreads,
+							 int _batchFrames) :
+	movie(_movie), numThreads(_numThreads), batchFrames(_batchFrames),
+	started(false)
+{
+#ifdef _OPENMP
+	if (numThreads <= 0) {
+		numThreads = omp_get_max_threads();
+	}
+#else
+	numThreads = 1;
+#endif
+	if (batchFrames <= 0) {
+		batchFrames = 4 * numThreads;
+	}
+}
+
+void FramePipeline::readBatch()
+{
+	//the capture decodes every frame into the same buffer, so each is
+	//copied out before the next is read
+	nextFrames.resize(batchFrames);
+	size_t n = 0;
+	cv::Mat frame;
+	while (n < nextFrames.size() && movie.read(frame)) {
+		nextFrames[n] = frame.clone();
+		n++;
+	}
+	nextFrames.resize(n);
+}
+
+bool FramePipeline::next(const FrameStage &stage)
+{
+	if (!started) {
+		readBatch();
+		started = true;
+	}
+	frames.swap(nextFrames);
+	if (frames.empty()) {
+		return false;
+	}
+	kpts.resize(frames.size());
+	//new results, as the caller may still hold those of the last batch
+	results.assign(frames.size(), cv::Mat());
+
+	//the next batch is decoded along with the first frames of this one
+	int n = (int)frames.size();
+#ifdef _OPENMP
+#pragma omp parallel num_threads(numThreads)
+#endif
+	{
+#ifdef _OPENMP
+#pragma omp single nowait
+#endif
+		readBatch();
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 1)
+#endif
+		for (int i = 0; i < n; i++) {
+			stage.process(frames[i], kpts[i], results[i]);
+		}
+	}
+	return true;
+}
+
+void DescriptorStage::create(cv::FileStorage &settings, int numThreads)
+{
+	detectors.resize(numThreads);
+	extractors.resize(numThreads);
+	for (int i = 0; i < numThreads; i++) {
+		detectors[i] = generateDetector(settings);
+		extractors[i] = generateExtractor(settings);
+		CV_Assert(!detectors[i].empty() && !extractors[i].empty());
+	}
+}
+
+void DescriptorStage::process(const cv::Mat& frame,
+							  std::vector<cv::KeyPoint>& kpts,
+							  cv::Mat& result) const
+{
+#ifdef _OPENMP
+	int thread = omp_get_thread_num();
+#else
+	int thread = 0;
+#endif
+	detectors[thread]->detect(frame, kpts);
+	extractors[thread]->compute(frame, kpts, result);
+}
+
+void BOWStage::compute(const cv::Mat& descriptors, cv::Mat& result) const
+{
+	if (projection.empty()) {
+		quantise(descriptors, result);
+		return;
+	}
+	cv::Mat projected;
+	projection.project(descriptors, projected);
+	quantise(projected, result);
+}
+
+void BOWStage::quantise(const cv::Mat& descriptors, cv::Mat& result) const
+{
+	if (!vocabTree.empty()) {
+		vocabTree.compute(descriptors, result);
+	} else if (!exactQuantiser.empty()) {
+		exactQuantiser.compute(descriptors, result);
+	} else {
+		//the matcher already holds the vocabulary. The word counts are
+		//normalised as cv::BOWImgDescriptorExtractor does
+		std::vector<cv::DMatch> matches;
+		result = cv::Mat::zeros(1, vocabSize, CV_32F);
+		if (!descriptors.empty()) {
+			matcher->match(descriptors, matches);
+		}
+		for (size_t i = 0; i < matches.size(); i++) {
+			result.at<float>(0, matches[i].trainIdx)++;
+		}
+		if (!matches.empty()) {
+			result /= (double)matches.size();
+		}
+	}
+}
+
+/*
+feature cache files hold a header of FEATURE_CACHE_MAGIC and the number of
+frames, then each frame's keypoints and descriptors, then a frame of -1
+keypoints. They are written under a temporary name and renamed once
+complete
+*/
+static const char FEATURE_CACHE_MAGIC[8] = {'O','F','2','F','E','A','T','1'};
+
+//64 bit FNV-1a
+static void hashBytes(const void *data, size_t n, uint64 &hash)
+{
+	const unsigned char *bytes = (const unsigned char *)data;
+	for (size_t i = 0; i < n; i++) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+}
+
+static void hashString(const std::string &str, uint64 &hash)
+{
+	hashBytes(str.c_str(), str.size() + 1, hash);
+}
+
+//every name and value beneath a settings node
+static void hashNode(const cv::FileNode &node, uint64 &hash)
+{
+	if (node.isMap() || node.isSeq()) {
+		for (cv::FileNodeIterator it = node.begin(); it != node.end(); ++it) {
+			cv::FileNode child = *it;
+			hashString(child.name(), hash);
+			hashNode(child, hash);
+		}
+	} else if (node.isString()) {
+		hashString((std::string)node, hash);
+	} else if (node.isInt()) {
+		int value = (int)node;
+		hashBytes(&value, sizeof(value), hash);
+	} else if (node.isReal()) {
+		double value = (double)node;
+		hashBytes(&value, sizeof(value), hash);
+	}
+}
+
+//the video is identified by its size and its first and last megabyte
+static bool hashVideo(const std::string &videoPath, uint64 &hash)
+{
+	std::ifstream video(videoPath.c_str(), std::ios::binary);
+	if (!video.is_open()) {
+		return false;
+	}
+	video.seekg(0, std::ios::end);
+	std::streamoff length = video.tellg();
+	hashBytes(&length, sizeof(length), hash);
+
+	std::vector<char> buffer(1 << 20);
+	std::streamoff starts[2] = {0, std::max((std::streamoff)0,
+		length - (std::streamoff)buffer.size())};
+	for (int i = 0; i < 2; i++) {
+		video.seekg(starts[i]);
+		video.read(&buffer[0], buffer.size());
+		hashBytes(&buffer[0], (size_t)video.gcount(), hash);
+		video.clear();
+	}
+	return true;
+}
+
+static void writeFeatures(std::ofstream &out,
+						  const std::vector<cv::KeyPoint> &kpts,
+						  const cv::Mat &descs)
+{
+	int header[4] = {(int)kpts.size(), descs.rows, descs.cols, descs.type()};
+	out.write((const char *)header, sizeof(header));
+	for (size_t i = 0; i < kpts.size(); i++) {
+		float values[5] = {kpts[i].pt.x, kpts[i].pt.y, kpts[i].size,
+			kpts[i].angle, kpts[i].response};
+		int ids[2] = {kpts[i].octave, kpts[i].class_id};
+		out.write((const char *)values, sizeof(values));
+		out.write((const char *)ids, sizeof(ids));
+	}
+	for (int r = 0; r < descs.rows; r++) {
+		out.write((const char *)descs.ptr(r), descs.cols * descs.elemSize());
+	}
+}
+
+//the bytes of keypoints and descriptors following a frame header, -1 if the
+//header is damaged
+static long long featureBytes(const int header[4])
+{
+	if (header[0] < 0 || header[1] < 0 || header[2] < 0 ||
+		header[3] != CV_MAT_DEPTH(header[3]) || header[3] > CV_64F) {
+		return -1;
+	}
+	return header[0] * (long long)(5 * sizeof(float) + 2 * sizeof(int)) +
+		header[1] * (long long)header[2] * CV_ELEM_SIZE(header[3]);
+}
+
+//reads the header of a cache file and walks its frame headers, checking
+//that every frame fits in the file and that as many frames as the header
+//records precede the end marker. Leaves the file at the first frame
+static bool checkFeatureCache(std::ifstream &in, int &frameCount)
+{
+	in.seekg(0, std::ios::end);
+	std::streamoff fileSize = in.tellg();
+	in.seekg(0);
+
+	char magic[8];
+	if (!in.read(magic, 8) ||
+		!std::equal(magic, magic + 8, FEATURE_CACHE_MAGIC) ||
+		!in.read((char *)&frameCount, sizeof(frameCount))) {
+		return false;
+	}
+	std::streamoff framesStart = in.tellg();
+
+	int frames = 0;
+	int header[4];
+	while (in.read((char *)header, sizeof(header)) && header[0] != -1) {
+		long long bytes = featureBytes(header);
+		if (bytes < 0 || bytes > fileSize - (long long)in.tellg()) {
+			return false;
+		}
+		in.seekg((std::streamoff)bytes, std::ios::cur);
+		frames++;
+	}
+	if (!in || frames != frameCount) {
+		return false;
+	}
+	in.seekg(framesStart);
+	return true;
+}
 
+//1 once a frame is read, 0 at the end of the frames and -1 if the file is
+//damaged
+static int readFeatures(std::ifstream &in, std::vector<cv::KeyPoint> &kpts,
+						cv::Mat &descs)
+{
+	int header[4];
+	if (!in.read((char *)header, sizeof(header))) {
+		return -1;
+	}
+	if (header[0] == -1) {
+		return 0;
+	}
+	if (featureBytes(header) < 0) {
+		return -1;
+	}
+	kpts.resize(header[0]);
+	for (size_t i = 0; i < kpts.size(); i++) {
+		float values[5];
+		int ids[2];
+		in.read((char *)values, sizeof(values));
+		in.read((char *)ids, sizeof(ids));
+		kpts[i] = cv::KeyPoint(values[0], values[1], values[2], values[3],
+			values[4], ids[0], ids[1]);
+	}
+	descs = cv::Mat();
+	if (header[1] > 0) {
+		descs.create(header[1], header[2], header[3]);
+		for (int r = 0; r < descs.rows; r++) {
+			in.read((char *)descs.ptr(r), descs.cols * descs.elemSize());
+		}
+	}
+	return in ? 1 : -1;
 }
 
+FeatureSource::FeatureSource(cv::FileStorage &_settings, int numThreads,
+							 int _batchFrames) :
+	settings(_settings), batchFrames(_batchFrames > 0 ?
+	_batchFrames : 32), pipeline(movie, numThreads, _batchFrames),
+	frameCount(0), framesDone(0)
+{
+}
 
+FeatureSource::~FeatureSource()
+{
+	//an unfinished cache file is discarded
+	if (cacheOut.is_open()) {
+		cacheOut.close();
+		std::remove((cacheFile + ".tmp").c_str());
+	}
+}
+
+bool FeatureSource::open(const std::string &videoPath,
+						 const std::string &cacheDir,
+						 const cv::FileNode &featureOptions)
+{
+	uint64 hash = 14695981039346656037ULL;
+	if (!cacheDir.empty() && hashVideo(videoPath, hash)) {
+		hashNode(featureOptions, hash);
+		char name[32];
+		sprintf(name, "%016llx.features", (unsigned long long)hash);
+		char last = cacheDir[cacheDir.size() - 1];
+		cacheFile = cacheDir + (last == '/' || last == '\\' ? "" : "/") +
+			name;
+
+		//a damaged cache file is removed and the features extracted again
+		cacheIn.open(cacheFile.c_str(), std::ios::binary);
+		if (cacheIn.is_open()) {
+			if (checkFeatureCache(cacheIn, frameCount)) {
+				std::cout << "Reading features from " << cacheFile <<
+					std::endl;
+				return true;
+			}
+			std::cerr << cacheFile << ": feature cache is damaged, "
+				"extracting the features again" << std::endl;
+			cacheIn.close();
+			std::remove(cacheFile.c_str());
+		}
+		frameCount = 0;
+	}
+
+	movie.open(videoPath);
+	if (!movie.isOpened()) {
+		return false;
+	}
+	stage.create(settings, pipeline.getNumThreads());
+	if (!cacheFile.empty()) {
+		cacheOut.open((cacheFile + ".tmp").c_str(), std::ios::binary);
+		if (cacheOut.is_open()) {
+			cacheOut.write(FEATURE_CACHE_MAGIC, 8);
+			cacheOut.write((const char *)&frameCount, sizeof(frameCount));
+		} else {
+			std::cerr << cacheFile << ": could not write to the feature "
+				"cache" << std::endl;
+		}
+	}
+	return true;
+}
+
+bool FeatureSource::next()
+{
+	if (cacheIn.is_open()) {
+		kpts.resize(batchFrames);
+		descs.resize(batchFrames);
+		size_t n = 0;
+		int read = 1;
+		while (n < kpts.size() &&
+			(read = readFeatures(cacheIn, kpts[n], descs[n])) > 0) {
+			n++;
+		}
+		//the file was checked when opened, so it has changed since
+		if (read < 0 || (read == 0 && framesDone + (int)n != frameCount)) {
+			CV_Error(CV_StsParseError, cacheFile + ": feature cache is "
+				"damaged");
+		}
+		kpts.resize(n);
+		descs.resize(n);
+		framesDone += (int)n;
+		return n > 0;
+	}
+
+	if (!pipeline.next(stage)) {
+		//the cache file is complete once every frame has been added
+		if (cacheOut.is_open()) {
+			int end[4] = {-1, 0, 0, 0};
+			cacheOut.write((const char *)end, sizeof(end));
+			cacheOut.seekp(8);
+			cacheOut.write((const char *)&framesDone, sizeof(framesDone));
+			bool written = (bool)cacheOut;
+			cacheOut.close();
+			std::remove(cacheFile.c_str());
+			if (!written || std::rename((cacheFile + ".tmp").c_str(),
+				cacheFile.c_str()) != 0) {
+				std::remove((cacheFile + ".tmp").c_str());
+			}
+		}
+		return false;
+	}
+	if (cacheOut.is_open()) {
+		for (size_t i = 0; i < pipeline.size(); i++) {
+			writeFeatures(cacheOut, pipeline.keypoints(i),
+				pipeline.result(i));
+		}
+	}
+	framesDone += (int)pipeline.size();
+	return true;
+}
+
+size_t FeatureSource::size() const
+{
+	return cacheIn.is_open() ? descs.size() : pipeline.size();
+}
+
+const cv::Mat& FeatureSource::frame(size_t i) const
+{
+	return cacheIn.is_open() ? noFrame : pipeline.frame(i);
+}
+
+const std::vector<cv::KeyPoint>& FeatureSource::keypoints(size_t i) const
+{
+	return cacheIn.is_open() ? kpts[i] : pipeline.keypoints(i);
+}
+
+const cv::Mat& FeatureSource::descriptors(size_t i) const
+{
+	return cacheIn.is_open() ? descs[i] : pipeline.result(i);
+}
+
+double FeatureSource::progress()
+{
+	if (cacheIn.is_open()) {
+		return frameCount > 0 ? 100.0 * framesDone / frameCount : 0;
+	}
+	return 100.0 * (movie.get(CV_CAP_PROP_POS_FRAMES) /
+		movie.get(CV_CAP_PROP_FRAME_COUNT));
+}
 
 /*
 draws keypoints to scale with coloring proportional to feature strength
@@ -0,0 +1,184 @@
+/*------------------------------------------------------------------------
+ Copyright 2012 Arren Glover [aj.glover@qut.edu.au]
+                Will Maddern [w.maddern@qut.edu.au]
+
+ This file is part of OpenFABMAP. http://code.google.com/p/openfabmap/
+
+ OpenFABMAP is free software: you can redistribute it and/or modify it under
+ the terms of the GNU General Public License as published by the Free Software
+ Foundation, either version 3 of the License, or (at your option) any later
+ version.
+
+ OpenFABMAP is distributed in the hope that it will be useful, but WITHOUT ANY
+ WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ details.
+
+ For published work which uses all or part of OpenFABMAP, please cite:
+ http://ieeexplore.ieee.org/xpl/articleDetails.jsp?arnumber=6224843
+
+ Original Algorithm by Mark Cummins and Paul Newman:
+ http://ijr.sagepub.com/content/27/6/647.short
+ http://ieeexplore.ieee.org/xpl/articleDetails.jsp?arnumber=5613942
+ http://ijr.sagepub.com/content/30/9/1100.abstract
+
+ You should have received a copy of the GNU General Public License along with
+ OpenFABMAP. If not, see http://www.gnu.org/licenses/.
+------------------------------------------------------------------------*/
+
+#include "../include/openfabmap.hpp"
+#include <cstdlib>
+#include <cstring>
+
+using std::string;
+using cv::Mat;
+
+namespace of2 {
+
+BOWDescriptorReader::BOWDescriptorReader() : rows(0), cols(0), rowsRead(0) {
+}
+
+BOWDescriptorReader::BOWDescriptorReader(const string& filename,
+		const string& nodeName) : rows(0), cols(0), rowsRead(0) {
+	open(filename, nodeName);
+}
+
+BOWDescriptorReader::~BOWDescriptorReader() {
+}
+
+// the matrix header fields are written one per line in both formats:
+// YAML "rows: 10" or XML "<rows>10</rows>". The key is followed by a single
+// ':' or '>' before its value
+static const char *fieldValue(const string& line, const char *key) {
+	size_t pos = line.find(key);
+	if (pos == string::npos) {
+		return NULL;
+	}
+	const char *value = line.c_str() + pos + strlen(key) + 1;
+	while (*value == ' ') value++;
+	return value;
+}
+
+bool BOWDescriptorReader::open(const string& filename,
+		const string& _nodeName) {
+
+	if (file.is_open()) {
+		file.close();
+	}
+	file.clear();
+	matrixFile.release();
+	nodeName = _nodeName;
+	rows = cols = rowsRead = 0;
+
+	// matrix files are streamed by MatrixFile
+	if (MatrixFile::isMatrixFile(filename)) {
+		int type;
+		if (matrixFile.open(filename, MatrixFile::READ) &&
+			matrixFile.find(nodeName, rows, cols, type) &&
+			rows > 0 && cols > 0 && type == CV_32F) {
+			return true;
+		}
+		matrixFile.release();
+		rows = cols = 0;
+		return false;
+	}
+
+	// binary mode so the positions given by tellg can be returned to
+	file.open(filename.c_str(), std::ios::in | std::ios::binary);
+	if (!file.is_open()) {
+		return false;
+	}
+
+	string line, yamlNode = nodeName + ":", xmlNode = "<" + nodeName;
+	bool found = false;
+	while (std::getline(file, line)) {
+		if (line.compare(0, yamlNode.size(), yamlNode) == 0 ||
+			line.find(xmlNode) != string::npos) {
+			found = true;
+			break;
+		}
+	}
+
+	bool isFloat = false;
+	while (found) {
+		std::streampos lineStart = file.tellg();
+		if (!std::getline(file, line)) {
+			break;
+		}
+		const char *value;
+		if ((value = fieldValue(line, "rows"))) {
+			rows = atoi(value);
+		} else if ((value = fieldValue(line, "cols"))) {
+			cols = atoi(value);
+		} else if ((value = fieldValue(line, "dt"))) {
+			isFloat = *value == 'f';
+		} else if ((value = fieldValue(line, "data"))) {
+			// the values may begin on the same line
+			file.clear();
+			file.seekg(lineStart + (std::streamoff)(value - line.c_str()));
+			dataStart = file.tellg();
+			if (rows > 0 && cols > 0 && isFloat) {
+				return true;
+			}
+			break;
+		}
+	}
+
+	file.close();
+	rows = cols = 0;
+	return false;
+}
+
+bool BOWDescriptorReader::isOpened() const {
+	return file.is_open() || matrixFile.isOpened();
+}
+
+void BOWDescriptorReader::rewind() {
+	if (matrixFile.isOpened()) {
+		int type;
+		matrixFile.find(nodeName, rows, cols, type);
+		rowsRead = 0;
+		return;
+	}
+	CV_Assert(file.is_open());
+	file.clear();
+	file.seekg(dataStart);
+	rowsRead = 0;
+}
+
+bool BOWDescriptorReader::read(Mat& imgDescriptors, int maxRows) {
+
+	if (matrixFile.isOpened()) {
+		if (!matrixFile.readRows(imgDescriptors, maxRows)) {
+			return false;
+		}
+		rowsRead += imgDescriptors.rows;
+		return true;
+	}
+
+	if (!file.is_open() || rowsRead >= rows) {
+		return false;
+	}
+
+	int chunkRows = std::min(maxRows, rows - rowsRead);
+	imgDescriptors.create(chunkRows, cols, CV_32F);
+	for (int i = 0; i < chunkRows; i++) {
+		float *z = imgDescriptors.ptr<float>(i);
+		for (int q = 0; q < cols; q++) {
+			// skip the separators of the YAML sequence
+			int c = file.peek();
+			while (c == ' ' || c == ',' || c == '[' || c == '\n' ||
+				c == '\r' || c == '\t') {
+				file.get();
+				c = file.peek();
+			}
+			if (!(file >> z[q])) {
+				CV_Error(CV_StsParseError, "BOW descriptors ended early");
+			}
+		}
+	}
+	rowsRead += chunkRows;
+	return true;
+}
+
+}
@@ -27,15 +27,24 @@
 ------------------------------------------------------------------------*/
 
 #include "../include/openfabmap.hpp"
+#include <algorithm>
+#include <cstring>
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 using std::vector;
-using std::list;
 using cv::Mat;
 
 namespace of2 {
 
-BOWMSCTrainer::BOWMSCTrainer(double _clusterSize) :
-	clusterSize(_clusterSize) {
+BOWMSCTrainer::BOWMSCTrainer(double _clusterSize, int _numThreads) :
+	clusterSize(_clusterSize), numThreads(_numThreads) {
 }
 
 BOWMSCTrainer::~BOWMSCTrainer() {
@@ -43,73 +52,508 @@ BOWMSCTrainer::~BOWMSCTrainer() {
 
 Mat BOWMSCTrainer::cluster() const {
 	CV_Assert(!descriptors.empty());
-	int descCount = 0;
-	for(size_t i = 0; i < descriptors.size(); i++)
-	descCount += descriptors[i].rows;
+	return cluster(descriptors);
+}
 
-	Mat mergedDescriptors(descCount, descriptors[0].cols, 
-		descriptors[0].type());
-	for(size_t i = 0, start = 0; i < descriptors.size(); i++)
-	{
-		Mat submut = mergedDescriptors.rowRange((int)start, 
-			(int)(start + descriptors[i].rows));
-		descriptors[i].copyTo(submut);
-		start += descriptors[i].rows;
+Mat BOWMSCTrainer::cluster(const Mat& descriptors) const {
+	CV_Assert(!descriptors.empty());
+	return cluster(vector<Mat>(1, descriptors));
+}
+
+// squared euclidean distance between two descriptors
+static float distanceSq(const float *a, const float *b, int n) {
+	int i = 0;
+	float dist = 0;
+#if defined(__AVX512F__)
+	__m512 sum = _mm512_setzero_ps();
+	for (; i + 16 <= n; i += 16) {
+		__m512 d = _mm512_sub_ps(_mm512_loadu_ps(a + i),
+			_mm512_loadu_ps(b + i));
+		sum = _mm512_fmadd_ps(d, d, sum);
 	}
-	return cluster(mergedDescriptors);
+	dist = _mm512_reduce_add_ps(sum);
+#elif defined(__AVX2__)
+	__m256 sum = _mm256_setzero_ps();
+	for (; i + 8 <= n; i += 8) {
+		__m256 d = _mm256_sub_ps(_mm256_loadu_ps(a + i),
+			_mm256_loadu_ps(b + i));
+#ifdef __FMA__
+		sum = _mm256_fmadd_ps(d, d, sum);
+#else
+		sum = _mm256_add_ps(sum, _mm256_mul_ps(d, d));
+#endif
+	}
+	float lanes[8];
+	_mm256_storeu_ps(lanes, sum);
+	dist = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]) +
+		(lanes[4] + lanes[5]) + (lanes[6] + lanes[7]);
+#endif
+	for (; i < n; i++) {
+		float d = a[i] - b[i];
+		dist += d * d;
+	}
+	return dist;
 }
 
-Mat BOWMSCTrainer::cluster(const Mat& descriptors) const {
+static inline int popCount(uint64 x) {
+#if defined(__GNUC__)
+	return __builtin_popcountll(x);
+#else
+	x -= (x >> 1) & 0x5555555555555555ULL;
+	x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+	x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+	return (int)((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
 
-	CV_Assert(!descriptors.empty());
+// squared hamming distance between two binary descriptors of n bytes, so
+// binary centres are indexed and compared as the float ones are
+static float distanceSq(const uchar *a, const uchar *b, int n) {
+	int i = 0, dist = 0;
+	for (; i + 8 <= n; i += 8) {
+		uint64 x, y;
+		memcpy(&x, a + i, 8);
+		memcpy(&y, b + i, 8);
+		dist += popCount(x ^ y);
+	}
+	for (; i < n; i++) {
+		dist += popCount(a[i] ^ b[i]);
+	}
+	return (float)(dist * dist);
+}
 
-	// TODO: sort the descriptors before clustering.
+// whether a descriptor lies within the cluster size of any of the centres
+// [first, last)
+template<typename T>
+static bool nearCentre(const T *z, const vector<const T *>& centres,
+					   size_t first, size_t last, int cols, float maxDistSq) {
+	for (size_t j = first; j < last; j++) {
+		if (distanceSq(z, centres[j], cols) <= maxDistSq) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// vantage point tree over the first centres, so a descriptor is only
+// compared with the centres that may lie near it. Each node holds a centre
+// and the median distance of the centres below it from that centre, those
+// nearer in the inside subtree and the others in the outside subtree
+struct CentreTree {
+	vector<int> centre;
+	vector<float> radius;
+	vector<int> inside;
+	vector<int> outside;
+};
+
+// the tree prunes by distances rather than squared distances, with some
+// slack so rounding never prunes a centre the exact comparison would accept
+static inline float pruneBound(float dist) {
+	return dist * 1.0001f + 1e-6f;
+}
 
+template<typename T>
+static int buildCentreTree(CentreTree& tree,
+						   const vector<const T *>& centres, int cols,
+						   vector<std::pair<float, int> >& items,
+						   int begin, int end) {
+	if (begin >= end) {
+		return -1;
+	}
+	int node = (int)tree.centre.size();
+	tree.centre.push_back(items[begin].second);
+	tree.radius.push_back(0);
+	tree.inside.push_back(-1);
+	tree.outside.push_back(-1);
 
-	Mat icovar = Mat::eye(descriptors.cols,descriptors.cols,descriptors.type());
+	const T *vp = centres[items[begin].second];
+	for (int i = begin + 1; i < end; i++) {
+		items[i].first = std::sqrt(distanceSq(vp, centres[items[i].second],
+			cols));
+	}
+	int middle = (begin + 1 + end) / 2;
+	if (middle < end) {
+		std::nth_element(items.begin() + begin + 1, items.begin() + middle,
+			items.begin() + end);
+		tree.radius[node] = items[middle].first;
+	}
+	int inside = buildCentreTree(tree, centres, cols, items,
+		begin + 1, middle);
+	int outside = buildCentreTree(tree, centres, cols, items, middle, end);
+	tree.inside[node] = inside;
+	tree.outside[node] = outside;
+	return node;
+}
 
-	vector<Mat> initialCentres;
-	initialCentres.push_back(descriptors.row(0));
-	for (int i = 1; i < descriptors.rows; i++) {
-		double minDist = DBL_MAX;
-		for (size_t j = 0; j < initialCentres.size(); j++) {
-			minDist = std::min(minDist,
-				cv::Mahalanobis(descriptors.row(i),initialCentres[j],
-				icovar));
+// index the first nCentres centres
+template<typename T>
+static void buildCentreTree(CentreTree& tree,
+							const vector<const T *>& centres,
+							size_t nCentres, int cols) {
+	tree.centre.clear();
+	tree.radius.clear();
+	tree.inside.clear();
+	tree.outside.clear();
+	vector<std::pair<float, int> > items(nCentres);
+	for (size_t j = 0; j < nCentres; j++) {
+		items[j] = std::make_pair(0.0f, (int)j);
+	}
+	buildCentreTree(tree, centres, cols, items, 0, (int)nCentres);
+}
+
+// whether any indexed centre lies within maxDist of descriptor z
+template<typename T>
+static bool nearCentre(const CentreTree& tree, int node, const T *z,
+					   const vector<const T *>& centres, int cols,
+					   float maxDistSq, float maxDist) {
+	while (node >= 0) {
+		float distSq = distanceSq(z, centres[tree.centre[node]], cols);
+		if (distSq <= maxDistSq) {
+			return true;
+		}
+		// the side the descriptor falls in is searched first
+		float dist = std::sqrt(distSq);
+		int nearSide = tree.inside[node], farSide = tree.outside[node];
+		if (dist >= tree.radius[node]) {
+			std::swap(nearSide, farSide);
+		}
+		if (nearCentre(tree, nearSide, z, centres, cols, maxDistSq,
+			maxDist)) {
+			return true;
+		}
+		node = fabs(dist - tree.radius[node]) <= pruneBound(maxDist) ?
+			farSide : -1;
+	}
+	return false;
+}
+
+// the nearest indexed centre to descriptor z, the earliest on ties
+template<typename T>
+static void nearestCentre(const CentreTree& tree, int node, const T *z,
+						  const vector<const T *>& centres, int cols,
+						  float& minDistSq, int& index) {
+	if (node < 0) {
+		return;
+	}
+	int j = tree.centre[node];
+	float distSq = distanceSq(z, centres[j], cols);
+	if (distSq < minDistSq || (distSq == minDistSq && j < index)) {
+		minDistSq = distSq;
+		index = j;
+	}
+	// the side the descriptor falls in first, as it is the likelier to
+	// hold the nearest centre
+	float dist = std::sqrt(distSq);
+	int nearSide = tree.inside[node], farSide = tree.outside[node];
+	if (dist >= tree.radius[node]) {
+		std::swap(nearSide, farSide);
+	}
+	nearestCentre(tree, nearSide, z, centres, cols, minDistSq, index);
+	if (fabs(dist - tree.radius[node]) <= pruneBound(std::sqrt(minDistSq))) {
+		nearestCentre(tree, farSide, z, centres, cols, minDistSq, index);
+	}
+}
+
+// the next chunk of a descriptor stream, read and projected by one thread
+// while the others process the current chunk
+struct ChunkPrefetch {
+	ChunkPrefetch(BOWDescriptorReader& _reader, int _chunkRows,
+		const PCAProjection& _projection) : reader(_reader),
+		chunkRows(_chunkRows), projection(_projection), more(false) {
+	}
+	void read() {
+		more = reader.read(next, chunkRows);
+		if (more && !projection.empty()) {
+			projection.project(next, projected);
+			std::swap(next, projected);
+		}
+	}
+
+	BOWDescriptorReader& reader;
+	int chunkRows;
+	const PCAProjection& projection;
+	Mat next;
+	Mat projected;
+	bool more;
+};
+
+// the centres found so far, as pointers to their descriptors. Streamed
+// descriptors do not stay in memory, so centres among them are copied
+// into blocks of rows that are never reallocated
+template<typename T>
+struct CentreSeeding {
+	CentreSeeding(int _cols, double clusterSize) : cols(_cols),
+		maxDistSq((float)(clusterSize * clusterSize)),
+		maxDist((float)clusterSize), indexedCentres(0), copiedRows(0) {
+	}
+
+	int cols;
+	float maxDistSq;
+	float maxDist;
+	vector<const T *> centres;
+	CentreTree tree;
+	size_t indexedCentres;
+	vector<Mat> copies;
+	int copiedRows;
+	vector<char> covered;
+};
+
+template<typename T>
+static void addCentre(CentreSeeding<T>& seeding, const T *z, bool copy) {
+	if (copy) {
+		if (seeding.copies.empty() ||
+			seeding.copiedRows == seeding.copies.back().rows) {
+			seeding.copies.push_back(Mat(1024, seeding.cols, cv::DataType<T>::type));
+			seeding.copiedRows = 0;
+		}
+		T *row = seeding.copies.back().template ptr<T>(seeding.copiedRows++);
+		std::copy(z, z + seeding.cols, row);
+		z = row;
+	}
+	seeding.centres.push_back(z);
+}
+
+// a descriptor further than the cluster size from every centre becomes a
+// centre itself. Each block of descriptors is first compared in parallel
+// with the centres found before the block, and the remaining descriptors
+// in order with the centres found within it. The centres are indexed in a
+// tree, rebuilt once enough new centres are found
+template<typename T>
+static void seedCentres(CentreSeeding<T>& seeding, const Mat& batch, bool copy,
+						int threads, ChunkPrefetch *prefetch) {
+	const int blockRows = 4096;
+	vector<const T *>& centres = seeding.centres;
+	seeding.covered.resize(blockRows);
+	for (int start = 0; start < batch.rows; start += blockRows) {
+		int end = std::min(batch.rows, start + blockRows);
+		if (centres.empty()) {
+			addCentre(seeding, batch.ptr<T>(start), copy);
+		}
+		size_t knownCentres = centres.size();
+		if (knownCentres - seeding.indexedCentres >
+			std::max((size_t)256, seeding.indexedCentres / 8)) {
+			buildCentreTree(seeding.tree, centres, knownCentres,
+				seeding.cols);
+			seeding.indexedCentres = knownCentres;
+		}
+		int root = seeding.indexedCentres ? 0 : -1;
+#ifdef _OPENMP
+#pragma omp parallel num_threads(threads)
+#endif
+		{
+			// the next chunk is read along with the first block
+			if (prefetch) {
+#ifdef _OPENMP
+#pragma omp single nowait
+#endif
+				prefetch->read();
+			}
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 64)
+#endif
+			for (int i = start; i < end; i++) {
+				const T *z = batch.ptr<T>(i);
+				seeding.covered[i - start] = nearCentre(seeding.tree, root,
+					z, centres, seeding.cols, seeding.maxDistSq,
+					seeding.maxDist) || nearCentre(z, centres,
+					seeding.indexedCentres, knownCentres, seeding.cols,
+					seeding.maxDistSq);
+			}
 		}
-		if (minDist > clusterSize)
-			initialCentres.push_back(descriptors.row(i));
-	}
-
-	vector<list<Mat> > clusters;
-	clusters.resize(initialCentres.size());
-	for (int i = 0; i < descriptors.rows; i++) {
-		int index; double dist, minDist = DBL_MAX;
-		for (size_t j = 0; j < initialCentres.size(); j++) {
-			dist = cv::Mahalanobis(descriptors.row(i),initialCentres[j],icovar);
-			if (dist < minDist) {
-				minDist = dist;
-				index = j;
+		prefetch = NULL;
+		for (int i = start; i < end; i++) {
+			const T *z = batch.ptr<T>(i);
+			if (!seeding.covered[i - start] && !nearCentre(z, centres,
+				knownCentres, centres.size(), seeding.cols,
+				seeding.maxDistSq)) {
+				addCentre(seeding, z, copy);
 			}
 		}
-		clusters[index].push_back(descriptors.row(i));
 	}
+}
 
-	// TODO: throw away small clusters.
+// float descriptors are summed for their mean, binary ones bit by bit for a
+// majority vote of each bit of the centre
+static void addDescriptor(double *sum, const float *z, int cols) {
+	for (int k = 0; k < cols; k++) {
+		sum[k] += z[k];
+	}
+}
 
-	Mat vocabulary;
-	Mat centre = Mat::zeros(1,descriptors.cols,descriptors.type());
-	for (size_t i = 0; i < clusters.size(); i++) {
-		centre.setTo(0);
-		for (list<Mat>::iterator Ci = clusters[i].begin(); Ci != clusters[i].end(); Ci++) {
-			centre += *Ci;
+static void addDescriptor(double *sum, const uchar *z, int cols) {
+	for (int k = 0; k < cols; k++) {
+		for (int b = 0; b < 8; b++) {
+			sum[k * 8 + b] += (z[k] >> b) & 1;
 		}
-		centre /= (double)clusters[i].size();
-		vocabulary.push_back(centre);
 	}
+}
+
+static int sumCols(int cols, const float *) {
+	return cols;
+}
+
+static int sumCols(int cols, const uchar *) {
+	return cols * 8;
+}
+
+static void centreMean(const double *sum, int count, float *centre,
+					   int cols) {
+	for (int k = 0; k < cols; k++) {
+		centre[k] = (float)(sum[k] / count);
+	}
+}
+
+// a bit is set when more than half the descriptors of the centre set it
+static void centreMean(const double *sum, int count, uchar *centre,
+					   int cols) {
+	for (int k = 0; k < cols; k++) {
+		centre[k] = 0;
+		for (int b = 0; b < 8; b++) {
+			if (2 * sum[k * 8 + b] > count) {
+				centre[k] |= (uchar)(1 << b);
+			}
+		}
+	}
+}
+
+// add each descriptor to the sum of its nearest centre
+template<typename T>
+static void assignCentres(const CentreSeeding<T>& seeding, const Mat& batch,
+						  Mat& sums, vector<int>& counts, int threads,
+						  ChunkPrefetch *prefetch) {
+	vector<int> labels(batch.rows);
+#ifdef _OPENMP
+#pragma omp parallel num_threads(threads)
+#endif
+	{
+		if (prefetch) {
+#ifdef _OPENMP
+#pragma omp single nowait
+#endif
+			prefetch->read();
+		}
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 64)
+#endif
+		for (int i = 0; i < batch.rows; i++) {
+			int index = 0;
+			float minDistSq = FLT_MAX;
+			nearestCentre(seeding.tree, 0, batch.ptr<T>(i),
+				seeding.centres, seeding.cols, minDistSq, index);
+			labels[i] = index;
+		}
+	}
+
+	for (int i = 0; i < batch.rows; i++) {
+		addDescriptor(sums.ptr<double>(labels[i]), batch.ptr<T>(i),
+			batch.cols);
+		counts[labels[i]]++;
+	}
+}
+
+// the vocabulary words are the means of the descriptors of each centre
+template<typename T>
+static Mat centreMeans(const Mat& sums, const vector<int>& counts, int cols) {
+
+	// TODO: throw away small clusters.
 
+	Mat vocabulary(sums.rows, cols, cv::DataType<T>::type);
+	for (int j = 0; j < sums.rows; j++) {
+		centreMean(sums.ptr<double>(j), counts[j], vocabulary.ptr<T>(j),
+			cols);
+	}
 	return vocabulary;
 }
 
+// the batches are clustered in place, in order, without being merged
+template<typename T>
+static Mat clusterBatches(const vector<Mat>& descriptors, double clusterSize,
+						  int threads) {
+
+	// TODO: sort the descriptors before clustering.
+
+	int cols = descriptors[0].cols;
+	CentreSeeding<T> seeding(cols, clusterSize);
+	for (size_t b = 0; b < descriptors.size(); b++) {
+		seedCentres(seeding, descriptors[b], false, threads, NULL);
+	}
+
+	buildCentreTree(seeding.tree, seeding.centres, seeding.centres.size(),
+		cols);
+	Mat sums = Mat::zeros((int)seeding.centres.size(),
+		sumCols(cols, (const T *)NULL), CV_64F);
+	vector<int> counts(seeding.centres.size(), 0);
+	for (size_t b = 0; b < descriptors.size(); b++) {
+		assignCentres(seeding, descriptors[b], sums, counts, threads, NULL);
+	}
+
+	return centreMeans<T>(sums, counts, cols);
+}
+
+// float descriptors are compared by euclidean distance and binary ones by
+// hamming distance
+Mat BOWMSCTrainer::cluster(const vector<Mat>& descriptors) const {
+
+	CV_Assert(!descriptors.empty());
+	int type = descriptors[0].type();
+	CV_Assert(type == CV_32F || type == CV_8U);
+	for (size_t b = 0; b < descriptors.size(); b++) {
+		CV_Assert(descriptors[b].type() == type);
+		CV_Assert(descriptors[b].cols == descriptors[0].cols);
+	}
+
+	if (type == CV_8U) {
+		return clusterBatches<uchar>(descriptors, clusterSize,
+			getNumThreads());
+	}
+	return clusterBatches<float>(descriptors, clusterSize, getNumThreads());
+}
+
+// the stream is read twice, once to find the centres and once to assign
+// the descriptors to them, holding two chunks at a time
+Mat BOWMSCTrainer::cluster(BOWDescriptorReader& reader, int chunkRows) const {
+	return cluster(reader, PCAProjection(), chunkRows);
+}
+
+Mat BOWMSCTrainer::cluster(BOWDescriptorReader& reader,
+						   const PCAProjection& projection,
+						   int chunkRows) const {
+
+	CV_Assert(reader.isOpened());
+	CV_Assert(chunkRows > 0);
+	CV_Assert(projection.empty() ||
+		projection.getInputDims() == reader.getCols());
+
+	int threads = getNumThreads();
+	CentreSeeding<float> seeding(projection.empty() ? reader.getCols() :
+		projection.getDims(), clusterSize);
+	ChunkPrefetch prefetch(reader, chunkRows, projection);
+	Mat chunk;
+	for (prefetch.read(); prefetch.more; ) {
+		std::swap(chunk, prefetch.next);
+		seedCentres(seeding, chunk, true, threads, &prefetch);
+	}
+	CV_Assert(!seeding.centres.empty());
+
+	buildCentreTree(seeding.tree, seeding.centres, seeding.centres.size(),
+		seeding.cols);
+	Mat sums = Mat::zeros((int)seeding.centres.size(), seeding.cols, CV_64F);
+	vector<int> counts(seeding.centres.size(), 0);
+	reader.rewind();
+	for (prefetch.read(); prefetch.more; ) {
+		std::swap(chunk, prefetch.next);
+		assignCentres(seeding, chunk, sums, counts, threads, &prefetch);
+	}
+
+	return centreMeans<float>(sums, counts, seeding.cols);
+}
+
+int BOWMSCTrainer::getNumThreads() const {
+#ifdef _OPENMP
+	return numThreads > 0 ? numThreads : omp_get_max_threads();
+#else
+	return 1;
+#endif
 }
 
+}
@@ -0,0 +1,321 @@
+/*------------------------------------------------------------------------
+ Copyright 2012 Arren Glover [aj.glover@qut.edu.au]
+                Will Maddern [w.maddern@qut.edu.au]
+
+ This file is part of OpenFABMAP. http://code.google.com/p/openfabmap/
+
+ OpenFABMAP is free software: you can redistribute it and/or modify it under
+ the terms of the GNU General Public License as published by the Free Software
+ Foundation, either version 3 of the License, or (at your option) any later
+ version.
+
+ OpenFABMAP is distributed in the hope that it will be useful, but WITHOUT ANY
+ WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ details.
+
+ For published work which uses all or part of OpenFABMAP, please cite:
+ http://ieeexplore.ieee.org/xpl/articleDetails.jsp?arnumber=6224843
+
+ Original Algorithm by Mark Cummins and Paul Newman:
+ http://ijr.sagepub.com/content/27/6/647.short
+ http://ieeexplore.ieee.org/xpl/articleDetails.jsp?arnumber=5613942
+ http://ijr.sagepub.com/content/30/9/1100.abstract
+
+ You should have received a copy of the GNU General Public License along with
+ OpenFABMAP. If not, see http://www.gnu.org/licenses/.
+------------------------------------------------------------------------*/
+
+#include "../include/openfabmap.hpp"
+#include <algorithm>
+#include <climits>
+#include <cstring>
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+using std::vector;
+using cv::Mat;
+
+namespace of2 {
+
+// words scored together by the kernel, and the tiling of the product
+static const int panelWords = 16;
+#if defined(__AVX512F__)
+static const int groupRows = 8;
+#else
+static const int groupRows = 4;
+#endif
+static const int blockRows = 64;
+static const int blockPanels = 16;
+
+BOWQuantiser::BOWQuantiser() : vocabularySize(0), dims(0) {
+}
+
+BOWQuantiser::BOWQuantiser(const Mat& vocabulary) : vocabularySize(0),
+	dims(0) {
+	setVocabulary(vocabulary);
+}
+
+BOWQuantiser::~BOWQuantiser() {
+}
+
+void BOWQuantiser::setVocabulary(const Mat& vocabulary) {
+
+	CV_Assert(!vocabulary.empty());
+	CV_Assert(vocabulary.type() == CV_32F || vocabulary.type() == CV_8U);
+
+	vocabularySize = vocabulary.rows;
+	dims = vocabulary.cols;
+	if (vocabulary.type() == CV_8U) {
+		binaryWords = vocabulary.clone();
+		panels.release();
+		wordNorms.clear();
+		return;
+	}
+	binaryWords.release();
+	int nPanels = (vocabularySize + panelWords - 1) / panelWords;
+
+	// the words past the end of the last panel are never nearest
+	panels = Mat::zeros(nPanels * dims, panelWords, CV_32F);
+	wordNorms.assign(nPanels * panelWords, FLT_MAX);
+	for (int q = 0; q < vocabularySize; q++) {
+		const float *w = vocabulary.ptr<float>(q);
+		float *panel = panels.ptr<float>((q / panelWords) * dims);
+		double norm = 0;
+		for (int k = 0; k < dims; k++) {
+			panel[k * panelWords + q % panelWords] = w[k];
+			norm += (double)w[k] * w[k];
+		}
+		wordNorms[q] = (float)norm;
+	}
+}
+
+bool BOWQuantiser::empty() const {
+	return vocabularySize == 0;
+}
+
+int BOWQuantiser::getVocabularySize() const {
+	return vocabularySize;
+}
+
+// the dot products of a group of descriptors with the 16 words of a panel
+static void scorePanel(const float *const z[groupRows], const float *panel,
+					   int dims, float dots[groupRows][panelWords]) {
+#if defined(__AVX512F__)
+	// the accumulators are named so they stay in registers
+	__m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+	__m512 acc2 = _mm512_setzero_ps(), acc3 = _mm512_setzero_ps();
+	__m512 acc4 = _mm512_setzero_ps(), acc5 = _mm512_setzero_ps();
+	__m512 acc6 = _mm512_setzero_ps(), acc7 = _mm512_setzero_ps();
+	for (int k = 0; k < dims; k++) {
+		__m512 w = _mm512_loadu_ps(panel + k * panelWords);
+		acc0 = _mm512_fmadd_ps(_mm512_set1_ps(z[0][k]), w, acc0);
+		acc1 = _mm512_fmadd_ps(_mm512_set1_ps(z[1][k]), w, acc1);
+		acc2 = _mm512_fmadd_ps(_mm512_set1_ps(z[2][k]), w, acc2);
+		acc3 = _mm512_fmadd_ps(_mm512_set1_ps(z[3][k]), w, acc3);
+		acc4 = _mm512_fmadd_ps(_mm512_set1_ps(z[4][k]), w, acc4);
+		acc5 = _mm512_fmadd_ps(_mm512_set1_ps(z[5][k]), w, acc5);
+		acc6 = _mm512_fmadd_ps(_mm512_set1_ps(z[6][k]), w, acc6);
+		acc7 = _mm512_fmadd_ps(_mm512_set1_ps(z[7][k]), w, acc7);
+	}
+	_mm512_storeu_ps(dots[0], acc0);
+	_mm512_storeu_ps(dots[1], acc1);
+	_mm512_storeu_ps(dots[2], acc2);
+	_mm512_storeu_ps(dots[3], acc3);
+	_mm512_storeu_ps(dots[4], acc4);
+	_mm512_storeu_ps(dots[5], acc5);
+	_mm512_storeu_ps(dots[6], acc6);
+	_mm512_storeu_ps(dots[7], acc7);
+#elif defined(__AVX2__)
+#ifdef __FMA__
+#define OF2_MADD(a, b, c) _mm256_fmadd_ps(a, b, c)
+#else
+#define OF2_MADD(a, b, c) _mm256_add_ps(_mm256_mul_ps(a, b), c)
+#endif
+	__m256 acc00 = _mm256_setzero_ps(), acc01 = _mm256_setzero_ps();
+	__m256 acc10 = _mm256_setzero_ps(), acc11 = _mm256_setzero_ps();
+	__m256 acc20 = _mm256_setzero_ps(), acc21 = _mm256_setzero_ps();
+	__m256 acc30 = _mm256_setzero_ps(), acc31 = _mm256_setzero_ps();
+	for (int k = 0; k < dims; k++) {
+		__m256 w0 = _mm256_loadu_ps(panel + k * panelWords);
+		__m256 w1 = _mm256_loadu_ps(panel + k * panelWords + 8);
+		__m256 a = _mm256_set1_ps(z[0][k]);
+		acc00 = OF2_MADD(a, w0, acc00);
+		acc01 = OF2_MADD(a, w1, acc01);
+		a = _mm256_set1_ps(z[1][k]);
+		acc10 = OF2_MADD(a, w0, acc10);
+		acc11 = OF2_MADD(a, w1, acc11);
+		a = _mm256_set1_ps(z[2][k]);
+		acc20 = OF2_MADD(a, w0, acc20);
+		acc21 = OF2_MADD(a, w1, acc21);
+		a = _mm256_set1_ps(z[3][k]);
+		acc30 = OF2_MADD(a, w0, acc30);
+		acc31 = OF2_MADD(a, w1, acc31);
+	}
+#undef OF2_MADD
+	_mm256_storeu_ps(dots[0], acc00);
+	_mm256_storeu_ps(dots[0] + 8, acc01);
+	_mm256_storeu_ps(dots[1], acc10);
+	_mm256_storeu_ps(dots[1] + 8, acc11);
+	_mm256_storeu_ps(dots[2], acc20);
+	_mm256_storeu_ps(dots[2] + 8, acc21);
+	_mm256_storeu_ps(dots[3], acc30);
+	_mm256_storeu_ps(dots[3] + 8, acc31);
+#else
+	for (int r = 0; r < groupRows; r++) {
+		for (int i = 0; i < panelWords; i++) {
+			dots[r][i] = 0;
+		}
+	}
+	for (int k = 0; k < dims; k++) {
+		const float *w = panel + k * panelWords;
+		for (int r = 0; r < groupRows; r++) {
+			float a = z[r][k];
+			for (int i = 0; i < panelWords; i++) {
+				dots[r][i] += a * w[i];
+			}
+		}
+	}
+#endif
+}
+
+static inline int popCount(uint64 x) {
+#if defined(__GNUC__)
+	return __builtin_popcountll(x);
+#else
+	x -= (x >> 1) & 0x5555555555555555ULL;
+	x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+	x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+	return (int)((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+// the nearest binary word by hamming distance, comparing 64 bits at a time
+static int nearestBinaryWord(const uchar *z, const Mat& binaryWords) {
+	int n = binaryWords.cols;
+	int best = 0, minDist = INT_MAX;
+	for (int q = 0; q < binaryWords.rows; q++) {
+		const uchar *w = binaryWords.ptr<uchar>(q);
+		int k = 0, dist = 0;
+		for (; k + 8 <= n; k += 8) {
+			uint64 x, y;
+			memcpy(&x, z + k, 8);
+			memcpy(&y, w + k, 8);
+			dist += popCount(x ^ y);
+		}
+		for (; k < n; k++) {
+			dist += popCount(z[k] ^ w[k]);
+		}
+		if (dist < minDist) {
+			minDist = dist;
+			best = q;
+		}
+	}
+	return best;
+}
+
+// blocks of descriptors are scored against blocks of panels small enough
+// to stay in cache, a group of descriptors at a time
+void BOWQuantiser::quantise(const Mat& descriptors,
+							vector<int>& words) const {
+	CV_Assert(!empty());
+	int type = binaryWords.empty() ? CV_32F : CV_8U;
+	CV_Assert(descriptors.empty() || (descriptors.type() == type &&
+		descriptors.cols == dims));
+
+	words.resize(descriptors.rows);
+	if (type == CV_8U) {
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 16)
+#endif
+		for (int i = 0; i < descriptors.rows; i++) {
+			words[i] = nearestBinaryWord(descriptors.ptr<uchar>(i),
+				binaryWords);
+		}
+		return;
+	}
+
+	int nPanels = panels.rows / dims;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (int start = 0; start < descriptors.rows; start += blockRows) {
+		int end = std::min(descriptors.rows, start + blockRows);
+		// the running minimum of each of the 16 lanes of a panel, which only
+		// moves to a later panel on a strictly lower score
+		float minScore[blockRows][panelWords];
+		int minPanel[blockRows][panelWords];
+		for (int i = 0; i < blockRows; i++) {
+			for (int j = 0; j < panelWords; j++) {
+				minScore[i][j] = FLT_MAX;
+				minPanel[i][j] = 0;
+			}
+		}
+		float dots[groupRows][panelWords];
+		for (int p0 = 0; p0 < nPanels; p0 += blockPanels) {
+			int p1 = std::min(nPanels, p0 + blockPanels);
+			for (int i = start; i < end; i += groupRows) {
+				// a partial group repeats its last descriptor
+				const float *z[groupRows];
+				for (int r = 0; r < groupRows; r++) {
+					z[r] = descriptors.ptr<float>(std::min(i + r, end - 1));
+				}
+				for (int p = p0; p < p1; p++) {
+					scorePanel(z, panels.ptr<float>(p * dims), dims, dots);
+					const float *norms = &wordNorms[p * panelWords];
+					for (int r = 0; r < groupRows && i + r < end; r++) {
+						float *ms = minScore[i + r - start];
+						int *mp = minPanel[i + r - start];
+						for (int j = 0; j < panelWords; j++) {
+							float score = norms[j] - 2 * dots[r][j];
+							bool lower = score < ms[j];
+							ms[j] = lower ? score : ms[j];
+							mp[j] = lower ? p : mp[j];
+						}
+					}
+				}
+			}
+		}
+		for (int i = start; i < end; i++) {
+			const float *ms = minScore[i - start];
+			const int *mp = minPanel[i - start];
+			int best = mp[0] * panelWords;
+			float bestScore = ms[0];
+			for (int j = 1; j < panelWords; j++) {
+				int word = mp[j] * panelWords + j;
+				if (ms[j] < bestScore || (ms[j] == bestScore && word < best)) {
+					best = word;
+					bestScore = ms[j];
+				}
+			}
+			words[i] = best;
+		}
+	}
+}
+
+void BOWQuantiser::compute(const Mat& descriptors, Mat& imgDescriptor) const {
+	vector<int> words;
+	quantise(descriptors, words);
+
+	imgDescriptor = Mat::zeros(1, vocabularySize, CV_32F);
+	for (size_t i = 0; i < words.size(); i++) {
+		imgDescriptor.at<float>(0, words[i])++;
+	}
+	if (!words.empty()) {
+		imgDescriptor /= (double)words.size();
+	}
+}
+
+void BOWQuantiser::computeWordList(const Mat& descriptors,
+								   Mat& wordList) const {
+	vector<int> words;
+	quantise(descriptors, words);
+
+	std::sort(words.begin(), words.end());
+	words.erase(std::unique(words.begin(), words.end()), words.end());
+	Mat(words).reshape(1, 1).copyTo(wordList);
+}
+
+}
@@ -27,6 +27,15 @@
 ------------------------------------------------------------------------*/
 
 #include "../include/openfabmap.hpp"
+#include <algorithm>
+
+#if defined(__AVX2__) || defined(__AVX512VPOPCNTDQ__)
+#include <immintrin.h>
+#endif
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 using std::vector;
 using std::list;
@@ -35,7 +44,9 @@ using cv::Mat;
 
 namespace of2 {
 
-ChowLiuTree::ChowLiuTree() {
+ChowLiuTree::ChowLiuTree(int maxPartners) : nWords(0), nImages(0),
+	maxPartners(maxPartners) {
+	CV_Assert(maxPartners >= 0);
 }
 
 ChowLiuTree::~ChowLiuTree() {
@@ -47,6 +58,9 @@ void ChowLiuTree::add(const Mat& imgDescriptor) {
 		CV_Assert(imgDescriptors[0].cols == imgDescriptor.cols);
 		CV_Assert(imgDescriptors[0].type() == imgDescriptor.type());
 	}
+	if (!wordCounts.empty()) {
+		CV_Assert(imgDescriptor.cols == nWords);
+	}
 
 	imgDescriptors.push_back(imgDescriptor);
 
@@ -62,35 +76,26 @@ const std::vector<cv::Mat>& ChowLiuTree::getImgDescriptors() const {
 	return imgDescriptors;
 }
 
-Mat ChowLiuTree::make(double infoThreshold) {
-	CV_Assert(!imgDescriptors.empty());
+Mat ChowLiuTree::make(double infoThreshold, int numThreads) {
 
-	unsigned int descCount = 0;
-	for (size_t i = 0; i < imgDescriptors.size(); i++)
-		descCount += imgDescriptors[i].rows;
-
-	mergedImgDescriptors = cv::Mat(descCount, imgDescriptors[0].cols, 
-		imgDescriptors[0].type());
-	for (size_t i = 0, start = 0; i < imgDescriptors.size(); i++)
-	{
-		Mat submut = mergedImgDescriptors.rowRange((int)start, 
-			(int)(start + imgDescriptors[i].rows));
-		imgDescriptors[i].copyTo(submut);
-		start += imgDescriptors[i].rows;
-	}
+	updateStatistics(numThreads);
+	CV_Assert(nImages > 0);
 
 	list<info> edges;
-	// create edges
-	// using mutual information between nodes
-	// while mutual information between certain nodes is 
-	// smaller than a given threshold
-	// the edge is discarded
-	createBaseEdges(edges, infoThreshold);
-
-	// TODO: if it cv_asserts here they really won't know why.
+	if(maxPartners > 0) {
+		// the maximum weight spanning forest of the counted partners,
+		// joined into a tree
+		createPartnerSpanningTree(edges, infoThreshold);
+	} else if(!createMaxSpanningTree(edges, infoThreshold, numThreads)) {
+		// the maximum weight spanning tree of the complete graph, using
+		// mutual information between nodes. Pairs with less information
+		// than the threshold are never linked
+		CV_Error(CV_StsError, "Chow-Liu tree could not be connected with "
+			"the given information threshold");
+	}
 
-	// reduce the complete graph to a maximum weight spanning tree
-	CV_Assert(reduceEdgesToMinSpan(edges));
+	// the tree is rooted at the most informative edge
+	edges.sort(sortInfoScores);
 
 	// rearrange the data structure
 	// put the cltree in a 4-by-N matrix
@@ -106,49 +111,535 @@ Mat ChowLiuTree::make(double infoThreshold) {
 	return buildTree(edges.front().word1, edges);
 }
 
+// number of set bits in the AND of two bitsets
+static inline int popcount(uint64 x) {
+#if defined(__GNUC__)
+	return __builtin_popcountll(x);
+#else
+	x = x - ((x >> 1) & 0x5555555555555555ULL);
+	x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+	x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+	return (int)((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+static int countAnd(const uint64 *a, const uint64 *b, int nBlocks) {
+	int i = 0, count = 0;
+#if defined(__AVX512VPOPCNTDQ__) && defined(__AVX512F__)
+	__m512i sum = _mm512_setzero_si512();
+	for (; i + 8 <= nBlocks; i += 8) {
+		__m512i v = _mm512_and_si512(_mm512_loadu_si512(a + i),
+			_mm512_loadu_si512(b + i));
+		sum = _mm512_add_epi64(sum, _mm512_popcnt_epi64(v));
+	}
+	count += (int)_mm512_reduce_add_epi64(sum);
+#elif defined(__AVX2__)
+	// per-nibble table look-up, summed into 64 bit lanes
+	const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3,
+		1, 2, 2, 3, 2, 3, 3, 4, 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i lowMask = _mm256_set1_epi8(0x0f);
+	__m256i sum = _mm256_setzero_si256();
+	for (; i + 4 <= nBlocks; i += 4) {
+		__m256i v = _mm256_and_si256(
+			_mm256_loadu_si256((const __m256i *)(a + i)),
+			_mm256_loadu_si256((const __m256i *)(b + i)));
+		__m256i lo = _mm256_shuffle_epi8(lookup,
+			_mm256_and_si256(v, lowMask));
+		__m256i hi = _mm256_shuffle_epi8(lookup,
+			_mm256_and_si256(_mm256_srli_epi16(v, 4), lowMask));
+		sum = _mm256_add_epi64(sum, _mm256_sad_epu8(_mm256_add_epi8(lo, hi),
+			_mm256_setzero_si256()));
+	}
+	uint64 lanes[4];
+	_mm256_storeu_si256((__m256i *)lanes, sum);
+	count += (int)(lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+#endif
+	for (; i < nBlocks; i++) {
+		count += popcount(a[i] & b[i]);
+	}
+	return count;
+}
+
+// count the descriptors added since the last update into the statistics
+void ChowLiuTree::updateStatistics(int numThreads) {
+
+	if (imgDescriptors.empty()) {
+		return;
+	}
+
+	if (wordCounts.empty()) {
+		nWords = imgDescriptors[0].cols;
+		wordCounts.assign(nWords, 0);
+		if (maxPartners > 0) {
+			partnerCounts.assign(nWords, vector<std::pair<int, int> >());
+		} else {
+			pairCounts.assign(nWords, vector<std::pair<int, int> >());
+		}
+	}
+	CV_Assert(imgDescriptors[0].cols == nWords);
+
+#ifdef _OPENMP
+	if (numThreads <= 0) numThreads = omp_get_max_threads();
+#endif
+	if (maxPartners > 0) {
+		countPartners(numThreads);
+	} else {
+		countPairs(numThreads);
+	}
+
+	imgDescriptors.clear();
+}
+
+// add counts, in word order, to a list of (word, count) in word order
+static void addCounts(vector<std::pair<int, int> >& list,
+					  const vector<std::pair<int, int> >& counts) {
+	vector<std::pair<int, int> > merged;
+	merged.reserve(list.size() + counts.size());
+
+	size_t i = 0, j = 0;
+	while (i < list.size() || j < counts.size()) {
+		if (j == counts.size() ||
+			(i < list.size() && list[i].first < counts[j].first)) {
+			merged.push_back(list[i++]);
+		} else if (i == list.size() || counts[j].first < list[i].first) {
+			merged.push_back(counts[j++]);
+		} else {
+			merged.push_back(std::make_pair(list[i].first,
+				list[i].second + counts[j].second));
+			i++; j++;
+		}
+	}
+	list.swap(merged);
+}
+
+// the batch is packed into word-major bitsets, one bit per image, so the
+// joint count of two words is an AND and a popcount. Only the words present
+// in the batch are paired
+void ChowLiuTree::countPairs(int numThreads) {
+
+	int batchImages = 0;
+	for (size_t i = 0; i < imgDescriptors.size(); i++)
+		batchImages += imgDescriptors[i].rows;
+	int nBlocks = (batchImages + 63) / 64;
+
+	vector<uint64> wordBits((size_t)nWords * nBlocks, 0);
+	vector<char> present(nWords, false);
+	for (size_t i = 0, img = 0; i < imgDescriptors.size(); i++) {
+		for (int j = 0; j < imgDescriptors[i].rows; j++, img++) {
+			const float *z = imgDescriptors[i].ptr<float>(j);
+			uint64 bit = (uint64)1 << (img % 64);
+			for (int q = 0; q < nWords; q++) {
+				if (z[q] > 0) {
+					wordBits[(size_t)q * nBlocks + img / 64] |= bit;
+					wordCounts[q]++;
+					present[q] = true;
+				}
+			}
+		}
+	}
+	nImages += batchImages;
+
+	vector<int> words;
+	for (int q = 0; q < nWords; q++) {
+		if (present[q]) words.push_back(q);
+	}
+	int nPresent = (int)words.size();
+
+	// each word1 updates only its own pairs
+#ifdef _OPENMP
+#pragma omp parallel num_threads(numThreads)
+#endif
+	{
+		vector<std::pair<int, int> > counts;
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+		for (int i = 0; i < nPresent - 1; i++) {
+			int word1 = words[i];
+			const uint64 *bits1 = &wordBits[(size_t)word1 * nBlocks];
+			counts.clear();
+			for (int j = i + 1; j < nPresent; j++) {
+				int countAB = countAnd(bits1,
+					&wordBits[(size_t)words[j] * nBlocks], nBlocks);
+				if (countAB) {
+					counts.push_back(std::make_pair(words[j], countAB));
+				}
+			}
+			addCounts(pairCounts[word1], counts);
+		}
+	}
+}
+
+// the words present in each image of the batch are listed, so the words
+// seen with word q are gathered from the images q is present in. Only the
+// maxPartners most frequent partners of each word are kept, a pair pruned
+// from one batch starting its count again if it returns
+void ChowLiuTree::countPartners(int numThreads) {
+
+	vector<vector<int> > imageWords;
+	vector<vector<int> > wordImages(nWords);
+	for (size_t i = 0; i < imgDescriptors.size(); i++) {
+		for (int j = 0; j < imgDescriptors[i].rows; j++) {
+			const float *z = imgDescriptors[i].ptr<float>(j);
+			int img = (int)imageWords.size();
+			imageWords.push_back(vector<int>());
+			for (int q = 0; q < nWords; q++) {
+				if (z[q] > 0) {
+					imageWords[img].push_back(q);
+					wordImages[q].push_back(img);
+					wordCounts[q]++;
+				}
+			}
+		}
+	}
+	nImages += (int)imageWords.size();
+
+	// each word updates only its own partners
+#ifdef _OPENMP
+#pragma omp parallel num_threads(numThreads)
+#endif
+	{
+		vector<int> batchCounts(nWords, 0);
+		vector<int> touched;
+		vector<std::pair<int, int> > counts;
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+		for (int word1 = 0; word1 < nWords; word1++) {
+			for (size_t i = 0; i < wordImages[word1].size(); i++) {
+				const vector<int>& words = imageWords[wordImages[word1][i]];
+				for (size_t j = 0; j < words.size(); j++) {
+					if (words[j] != word1 && batchCounts[words[j]]++ == 0) {
+						touched.push_back(words[j]);
+					}
+				}
+			}
+			std::sort(touched.begin(), touched.end());
+			counts.clear();
+			for (size_t i = 0; i < touched.size(); i++) {
+				counts.push_back(std::make_pair(touched[i],
+					batchCounts[touched[i]]));
+				batchCounts[touched[i]] = 0;
+			}
+			touched.clear();
+			addPartnerCounts(word1, counts);
+		}
+	}
+}
+
+// more co-occurrences, then lower word
+static bool morePartnerCounts(const std::pair<int, int>& first,
+							  const std::pair<int, int>& second) {
+	if (first.second != second.second) return first.second > second.second;
+	return first.first < second.first;
+}
+
+// add the co-occurrence counts, in word order, to the partners of word q
+void ChowLiuTree::addPartnerCounts(int q,
+								   const vector<std::pair<int, int> >& counts) {
+	vector<std::pair<int, int> >& partners = partnerCounts[q];
+	addCounts(partners, counts);
+
+	if ((int)partners.size() > maxPartners) {
+		std::sort(partners.begin(), partners.end(), morePartnerCounts);
+		partners.resize(maxPartners);
+		std::sort(partners.begin(), partners.end());
+	}
+}
+
+void ChowLiuTree::updateStatistics(BOWDescriptorReader& reader,
+									int chunkRows, int numThreads) {
+	CV_Assert(chunkRows > 0);
+	updateStatistics(numThreads);
+
+	Mat chunk;
+	while (reader.read(chunk, chunkRows)) {
+		add(chunk);
+		updateStatistics(numThreads);
+	}
+}
+
+void ChowLiuTree::merge(const ChowLiuTree& other) {
+	if (!other.wordCounts.empty()) {
+		CV_Assert(other.maxPartners == maxPartners);
+		if (wordCounts.empty()) {
+			nWords = other.nWords;
+			wordCounts.assign(nWords, 0);
+			pairCounts.assign(other.pairCounts.size(),
+				vector<std::pair<int, int> >());
+			partnerCounts.assign(other.partnerCounts.size(),
+				vector<std::pair<int, int> >());
+		}
+		CV_Assert(other.nWords == nWords);
+		nImages += other.nImages;
+		for (int q = 0; q < nWords; q++) {
+			wordCounts[q] += other.wordCounts[q];
+		}
+		for (size_t q = 0; q < pairCounts.size(); q++) {
+			addCounts(pairCounts[q], other.pairCounts[q]);
+		}
+		for (size_t q = 0; q < partnerCounts.size(); q++) {
+			addPartnerCounts((int)q, other.partnerCounts[q]);
+		}
+	}
+	add(other.imgDescriptors);
+}
+
+// lists of (word, count) pairs are stored concatenated, with the offset of
+// the first pair of each list
+typedef vector<vector<std::pair<int, int> > > PairLists;
+
+static void packLists(const PairLists& lists, Mat& offsets, Mat& words,
+					  Mat& counts) {
+	vector<int> listOffsets(1, 0), listWords, listCounts;
+	for (size_t q = 0; q < lists.size(); q++) {
+		for (size_t i = 0; i < lists[q].size(); i++) {
+			listWords.push_back(lists[q][i].first);
+			listCounts.push_back(lists[q][i].second);
+		}
+		listOffsets.push_back((int)listWords.size());
+	}
+	Mat(listOffsets).copyTo(offsets);
+	Mat(listWords).copyTo(words);
+	Mat(listCounts).copyTo(counts);
+}
+
+static void unpackLists(const Mat& offsets, const Mat& words,
+						const Mat& counts, int nWords, PairLists& lists) {
+	CV_Assert(offsets.type() == CV_32S &&
+		offsets.total() == (size_t)nWords + 1);
+	CV_Assert(words.total() == counts.total() &&
+		(int)words.total() == offsets.at<int>(nWords));
+	CV_Assert(words.empty() ||
+		(words.type() == CV_32S && counts.type() == CV_32S));
+	lists.assign(nWords, vector<std::pair<int, int> >());
+	for (int q = 0; q < nWords; q++) {
+		int first = offsets.at<int>(q), last = offsets.at<int>(q + 1);
+		CV_Assert(first >= 0 && first <= last);
+		for (int i = first; i < last; i++) {
+			int word = words.at<int>(i);
+			CV_Assert(word >= 0 && word < nWords);
+			lists[q].push_back(std::make_pair(word, counts.at<int>(i)));
+		}
+	}
+}
+
+// the pair counts are saved as they are kept: only the pairs seen
+// together, each listed under the lower word of the pair
+void ChowLiuTree::getPairLists(Mat& offsets, Mat& words, Mat& counts) const {
+	packLists(maxPartners > 0 ? partnerCounts : pairCounts, offsets, words,
+		counts);
+}
+
+void ChowLiuTree::setPairLists(const Mat& offsets, const Mat& words,
+							   const Mat& counts) {
+	PairLists pairs;
+	unpackLists(offsets, words, counts, nWords, pairs);
+	for (int a = 0; a < nWords; a++) {
+		for (size_t i = 0; i < pairs[a].size(); i++) {
+			CV_Assert(i == 0 || pairs[a][i - 1].first < pairs[a][i].first);
+			CV_Assert(maxPartners > 0 || pairs[a][i].first > a);
+		}
+	}
+	if (maxPartners > 0) {
+		partnerCounts.swap(pairs);
+	} else {
+		pairCounts.swap(pairs);
+	}
+}
+
+void ChowLiuTree::write(cv::FileStorage& fs) const {
+	// descriptors are only saved once counted
+	CV_Assert(imgDescriptors.empty());
+	Mat offsets, words, counts;
+	getPairLists(offsets, words, counts);
+
+	fs << "ChowLiuStatistics" << "{";
+	fs << "NumImages" << nImages;
+	fs << "MaxPartners" << maxPartners;
+	fs << "WordCounts" << Mat(wordCounts);
+	fs << "PairOffsets" << offsets;
+	fs << "PairWords" << words;
+	fs << "PairCounts" << counts;
+	fs << "}";
+}
+
+bool ChowLiuTree::read(const cv::FileNode& fn) {
+	cv::FileNode statistics = fn["ChowLiuStatistics"];
+
+	// statistics counted with another number of partners cannot be added to
+	if ((int)statistics["MaxPartners"] != maxPartners) {
+		return false;
+	}
+
+	Mat counts;
+	statistics["WordCounts"] >> counts;
+	CV_Assert(counts.type() == CV_32S);
+	nImages = (int)statistics["NumImages"];
+	wordCounts.assign(counts.ptr<int>(), counts.ptr<int>() + counts.total());
+	nWords = (int)wordCounts.size();
+
+	Mat offsets, words;
+	statistics["PairOffsets"] >> offsets;
+	statistics["PairWords"] >> words;
+	statistics["PairCounts"] >> counts;
+	if (offsets.empty() && maxPartners == 0) {
+		// earlier statistics hold every pair count, as the packed upper
+		// triangle of the pair matrix
+		CV_Assert(counts.type() == CV_32S || counts.empty());
+		CV_Assert(counts.total() == (size_t)nWords * (nWords - 1) / 2);
+		const int *triangle = counts.ptr<int>();
+		pairCounts.assign(nWords, vector<std::pair<int, int> >());
+		for (int a = 0; a < nWords; a++) {
+			for (int b = a + 1; b < nWords; b++, triangle++) {
+				if (*triangle) {
+					pairCounts[a].push_back(std::make_pair(b, *triangle));
+				}
+			}
+		}
+		return true;
+	}
+	setPairLists(offsets, words, counts);
+	return true;
+}
+
+void ChowLiuTree::write(MatrixFile& file) const {
+	CV_Assert(imgDescriptors.empty());
+	Mat offsets, words, counts;
+	getPairLists(offsets, words, counts);
+
+	int header[] = {nImages, maxPartners};
+	file.write("ChowLiuStatistics", Mat(1, 2, CV_32S, header));
+	file.write("ChowLiuStatistics.WordCounts", Mat(wordCounts));
+	file.write("ChowLiuStatistics.PairOffsets", offsets);
+	file.write("ChowLiuStatistics.PairWords", words);
+	file.write("ChowLiuStatistics.PairCounts", counts);
+}
+
+bool ChowLiuTree::read(MatrixFile& file) {
+	Mat header;
+	file.read("ChowLiuStatistics", header);
+	if (header.type() != CV_32S || header.total() != 2) {
+		CV_Error(CV_StsParseError, "no Chow-Liu statistics found");
+	}
+	if (header.at<int>(1) != maxPartners) {
+		return false;
+	}
+
+	Mat counts, offsets, words;
+	file.read("ChowLiuStatistics.WordCounts", counts);
+	CV_Assert(counts.type() == CV_32S || counts.empty());
+	nImages = header.at<int>(0);
+	wordCounts.assign(counts.ptr<int>(), counts.ptr<int>() + counts.total());
+	nWords = (int)wordCounts.size();
+
+	file.read("ChowLiuStatistics.PairOffsets", offsets);
+	file.read("ChowLiuStatistics.PairWords", words);
+	file.read("ChowLiuStatistics.PairCounts", counts);
+	setPairLists(offsets, words, counts);
+	return true;
+}
+
+void ChowLiuTree::permuteWords(const WordOrder& order) {
+	CV_Assert(imgDescriptors.empty());
+	const vector<int>& oldToNew = order.getOldToNew();
+	CV_Assert((int)oldToNew.size() == nWords);
+
+	vector<int> counts(nWords);
+	for (int q = 0; q < nWords; q++) {
+		counts[oldToNew[q]] = wordCounts[q];
+	}
+	wordCounts.swap(counts);
+
+	if (maxPartners > 0) {
+		PairLists partners(nWords);
+		for (int q = 0; q < nWords; q++) {
+			vector<std::pair<int, int> >& renumbered = partners[oldToNew[q]];
+			renumbered = partnerCounts[q];
+			for (size_t i = 0; i < renumbered.size(); i++) {
+				renumbered[i].first = oldToNew[renumbered[i].first];
+			}
+			std::sort(renumbered.begin(), renumbered.end());
+		}
+		partnerCounts.swap(partners);
+		return;
+	}
+
+	// each pair is listed again under whichever word is now the lower
+	PairLists pairs(nWords);
+	for (int a = 0; a < nWords; a++) {
+		for (size_t i = 0; i < pairCounts[a].size(); i++) {
+			int newA = oldToNew[a], newB = oldToNew[pairCounts[a][i].first];
+			pairs[std::min(newA, newB)].push_back(
+				std::make_pair(std::max(newA, newB), pairCounts[a][i].second));
+		}
+	}
+	for (int q = 0; q < nWords; q++) {
+		std::sort(pairs[q].begin(), pairs[q].end());
+	}
+	pairCounts.swap(pairs);
+}
+
+// the count of word q in a list of (word, count), 0 if it is not listed
+static int partnerCount(const vector<std::pair<int, int> >& partners, int q) {
+	vector<std::pair<int, int> >::const_iterator partner =
+		std::lower_bound(partners.begin(), partners.end(),
+		std::make_pair(q, 0));
+	return partner != partners.end() && partner->first == q ?
+		partner->second : 0;
+}
+
+int ChowLiuTree::countJoint(int a, int b) {
+	if (maxPartners > 0) {
+		// each word may have kept the other as a partner, with counts that
+		// differ if the pair was pruned from one of them for a while. Pairs
+		// neither kept are taken never to occur together
+		return std::max(partnerCount(partnerCounts[a], b),
+			partnerCount(partnerCounts[b], a));
+	}
+	return a < b ? partnerCount(pairCounts[a], b) :
+		partnerCount(pairCounts[b], a);
+}
+
 double ChowLiuTree::P(int a, bool za) {
 
 	if(za) {
 		// ??
 		// what's the function of 0.98
 		// smoothing factor??
-		return (0.98 * cv::countNonZero(mergedImgDescriptors.col(a)) / 
-			mergedImgDescriptors.rows) + 0.01;
+		return (0.98 * wordCounts[a] / nImages) + 0.01;
 	} else {
-		return 1 - ((0.98 * cv::countNonZero(mergedImgDescriptors.col(a)) / 
-			mergedImgDescriptors.rows) + 0.01);
+		return 1 - ((0.98 * wordCounts[a] / nImages) + 0.01);
 	}
 
 }
-// compute the joint probability P( ea == za && eb = zb )
-// mergedImgDescriptors is a collection of image descriptors from all the images
-double ChowLiuTree::JP(int a, bool za, int b, bool zb) {
+// compute the joint probability P( ea == za && eb = zb ) from the number of
+// images containing both words
+double ChowLiuTree::JP(int a, bool za, int b, bool zb, int countAB) {
+	return count(a, za, b, zb, countAB) / (double)nImages;
+}
 
-	double count = 0;
-	for(int i = 0; i < mergedImgDescriptors.rows; i++) {
-		if((mergedImgDescriptors.at<float>(i,a) > 0) == za && 
-			(mergedImgDescriptors.at<float>(i,b) > 0) == zb) {
-				count++;
-		}
+// number of images with ea == za && eb == zb
+int ChowLiuTree::count(int a, bool za, int b, bool zb, int countAB) {
+	if(za && zb) {
+		return countAB;
+	} else if(za) {
+		return wordCounts[a] - countAB;
+	} else if(zb) {
+		return wordCounts[b] - countAB;
+	} else {
+		return nImages - wordCounts[a] - wordCounts[b] + countAB;
 	}
-	return count / mergedImgDescriptors.rows;
-
 }
+
 double ChowLiuTree::CP(int a, bool za, int b, bool zb){
 
 	// total: frequency of b=zb
 	// count: frequency of b=zb and a=za
-	int count = 0, total = 0;
-	for(int i = 0; i < mergedImgDescriptors.rows; i++) {
-		if((mergedImgDescriptors.at<float>(i,b) > 0) == zb) {
-			total++;
-			if((mergedImgDescriptors.at<float>(i,a) > 0) == za) {
-				count++;
-			}
-		}
-	}
+	int countAB = countJoint(a, b);
+	int total = zb ? wordCounts[b] : nImages - wordCounts[b];
 	if(total) {
-		return (double)(0.98 * count)/total + 0.01;
+		return (double)(0.98 * count(a, za, b, zb, countAB))/total + 0.01;
 	} else {
 		// pseudo-bayes estimator??
 		return (za) ? 0.01 : 0.99;
@@ -157,32 +648,48 @@ double ChowLiuTree::CP(int a, bool za, int b, bool zb){
 
 cv::Mat ChowLiuTree::buildTree(int root_word, list<info> &edges) {
 
-	int q = root_word;
-	cv::Mat cltree(4, edges.size()+1, CV_64F);
+	int nWords = (int)edges.size() + 1;
 
+	// adjacency list of the spanning tree
+	vector<vector<int> > adjacent(nWords);
+	for(list<info>::iterator edge = edges.begin(); edge != edges.end();
+		edge++) {
+		adjacent[edge->word1].push_back(edge->word2);
+		adjacent[edge->word2].push_back(edge->word1);
+	}
+
+	cv::Mat cltree(4, nWords, CV_64F);
+
+	//setting P(zq|zpq) to P(zq) gives the root node of the chow-liu 
+	//independence from a parent node.
+	int q = root_word;
 	cltree.at<double>(0, q) = q;
 	cltree.at<double>(1, q) = P(q, true);
 	cltree.at<double>(2, q) = P(q, true);
 	cltree.at<double>(3, q) = P(q, true);
-	//setting P(zq|zpq) to P(zq) gives the root node of the chow-liu 
-	//independence from a parent node.
-
-	//find all children and do the same
-	vector<int> nextqs = extractChildren(edges, q);
 
-	int pq = q;
-	vector<int>::iterator nextq;
-	for(nextq = nextqs.begin(); nextq != nextqs.end(); nextq++) {
-		recAddToTree(cltree, *nextq, pq, edges);
+	//visit the tree breadth first from the root, adding each word with the
+	//word it was reached from as its parent
+	vector<int> parents(nWords, -1);
+	vector<int> order(1, q);
+	parents[q] = q;
+	for(size_t i = 0; i < order.size(); i++) {
+		int pq = order[i];
+		vector<int>::iterator nextq;
+		for(nextq = adjacent[pq].begin(); nextq != adjacent[pq].end(); nextq++) {
+			if(parents[*nextq] < 0) {
+				parents[*nextq] = pq;
+				order.push_back(*nextq);
+				addToTree(cltree, *nextq, pq);
+			}
+		}
 	}
+	CV_Assert((int)order.size() == nWords);
 
 	return cltree;
-
-
 }
 
-void ChowLiuTree::recAddToTree(cv::Mat &cltree, int q, int pq, 
-							   list<info>& remaining_edges) {
+void ChowLiuTree::addToTree(cv::Mat &cltree, int q, int pq) {
 
 	/*
 	** Configuration of cltree
@@ -196,112 +703,164 @@ void ChowLiuTree::recAddToTree(cv::Mat &cltree, int q, int pq,
 	cltree.at<double>(1, q) = P(q, true);
 	cltree.at<double>(2, q) = CP(q, true, pq, true);
 	cltree.at<double>(3, q) = CP(q, true, pq, false);
-
-	//find all children and do the same
-	vector<int> nextqs = extractChildren(remaining_edges, q);
-
-	pq = q;
-	vector<int>::iterator nextq;
-	for(nextq = nextqs.begin(); nextq != nextqs.end(); nextq++) {
-		recAddToTree(cltree, *nextq, pq, remaining_edges);
-	}
-}
-
-vector<int> ChowLiuTree::extractChildren(list<info> &remaining_edges, int q) {
-
-	vector<int> children;
-	list<info>::iterator edge = remaining_edges.begin();
-
-	while(edge != remaining_edges.end()) {
-		if(edge->word1 == q) {
-			children.push_back(edge->word2);
-			edge = remaining_edges.erase(edge);
-			continue;
-		}
-		if(edge->word2 == q) {
-			children.push_back(edge->word1);
-			edge = remaining_edges.erase(edge);
-			continue;
-		}
-		edge++;
-	}
-
-	return children;
 }
 
+// decreasing information, then increasing word order
 bool ChowLiuTree::sortInfoScores(const info& first, const info& second) {
-	return first.score > second.score;
+	if(first.score != second.score) return first.score > second.score;
+	if(first.word1 != second.word1) return first.word1 < second.word1;
+	return first.word2 < second.word2;
 }
 
-double ChowLiuTree::calcMutInfo(int word1, int word2) {
+double ChowLiuTree::calcMutInfo(int word1, int word2, int count12) {
 	double accumulation = 0;
 
-	double P00 = JP(word1, false, word2, false);
+	double P00 = JP(word1, false, word2, false, count12);
 	if(P00) accumulation += P00 * log(P00 / (P(word1, false)*P(word2, false)));
 
-	double P01 = JP(word1, false, word2, true);
+	double P01 = JP(word1, false, word2, true, count12);
 	if(P01) accumulation += P01 * log(P01 / (P(word1, false)*P(word2, true)));
 
-	double P10 = JP(word1, true, word2, false);
+	double P10 = JP(word1, true, word2, false, count12);
 	if(P10) accumulation += P10 * log(P10 / (P(word1, true)*P(word2, false)));
 
-	double P11 = JP(word1, true, word2, true);
+	double P11 = JP(word1, true, word2, true, count12);
 	if(P11) accumulation += P11 * log(P11 / (P(word1, true)*P(word2, true)));
 
 	return accumulation;
 }
 
-// build the complete graph
-// when mutual information between two nodes is smaller than the threshold
-// discard the edge connecting these two nodes
-void ChowLiuTree::createBaseEdges(list<info>& edges, double infoThreshold) {
-
-	int nWords = imgDescriptors[0].cols;
-	info mutInfo;
+// find the maximum weight spanning tree of the complete graph weighted by
+// mutual information with Prim's algorithm. The information between a pair
+// of words is computed when the first of them joins the tree, so only the
+// best link of each remaining word is stored rather than every edge. Links
+// with less information than the threshold are not used
+bool ChowLiuTree::createMaxSpanningTree(list<info>& edges,
+										double infoThreshold,
+										int numThreads) {
+
+	vector<double> bestScore(nWords, -DBL_MAX);
+	vector<int> bestLink(nWords, -1);
+	vector<char> inTree(nWords, false);
+
+#ifdef _OPENMP
+	if (numThreads <= 0) numThreads = omp_get_max_threads();
+#endif
+	int word1 = 0;
+	for(int added = 1; added < nWords; added++) {
+		inTree[word1] = true;
+
+		// every remaining word is scored against the word just added
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(numThreads)
+#endif
+		for(int word2 = 0; word2 < nWords; word2++) {
+			if(inTree[word2]) continue;
+			int a = std::min(word1, word2), b = std::max(word1, word2);
+			double score = calcMutInfo(a, b, countJoint(a, b));
+			if(score >= infoThreshold && score > bestScore[word2]) {
+				bestScore[word2] = score;
+				bestLink[word2] = word1;
+			}
+		}
 
-	for(int word1 = 0; word1 < nWords; word1++) {
-		for(int word2 = word1 + 1; word2 < nWords; word2++) {
-			mutInfo.word1 = word1;
-			mutInfo.word2 = word2;
-			mutInfo.score = (float)calcMutInfo(word1, word2);
-			if(mutInfo.score >= infoThreshold)
-			edges.push_back(mutInfo);
+		// the remaining word with the most informative link joins next,
+		// the lowest word on ties so the tree does not depend on the
+		// thread count
+		int next = -1;
+		for(int word2 = 0; word2 < nWords; word2++) {
+			if(!inTree[word2] && bestLink[word2] >= 0 &&
+				(next < 0 || bestScore[word2] > bestScore[next])) {
+				next = word2;
+			}
+		}
+		if(next < 0) {
+			// no remaining word is linked above the threshold
+			return false;
 		}
+
+		info edge;
+		edge.word1 = std::min(next, bestLink[next]);
+		edge.word2 = std::max(next, bestLink[next]);
+		edge.score = (float)bestScore[next];
+		edges.push_back(edge);
+		word1 = next;
 	}
-	// since edges is a list of info
-	// call call function to sort
-	// sortInfoScores is a comparision function
-	// in decreasing order
-	// since what we want to find is a 
-	// maximum weight spanning tree
-	edges.sort(sortInfoScores);
+	return true;
 }
 
-bool ChowLiuTree::reduceEdgesToMinSpan(list<info>& edges) {
-
-	map<int, int> groups; map<int, int>::iterator groupIt;
-	for(int i = 0; i < imgDescriptors[0].cols; i++) groups[i] = i;
-	int group1, group2;
+// the representative of the component of word q, halving the path to it
+static int findComponent(vector<int>& components, int q) {
+	while (components[q] != q) {
+		components[q] = components[components[q]];
+		q = components[q];
+	}
+	return q;
+}
 
-	list<info>::iterator edge = edges.begin();
-	while(edge != edges.end()) {
-		if(groups[edge->word1] != groups[edge->word2]) {
-			group1 = groups[edge->word1];
-			group2 = groups[edge->word2];
-			for(groupIt = groups.begin(); groupIt != groups.end(); groupIt++)
-			if(groupIt->second == group2) groupIt->second = group1;
-			edge++;
-		} else {
-			edge = edges.erase(edge);
+// find the maximum weight spanning forest of the counted partner pairs
+// with Kruskal's algorithm. Words left in separate components share no
+// pair informative enough to be counted, so each component is joined by
+// its most frequent word to the most frequent word of the vocabulary
+// regardless of the threshold
+void ChowLiuTree::createPartnerSpanningTree(list<info>& edges,
+											double infoThreshold) {
+
+	vector<info> candidates;
+	for (int a = 0; a < nWords; a++) {
+		for (size_t i = 0; i < partnerCounts[a].size(); i++) {
+			int b = partnerCounts[a][i].first;
+			// pairs kept by both words are scored once
+			if (b < a && partnerCount(partnerCounts[b], a)) {
+				continue;
+			}
+			info edge;
+			edge.word1 = std::min(a, b);
+			edge.word2 = std::max(a, b);
+			edge.score = (float)calcMutInfo(edge.word1, edge.word2,
+				countJoint(edge.word1, edge.word2));
+			if (edge.score >= infoThreshold) {
+				candidates.push_back(edge);
+			}
 		}
 	}
+	std::sort(candidates.begin(), candidates.end(), sortInfoScores);
 
-	if(edges.size() != (unsigned int)imgDescriptors[0].cols - 1) {
-		return false;
-	} else {
-		return true;
+	vector<int> components(nWords);
+	for (int q = 0; q < nWords; q++) {
+		components[q] = q;
+	}
+	for (size_t i = 0; i < candidates.size(); i++) {
+		int a = findComponent(components, candidates[i].word1);
+		int b = findComponent(components, candidates[i].word2);
+		if (a != b) {
+			components[a] = b;
+			edges.push_back(candidates[i]);
+		}
 	}
 
+	// the most frequent word of each component, the lowest on ties
+	vector<int> frequent(nWords, -1);
+	int hub = 0;
+	for (int q = 0; q < nWords; q++) {
+		int c = findComponent(components, q);
+		if (frequent[c] < 0 || wordCounts[q] > wordCounts[frequent[c]]) {
+			frequent[c] = q;
+		}
+		if (wordCounts[q] > wordCounts[hub]) {
+			hub = q;
+		}
+	}
+	int hubComponent = findComponent(components, hub);
+	for (int c = 0; c < nWords; c++) {
+		if (frequent[c] < 0 || c == hubComponent) continue;
+		info edge;
+		edge.word1 = std::min(frequent[c], hub);
+		edge.word2 = std::max(frequent[c], hub);
+		edge.score = (float)calcMutInfo(edge.word1, edge.word2,
+			countJoint(edge.word1, edge.word2));
+		edges.push_back(edge);
+	}
 }
 
 }
@@ -28,6 +28,7 @@
 
 // git test
 #include "../include/openfabmap.hpp"
+#include <climits>
 
 using std::vector;
 using std::list;
@@ -52,7 +53,19 @@ FabMap::FabMap(const Mat& _clTree, double _PzGe,
 		double _PzGNe, int _flags, int _numSamples) :
 	clTree(_clTree), PzGe(_PzGe), PzGNe(_PzGNe), flags(
 			_flags), numSamples(_numSamples) {
-	
+	init();
+}
+
+FabMap::FabMap(const cv::Ptr<FabMapModel>& _model, int _flags,
+		int _numSamples) :
+	model(_model), clTree(_model->getTree()), PzGe(_model->getPzGe()),
+	PzGNe(_model->getPzGNe()), flags((_flags & ~(NAIVE_BAYES | CHOW_LIU)) |
+			_model->getFlags()), numSamples(_numSamples) {
+	init();
+}
+
+void FabMap::init() {
+
 	CV_Assert(flags & MEAN_FIELD || flags & SAMPLED);
 	CV_Assert(flags & NAIVE_BAYES || flags & CHOW_LIU);
 	if (flags & NAIVE_BAYES) {
@@ -72,6 +85,7 @@ FabMap::FabMap(const Mat& _clTree, double _PzGe,
 	Pnew = 0.9;
 	sFactor = 0.99;
 	mBias = 0.5;
+	incrementalThreshold = 0.25;
 }
 
 FabMap::~FabMap() {
@@ -85,6 +99,58 @@ const std::vector<cv::Mat>& FabMap::getTestImgDescriptors() const {
 	return testImgDescriptors;
 }
 
+void FabMap::setIncrementalThreshold(double threshold) {
+	CV_Assert(threshold >= 0 && threshold <= 1);
+	incrementalThreshold = threshold;
+}
+
+void FabMap::checkImgDescriptor(const Mat& imgDescriptor) const {
+	CV_Assert(!imgDescriptor.empty());
+	CV_Assert(imgDescriptor.rows == 1);
+	if (imgDescriptor.type() == CV_32S) {
+		const int *words = imgDescriptor.ptr<int>();
+		for (int i = 0; i < imgDescriptor.cols; i++) {
+			CV_Assert(words[i] >= 0 && words[i] < clTree.cols);
+		}
+	} else {
+		CV_Assert(imgDescriptor.cols == clTree.cols);
+		CV_Assert(imgDescriptor.type() == CV_32F);
+	}
+}
+
+// word lists are expanded into word counts of one
+Mat FabMap::denseImgDescriptor(const Mat& imgDescriptor) const {
+	checkImgDescriptor(imgDescriptor);
+	if (imgDescriptor.type() == CV_32F) {
+		return imgDescriptor;
+	}
+	Mat dense = Mat::zeros(1, clTree.cols, CV_32F);
+	const int *words = imgDescriptor.ptr<int>();
+	for (int i = 0; i < imgDescriptor.cols; i++) {
+		dense.at<float>(0, words[i]) = 1;
+	}
+	return dense;
+}
+
+// the words present in an image, in word order
+void FabMap::getPresentWords(const Mat& imgDescriptor,
+		vector<int>& words) const {
+	words.clear();
+	if (imgDescriptor.type() == CV_32S) {
+		const int *list = imgDescriptor.ptr<int>();
+		words.assign(list, list + imgDescriptor.cols);
+		std::sort(words.begin(), words.end());
+		words.erase(std::unique(words.begin(), words.end()), words.end());
+	} else {
+		const float *z = imgDescriptor.ptr<float>();
+		for (int q = 0; q < clTree.cols; q++) {
+			if (z[q] > 0) {
+				words.push_back(q);
+			}
+		}
+	}
+}
+
 // addTraining is used to add image descriptors to
 // trainingImgDescriptors which is a collection of 
 // image descriptors
@@ -102,11 +168,8 @@ void FabMap::addTraining(const Mat& queryImgDescriptor) {
 
 void FabMap::addTraining(const vector<Mat>& queryImgDescriptors) {
 	for (size_t i = 0; i < queryImgDescriptors.size(); i++) {
-		CV_Assert(!queryImgDescriptors[i].empty());
-		CV_Assert(queryImgDescriptors[i].rows == 1);
-		CV_Assert(queryImgDescriptors[i].cols == clTree.cols);
-		CV_Assert(queryImgDescriptors[i].type() == CV_32F);
-		trainingImgDescriptors.push_back(queryImgDescriptors[i]);
+		trainingImgDescriptors.push_back(
+			denseImgDescriptor(queryImgDescriptors[i]));
 	}
 }
 
@@ -121,11 +184,8 @@ void FabMap::add(const cv::Mat& queryImgDescriptor) {
 
 void FabMap::add(const std::vector<cv::Mat>& queryImgDescriptors) {
 	for (size_t i = 0; i < queryImgDescriptors.size(); i++) {
-		CV_Assert(!queryImgDescriptors[i].empty());
-		CV_Assert(queryImgDescriptors[i].rows == 1);
-		CV_Assert(queryImgDescriptors[i].cols == clTree.cols);
-		CV_Assert(queryImgDescriptors[i].type() == CV_32F);
-		testImgDescriptors.push_back(queryImgDescriptors[i]);
+		testImgDescriptors.push_back(
+			denseImgDescriptor(queryImgDescriptors[i]));
 	}
 }
 
@@ -181,14 +241,10 @@ void FabMap::compare(const vector<Mat>& queryImgDescriptors, vector<
 	// TODO: add first query if empty (is this necessary)
 
 	for (size_t i = 0; i < queryImgDescriptors.size(); i++) {
-		CV_Assert(!queryImgDescriptors[i].empty());
-		CV_Assert(queryImgDescriptors[i].rows == 1);
-		CV_Assert(queryImgDescriptors[i].cols == clTree.cols);
-		CV_Assert(queryImgDescriptors[i].type() == CV_32F);
 
 		// TODO: add mask
 
-		compareImgDescriptor(queryImgDescriptors[i],
+		compareImgDescriptor(denseImgDescriptor(queryImgDescriptors[i]),
 				i, testImgDescriptors, matches);
 		if (addQuery)
 				add(queryImgDescriptors[i]);
@@ -196,28 +252,63 @@ void FabMap::compare(const vector<Mat>& queryImgDescriptors, vector<
 }
 
 void FabMap::compare(const vector<Mat>& queryImgDescriptors,
-		const vector<Mat>& testImgDescriptors,
+		const vector<Mat>& _testImgDescriptors,
 		vector<IMatch>& matches, const Mat& mask) {
 
-	if (&testImgDescriptors != &(this->testImgDescriptors)) {
+	// other test sets are expanded if they hold word lists
+	vector<Mat> denseTestImgDescriptors;
+	const vector<Mat>* testSet = &_testImgDescriptors;
+	if (&_testImgDescriptors != &(this->testImgDescriptors)) {
 		CV_Assert(!(flags & MOTION_MODEL));
-		for (size_t i = 0; i < testImgDescriptors.size(); i++) {
-			CV_Assert(!testImgDescriptors[i].empty());
-			CV_Assert(testImgDescriptors[i].rows == 1);
-			CV_Assert(testImgDescriptors[i].cols == clTree.cols);
-			CV_Assert(testImgDescriptors[i].type() == CV_32F);
+		bool sparse = false;
+		for (size_t i = 0; i < _testImgDescriptors.size(); i++) {
+			checkImgDescriptor(_testImgDescriptors[i]);
+			sparse |= _testImgDescriptors[i].type() == CV_32S;
+		}
+		if (sparse) {
+			for (size_t i = 0; i < _testImgDescriptors.size(); i++) {
+				denseTestImgDescriptors.push_back(
+					denseImgDescriptor(_testImgDescriptors[i]));
+			}
+			testSet = &denseTestImgDescriptors;
 		}
 	}
+	const vector<Mat>& testImgDescriptors = *testSet;
 
+	vector<Mat> denseQueryImgDescriptors;
 	for (size_t i = 0; i < queryImgDescriptors.size(); i++) {
-		CV_Assert(!queryImgDescriptors[i].empty());
-		CV_Assert(queryImgDescriptors[i].rows == 1);
-		CV_Assert(queryImgDescriptors[i].cols == clTree.cols);
-		CV_Assert(queryImgDescriptors[i].type() == CV_32F);
+		denseQueryImgDescriptors.push_back(
+			denseImgDescriptor(queryImgDescriptors[i]));
+	}
+
+	// without the motion model or incremental scoring the queries are
+	// independent, so they are scored together to let the engine block
+	// queries against test images
+	if (denseQueryImgDescriptors.size() > 1 &&
+		!(flags & (MOTION_MODEL | INCREMENTAL))) {
+		vector<vector<IMatch> > queryMatches(denseQueryImgDescriptors.size());
+		for (size_t i = 0; i < denseQueryImgDescriptors.size(); i++) {
+			queryMatches[i].push_back(IMatch((int)i,-1,
+				getNewPlaceLikelihood(denseQueryImgDescriptors[i]),0));
+		}
+		getBatchLikelihoods(denseQueryImgDescriptors, testImgDescriptors,
+			queryMatches);
+		for (size_t i = 0; i < denseQueryImgDescriptors.size(); i++) {
+			normaliseDistribution(queryMatches[i]);
+			for (size_t j = 1; j < queryMatches[i].size(); j++) {
+				queryMatches[i][j].queryIdx = (int)i;
+			}
+			matches.insert(matches.end(), queryMatches[i].begin(),
+				queryMatches[i].end());
+		}
+		return;
+	}
+
+	for (size_t i = 0; i < denseQueryImgDescriptors.size(); i++) {
 
 		// TODO: add mask
 
-		compareImgDescriptor(queryImgDescriptors[i],
+		compareImgDescriptor(denseQueryImgDescriptors[i],
 				i, testImgDescriptors, matches);
 	}
 }
@@ -238,7 +329,15 @@ void FabMap::compareImgDescriptor(const Mat& queryImgDescriptor,
 	// col1: test image index (location) L_i
 	// col2: log likelihood of observation log( P( Z_k|L_i))
 	// col3: normalized probability
-	getLikelihoods(queryImgDescriptor,testImgDescriptors,queryMatches);
+	// only the stored test images are cached, other sets may change between
+	// queries
+	if ((flags & INCREMENTAL) &&
+		&testImgDescriptors == &(this->testImgDescriptors)) {
+		getIncrementalLikelihoods(queryImgDescriptor, testImgDescriptors,
+			testCache, queryMatches);
+	} else {
+		getLikelihoods(queryImgDescriptor,testImgDescriptors,queryMatches);
+	}
 	normaliseDistribution(queryMatches);
 	for (size_t j = 1; j < queryMatches.size(); j++) {
 		queryMatches[j].queryIdx = queryIndex;
@@ -251,6 +350,103 @@ void FabMap::getLikelihoods(const Mat& queryImgDescriptor,
 
 }
 
+void FabMap::getBatchLikelihoods(const vector<Mat>& queryImgDescriptors,
+		const vector<Mat>& testImgDescriptors,
+		vector<vector<IMatch> >& matches) {
+	// one query at a time, only the look-up-table engine blocks them
+	for (size_t i = 0; i < queryImgDescriptors.size(); i++) {
+		getLikelihoods(queryImgDescriptors[i], testImgDescriptors,
+			matches[i]);
+	}
+}
+
+// The location log-likelihood is a sum of per-word terms that only depend on
+// the state (zq, zpq) of each query word. Consecutive video frames share most
+// of their words, so the likelihoods of the last query are corrected for the
+// words whose state changed rather than summed again
+void FabMap::getIncrementalLikelihoods(const Mat& queryImgDescriptor,
+		const vector<Mat>& testImgDescriptors, LikelihoodCache& cache,
+		vector<IMatch>& matches) {
+
+	vector<uchar> wordStates(clTree.cols);
+	for (int q = 0; q < clTree.cols; q++) {
+		wordStates[q] = (queryImgDescriptor.at<float>(0,pq(q)) > 0) +
+			((queryImgDescriptor.at<float>(0, q) > 0) << 1);
+	}
+
+	vector<int> changedWords;
+	if (cache.imgDescriptors == &testImgDescriptors &&
+		cache.likelihoods.size() <= testImgDescriptors.size()) {
+		for (int q = 0; q < clTree.cols; q++) {
+			if (wordStates[q] != cache.wordStates[q]) {
+				changedWords.push_back(q);
+			}
+		}
+		// past the threshold scoring from scratch is cheaper
+		if (changedWords.size() > incrementalThreshold * clTree.cols) {
+			cache.likelihoods.clear();
+		}
+	} else {
+		cache.likelihoods.clear();
+	}
+
+	if (cache.likelihoods.empty()) {
+		vector<IMatch> fullMatches;
+		getLikelihoods(queryImgDescriptor, testImgDescriptors, fullMatches);
+		for (size_t i = 0; i < fullMatches.size(); i++) {
+			cache.likelihoods.push_back(fullMatches[i].likelihood);
+		}
+	} else {
+		if (!changedWords.empty()) {
+			updateLikelihoods(testImgDescriptors, changedWords,
+				cache.wordStates, wordStates, cache.likelihoods);
+		}
+		// images added since the last query are summed in full, as if
+		// no word was present and then corrected for the present words
+		double absentLogP = 0;
+		if (cache.likelihoods.size() < testImgDescriptors.size()) {
+			for (int q = 0; q < clTree.cols; q++) {
+				absentLogP += wordLikelihood(q, wordStates[q], false);
+			}
+		}
+		vector<int> words;
+		for (size_t i = cache.likelihoods.size();
+			i < testImgDescriptors.size(); i++) {
+			getPresentWords(testImgDescriptors[i], words);
+			double logP = absentLogP;
+			for (size_t j = 0; j < words.size(); j++) {
+				logP += wordLikelihood(words[j], wordStates[words[j]], true) -
+					wordLikelihood(words[j], wordStates[words[j]], false);
+			}
+			cache.likelihoods.push_back(logP);
+		}
+	}
+	cache.imgDescriptors = &testImgDescriptors;
+	cache.wordStates.swap(wordStates);
+
+	for (size_t i = 0; i < cache.likelihoods.size(); i++) {
+		matches.push_back(IMatch(0,i,cache.likelihoods[i],0));
+	}
+}
+
+void FabMap::updateLikelihoods(const vector<Mat>& testImgDescriptors,
+		const vector<int>& changedWords, const vector<uchar>& oldStates,
+		const vector<uchar>& newStates, vector<double>& likelihoods) {
+
+	for (size_t i = 0; i < likelihoods.size(); i++) {
+		const float* Lz = testImgDescriptors[i].ptr<float>();
+		for (size_t j = 0; j < changedWords.size(); j++) {
+			int q = changedWords[j];
+			likelihoods[i] += wordLikelihood(q, newStates[q], Lz[q] > 0) -
+				wordLikelihood(q, oldStates[q], Lz[q] > 0);
+		}
+	}
+}
+
+double FabMap::wordLikelihood(int q, int state, bool Lzq) {
+	return log((this->*PzGL)(q, (state >> 1) & 1, state & 1, Lzq));
+}
+
 double FabMap::getNewPlaceLikelihood(const Mat& queryImgDescriptor) {
 		// not sure about the MEAN_FIELD thing
 	if (flags & MEAN_FIELD) {
@@ -516,6 +712,10 @@ FabMap1::FabMap1(const Mat& _clTree, double _PzGe, double _PzGNe, int _flags,
 				_numSamples) {
 }
 
+FabMap1::FabMap1(const cv::Ptr<FabMapModel>& _model, int _flags,
+		int _numSamples) : FabMap(_model, _flags, _numSamples) {
+}
+
 FabMap1::~FabMap1() {
 }
 
@@ -546,14 +746,17 @@ void FabMap1::getLikelihoods(const Mat& queryImgDescriptor,
 }
 
 FabMapLUT::FabMapLUT(const Mat& _clTree, double _PzGe, double _PzGNe,
-		int _flags, int _numSamples, int _precision) :
+		int _flags, int _numSamples, int _precision, int _tableType) :
 FabMap(_clTree, _PzGe, _PzGNe, _flags, _numSamples), precision(_precision) {
 
-	int nWords = clTree.cols;
-	double precFactor = (double)pow(10.0, precision);
+	CV_Assert(_tableType == CV_32S || _tableType == CV_32F ||
+		_tableType == CV_16S || _tableType == CV_8S);
 
-	table = new int[nWords][8];
+	int nWords = clTree.cols;
 
+	// table index bits: Lzq << 2 | zq << 1 | zpq
+	Mat logTable(nWords, 8, CV_64F);
+	double maxEntry = 0;
 	for (int q = 0; q < nWords; q++) {
 		for (unsigned char i = 0; i < 8; i++) {
 
@@ -561,30 +764,263 @@ FabMap(_clTree, _PzGe, _PzGNe, _flags, _numSamples), precision(_precision) {
 			bool zq = (bool) ((i >> 1) & 0x01);
 			bool zpq = (bool) (i & 1);
 
-			table[q][i] = -(int)(log((this->*PzGL)(q, zq, zpq, Lzq))
-					* precFactor);
+			logTable.at<double>(q, i) = -log((this->*PzGL)(q, zq, zpq, Lzq));
+			maxEntry = std::max(maxEntry, logTable.at<double>(q, i));
+		}
+	}
+
+	// precision gives the number of decimal places stored. The reduced
+	// integer tables lower the scale further so the largest entry still fits
+	tableScale = (double)pow(10.0, precision);
+	if (_tableType == CV_32F) {
+		tableScale = 1;
+	} else if (_tableType == CV_16S && maxEntry > 0) {
+		tableScale = std::min(tableScale, SHRT_MAX / maxEntry);
+	} else if (_tableType == CV_8S && maxEntry > 0) {
+		tableScale = std::min(tableScale, SCHAR_MAX / maxEntry);
+	}
+
+	table.create(nWords, 8, _tableType);
+	for (int q = 0; q < nWords; q++) {
+		for (int i = 0; i < 8; i++) {
+			double entry = logTable.at<double>(q, i) * tableScale;
+			switch (_tableType) {
+			case CV_32S:
+				table.at<int>(q, i) = (int)entry;
+				break;
+			case CV_32F:
+				table.at<float>(q, i) = (float)entry;
+				break;
+			case CV_16S:
+				table.at<short>(q, i) = cv::saturate_cast<short>(entry);
+				break;
+			case CV_8S:
+				table.at<schar>(q, i) = cv::saturate_cast<schar>(entry);
+				break;
+			}
 		}
 	}
 }
 
+FabMapLUT::FabMapLUT(const cv::Ptr<FabMapModel>& _model, int _flags,
+		int _numSamples) : FabMap(_model, _flags, _numSamples),
+	precision(_model->lutPrecision) {
+	table = model->lutTable;
+	tableScale = model->lutScale;
+}
+
 FabMapLUT::~FabMapLUT() {
-	delete[] table;
+}
+
+// table entries are non-negative, so the narrow integer tables accumulate
+// into an int that saturates rather than wraps
+static inline void accumulateEntry(unsigned long long int& logP, int entry) {
+	logP += entry;
+}
+static inline void accumulateEntry(float& logP, float entry) {
+	logP += entry;
+}
+static inline void accumulateEntry(int& logP, int entry) {
+	logP = (logP > INT_MAX - entry) ? INT_MAX : logP + entry;
+}
+
+template<typename T, typename Acc>
+static void sumTableEntries(const Mat& table, const vector<uchar>& queryIdx,
+		const vector<Mat>& testImgDescriptors, double tableScale,
+		vector<IMatch>& matches) {
+
+	const T* entries = table.ptr<T>();
+	int nWords = (int)queryIdx.size();
+
+	for (size_t i = 0; i < testImgDescriptors.size(); i++) {
+		const float* Lz = testImgDescriptors[i].ptr<float>();
+		Acc logP = 0;
+		for (int q = 0; q < nWords; q++) {
+			accumulateEntry(logP, entries[8 * q + queryIdx[q] +
+				((Lz[q] > 0) << 2)]);
+		}
+		matches.push_back(IMatch(0,i,-(double)logP / tableScale,0));
+	}
+}
+
+// block sizes of the batch kernel. A block of test images, query indices
+// and table rows takes about 200KB, so it stays in L2 while every pair in
+// the block is summed
+static const int batchQueries = 32;
+static const int batchImages = 32;
+static const int batchWords = 1024;
+
+// each query/image pair is still summed in word order, so the results are
+// identical to sumTableEntries
+template<typename T, typename Acc>
+static void sumTableEntriesBatch(const Mat& table,
+		const vector<vector<uchar> >& queryIdx,
+		const vector<Mat>& testImgDescriptors, double tableScale,
+		vector<vector<IMatch> >& matches) {
+
+	const T* entries = table.ptr<T>();
+	int nWords = table.rows;
+	int nQueries = (int)queryIdx.size();
+	int nImages = (int)testImgDescriptors.size();
+	vector<Acc> logP(batchQueries * batchImages);
+
+	for (int i0 = 0; i0 < nImages; i0 += batchImages) {
+		int i1 = std::min(i0 + batchImages, nImages);
+		for (int j0 = 0; j0 < nQueries; j0 += batchQueries) {
+			int j1 = std::min(j0 + batchQueries, nQueries);
+			std::fill(logP.begin(), logP.end(), Acc(0));
+
+			for (int q0 = 0; q0 < nWords; q0 += batchWords) {
+				int q1 = std::min(q0 + batchWords, nWords);
+				for (int i = i0; i < i1; i++) {
+					const float* Lz = testImgDescriptors[i].ptr<float>();
+					for (int j = j0; j < j1; j++) {
+						const uchar* idx = &queryIdx[j][0];
+						Acc sum = logP[(j - j0) * batchImages + i - i0];
+						for (int q = q0; q < q1; q++) {
+							accumulateEntry(sum, entries[8 * q + idx[q] +
+								((Lz[q] > 0) << 2)]);
+						}
+						logP[(j - j0) * batchImages + i - i0] = sum;
+					}
+				}
+			}
+
+			for (int j = j0; j < j1; j++) {
+				for (int i = i0; i < i1; i++) {
+					matches[j].push_back(IMatch(0,i,
+						-(double)logP[(j - j0) * batchImages + i - i0] /
+						tableScale,0));
+				}
+			}
+		}
+	}
+}
+
+void FabMapLUT::getQueryIndices(const Mat& queryImgDescriptor,
+		vector<uchar>& queryIdx) {
+	queryIdx.resize(clTree.cols);
+	for (int q = 0; q < clTree.cols; q++) {
+		queryIdx[q] = (queryImgDescriptor.at<float>(0,pq(q)) > 0) +
+			((queryImgDescriptor.at<float>(0, q) > 0) << 1);
+	}
 }
 
 void FabMapLUT::getLikelihoods(const Mat& queryImgDescriptor,
 		const vector<Mat>& testImgDescriptors, vector<IMatch>& matches) {
 
-	double precFactor = (double)pow(10.0, -precision);
+	// the query only sets the low two bits of each table index, so these
+	// are looked up once rather than once per test image
+	vector<uchar> queryIdx;
+	getQueryIndices(queryImgDescriptor, queryIdx);
+
+	switch (table.depth()) {
+	case CV_32S:
+		sumTableEntries<int, unsigned long long int>(table, queryIdx,
+			testImgDescriptors, tableScale, matches);
+		break;
+	case CV_32F:
+		sumTableEntries<float, float>(table, queryIdx,
+			testImgDescriptors, tableScale, matches);
+		break;
+	case CV_16S:
+		sumTableEntries<short, int>(table, queryIdx,
+			testImgDescriptors, tableScale, matches);
+		break;
+	case CV_8S:
+		sumTableEntries<schar, int>(table, queryIdx,
+			testImgDescriptors, tableScale, matches);
+		break;
+	}
+}
+
+void FabMapLUT::getBatchLikelihoods(const vector<Mat>& queryImgDescriptors,
+		const vector<Mat>& testImgDescriptors,
+		vector<vector<IMatch> >& matches) {
+
+	vector<vector<uchar> > queryIdx(queryImgDescriptors.size());
+	for (size_t i = 0; i < queryImgDescriptors.size(); i++) {
+		getQueryIndices(queryImgDescriptors[i], queryIdx[i]);
+	}
+
+	switch (table.depth()) {
+	case CV_32S:
+		sumTableEntriesBatch<int, unsigned long long int>(table, queryIdx,
+			testImgDescriptors, tableScale, matches);
+		break;
+	case CV_32F:
+		sumTableEntriesBatch<float, float>(table, queryIdx,
+			testImgDescriptors, tableScale, matches);
+		break;
+	case CV_16S:
+		sumTableEntriesBatch<short, int>(table, queryIdx,
+			testImgDescriptors, tableScale, matches);
+		break;
+	case CV_8S:
+		sumTableEntriesBatch<schar, int>(table, queryIdx,
+			testImgDescriptors, tableScale, matches);
+		break;
+	}
+}
 
+double FabMapLUT::wordLikelihood(int q, int state, bool Lzq) {
+	int i = (Lzq << 2) + state;
+	switch (table.depth()) {
+	case CV_32S:
+		return -table.at<int>(q, i) / tableScale;
+	case CV_32F:
+		return -table.at<float>(q, i) / tableScale;
+	case CV_16S:
+		return -table.at<short>(q, i) / tableScale;
+	default:
+		return -table.at<schar>(q, i) / tableScale;
+	}
+}
+
+double FabMapLUT::precisionError(const vector<Mat>& queryImgDescriptors,
+		const vector<Mat>& testImgDescriptors) {
+
+	CV_Assert(!queryImgDescriptors.empty());
+	CV_Assert(!testImgDescriptors.empty());
 	for (size_t i = 0; i < testImgDescriptors.size(); i++) {
-		unsigned long long int logP = 0;
-		for (int q = 0; q < clTree.cols; q++) {
-			logP += table[q][(queryImgDescriptor.at<float>(0,pq(q)) > 0) +
-			((queryImgDescriptor.at<float>(0, q) > 0) << 1) +
-			((testImgDescriptors[i].at<float>(0,q) > 0) << 2)];
+		CV_Assert(testImgDescriptors[i].rows == 1);
+		CV_Assert(testImgDescriptors[i].cols == clTree.cols);
+		CV_Assert(testImgDescriptors[i].type() == CV_32F);
+	}
+
+	// the reference is the same sum as FabMap1, evaluated in double
+	Mat logTable(clTree.cols, 8, CV_64F);
+	for (int q = 0; q < clTree.cols; q++) {
+		for (int i = 0; i < 8; i++) {
+			logTable.at<double>(q, i) = log((this->*PzGL)(q, (i >> 1) & 1,
+				i & 1, (i >> 2) & 1));
+		}
+	}
+
+	double maxError = 0;
+	for (size_t i = 0; i < queryImgDescriptors.size(); i++) {
+		const Mat& query = queryImgDescriptors[i];
+		CV_Assert(query.rows == 1);
+		CV_Assert(query.cols == clTree.cols);
+		CV_Assert(query.type() == CV_32F);
+
+		vector<IMatch> approxMatches;
+		getLikelihoods(query, testImgDescriptors, approxMatches);
+
+		for (size_t j = 0; j < testImgDescriptors.size(); j++) {
+			double logP = 0;
+			for (int q = 0; q < clTree.cols; q++) {
+				logP += logTable.at<double>(q,
+					(query.at<float>(0,pq(q)) > 0) +
+					((query.at<float>(0,q) > 0) << 1) +
+					((testImgDescriptors[j].at<float>(0,q) > 0) << 2));
+			}
+			maxError = std::max(maxError,
+				fabs(logP - approxMatches[j].likelihood));
 		}
-		matches.push_back(IMatch(0,i,-precFactor*(double)logP,0));
 	}
+
+	return maxError;
 }
 
 FabMapFBO::FabMapFBO(const Mat& _clTree, double _PzGe, double _PzGNe,
@@ -593,6 +1029,27 @@ FabMapFBO::FabMapFBO(const Mat& _clTree, double _PzGe, double _PzGNe,
 FabMap(_clTree, _PzGe, _PzGNe, _flags, _numSamples), PsGd(_PsGd),
 	rejectionThreshold(_rejectionThreshold), bisectionStart(_bisectionStart),
 		bisectionIts(_bisectionIts) {
+	// bailed-out likelihoods are bounds, not sums that can be corrected
+	CV_Assert(!(flags & INCREMENTAL));
+
+	// indexed as the FabMapLUT table: Lzq << 2 | zq << 1 | zpq
+	logTable.create(clTree.cols, 8, CV_64F);
+	for (int q = 0; q < clTree.cols; q++) {
+		for (int i = 0; i < 8; i++) {
+			logTable.at<double>(q, i) = log((this->*PzGL)(q, (i >> 1) & 1,
+				i & 1, (i >> 2) & 1));
+		}
+	}
+}
+
+FabMapFBO::FabMapFBO(const cv::Ptr<FabMapModel>& _model, int _flags,
+		int _numSamples, double _rejectionThreshold, double _PsGd,
+		int _bisectionStart, int _bisectionIts) :
+FabMap(_model, _flags, _numSamples), PsGd(_PsGd),
+	rejectionThreshold(_rejectionThreshold), bisectionStart(_bisectionStart),
+		bisectionIts(_bisectionIts) {
+	CV_Assert(!(flags & INCREMENTAL));
+	logTable = model->fboLogTable;
 }
 
 
@@ -620,6 +1077,8 @@ void FabMapFBO::getLikelihoods(const Mat& queryImgDescriptor,
 			wordIter != wordData.end(); wordIter++) {
 		bool zq = queryImgDescriptor.at<float>(0,wordIter->q) > 0;
 		bool zpq = queryImgDescriptor.at<float>(0,pq(wordIter->q)) > 0;
+		const double *logPzGL = logTable.ptr<double>(wordIter->q) +
+			(zpq + (zq << 1));
 
 		currBest = -DBL_MAX;
 
@@ -628,8 +1087,7 @@ void FabMapFBO::getLikelihoods(const Mat& queryImgDescriptor,
 		for (size_t i = 0; i < matchIndices.size(); i++) {
 			bool Lzq = 
 				testImgDescriptors[matchIndices[i]].at<float>(0,wordIter->q) > 0;
-			queryMatches[matchIndices[i]].likelihood +=
-				log((this->*PzGL)(wordIter->q,zq,zpq,Lzq));
+			queryMatches[matchIndices[i]].likelihood += logPzGL[Lzq << 2];
 			// find current maximum likelihood
 			currBest = 
 				std::max(queryMatches[matchIndices[i]].likelihood, currBest);
@@ -691,8 +1149,8 @@ void FabMapFBO::setWordStatistics(const Mat& queryImgDescriptor,
 		zpq = queryImgDescriptor.at<float>(0,pq(wordIter->q)) > 0;
 
 		// d = log( P(zq|zpq, zq in Li) ) - log( P(zq|zpq, zq not in Li) )
-		d = log((this->*PzGL)(wordIter->q, zq, zpq, true)) - 
-			log((this->*PzGL)(wordIter->q, zq, zpq, false));
+		d = logTable.at<double>(wordIter->q, 4 + zpq + (zq << 1)) - 
+			logTable.at<double>(wordIter->q, zpq + (zq << 1));
 
 		// v = sum( E[Xi^2] )
 		// according to equation 4.12, Xi has the distribution of:
@@ -759,7 +1217,9 @@ FabMap2::FabMap2(const Mat& _clTree, double _PzGe, double _PzGNe,
 FabMap(_clTree, _PzGe, _PzGNe, _flags) {
 	CV_Assert(flags & SAMPLED);
 
-	children.resize(clTree.cols);
+	d.create(4, clTree.cols, CV_64F);
+	double *d1 = d.ptr<double>(0), *d2 = d.ptr<double>(1),
+		*d3 = d.ptr<double>(2), *d4 = d.ptr<double>(3);
 
 	for (int q = 0; q < clTree.cols; q++) {
 		// PzGL(q, zq, zpq, Li) =  P(zq|zpq, whether zq exists in Li)
@@ -771,8 +1231,8 @@ FabMap(_clTree, _PzGe, _PzGNe, _flags) {
 		// and once normalized like this, sparse pattern could be found (i.e. lots of zeros will appear)
 
 	    // d1: log( P(zq=F|zpq=F, Lzq=T) / P(zq=F|zpq=F, Lzq=F) )
-			d1.push_back(log((this->*PzGL)(q, false, false, true) /
-				(this->*PzGL)(q, false, false, false)));
+			d1[q] = log((this->*PzGL)(q, false, false, true) /
+				(this->*PzGL)(q, false, false, false));
 
 		// The reason to substract d1 from d2, d3 and d4 is that
 		// in updating log-likelihood, we can simply add d2 ( or d3, d4) to the default log-likelihood
@@ -780,18 +1240,40 @@ FabMap(_clTree, _PzGe, _PzGNe, _flags) {
 		// this strategy is just used for reducing computing time
 
 	    // d2: log( P(zq=F|zpq=T, Lzq=T) / P(zq=F|zpq=T, Lzq=F) ) - d1
-		d2.push_back(log((this->*PzGL)(q, false, true, true) /
-				(this->*PzGL)(q, false, true, false)) - d1[q]);
+		d2[q] = log((this->*PzGL)(q, false, true, true) /
+				(this->*PzGL)(q, false, true, false)) - d1[q];
 		// d3: log( P(zq=T|zpq=F, Lzq=T) / P(zq=T|zpq=F, Lzq=F) ) - d1
-		d3.push_back(log((this->*PzGL)(q, true, false, true) /
-				(this->*PzGL)(q, true, false, false))- d1[q]);
+		d3[q] = log((this->*PzGL)(q, true, false, true) /
+				(this->*PzGL)(q, true, false, false))- d1[q];
 	    // d4: log( P(zq=T|zpq=T, Lzq=T) / P(zq=T|zpq=T, Lzq=F) ) - d1
-		d4.push_back(log((this->*PzGL)(q, true, true, true) /
-				(this->*PzGL)(q, true, true, false))- d1[q]);
-		// children[i] records children of node i
-		children[pq(q)].push_back(q);
+		d4[q] = log((this->*PzGL)(q, true, true, true) /
+				(this->*PzGL)(q, true, true, false))- d1[q];
 	}
 
+	// children of node i are stored contiguously in word order
+	childIndex = Mat::zeros(1, clTree.cols + 1, CV_32S);
+	int *index = childIndex.ptr<int>();
+	for (int q = 0; q < clTree.cols; q++) {
+		index[pq(q) + 1]++;
+	}
+	for (int q = 0; q < clTree.cols; q++) {
+		index[q + 1] += index[q];
+	}
+	childList.create(1, clTree.cols, CV_32S);
+	vector<int> next(index, index + clTree.cols);
+	for (int q = 0; q < clTree.cols; q++) {
+		childList.at<int>(0, next[pq(q)]++) = q;
+	}
+
+}
+
+FabMap2::FabMap2(const cv::Ptr<FabMapModel>& _model, int _flags) :
+FabMap(_model, _flags) {
+	CV_Assert(flags & SAMPLED);
+
+	d = model->fabmap2Terms;
+	childIndex = model->childIndex;
+	childList = model->childList;
 }
 
 FabMap2::~FabMap2() {
@@ -800,10 +1282,7 @@ FabMap2::~FabMap2() {
 
 void FabMap2::addTraining(const vector<Mat>& queryImgDescriptors) {
 	for (size_t i = 0; i < queryImgDescriptors.size(); i++) {
-		CV_Assert(!queryImgDescriptors[i].empty());
-		CV_Assert(queryImgDescriptors[i].rows == 1);
-		CV_Assert(queryImgDescriptors[i].cols == clTree.cols);
-		CV_Assert(queryImgDescriptors[i].type() == CV_32F);
+		checkImgDescriptor(queryImgDescriptors[i]);
 		// add image descriptors to training set ( used for randomly sampling to compute new place likelihood )
 		trainingImgDescriptors.push_back(queryImgDescriptors[i]);
 		addToIndex(queryImgDescriptors[i], trainingDefaults, trainingInvertedMap);
@@ -815,10 +1294,7 @@ void FabMap2::add(const vector<Mat>& queryImgDescriptors) {
 	// add test image descriptors to testImgDescriptors
 	// and compute default log-likelihoods of each location
 	for (size_t i = 0; i < queryImgDescriptors.size(); i++) {
-		CV_Assert(!queryImgDescriptors[i].empty());
-		CV_Assert(queryImgDescriptors[i].rows == 1);
-		CV_Assert(queryImgDescriptors[i].cols == clTree.cols);
-		CV_Assert(queryImgDescriptors[i].type() == CV_32F);
+		checkImgDescriptor(queryImgDescriptors[i]);
 		testImgDescriptors.push_back(queryImgDescriptors[i]);
 		// add image descriptors to test set ( test set is a history of previously visited locations)
 		// testDefaults stores the default likelihood of a location which is sum ( log (P(zq=F|zpq=F, zq=T) / P(zq=F|zpq=F, zq=F) ) )
@@ -833,6 +1309,9 @@ void FabMap2::getLikelihoods(const Mat& queryImgDescriptor,
 	if (&testImgDescriptors== &(this->testImgDescriptors)) {
 		getIndexLikelihoods(queryImgDescriptor, testDefaults, testInvertedMap, 
 			matches);
+	} else if (&testImgDescriptors == &trainingImgDescriptors) {
+		getIndexLikelihoods(queryImgDescriptor, trainingDefaults,
+			trainingInvertedMap, matches);
 	} else {
 		CV_Assert(!(flags & MOTION_MODEL));
 		vector<double> defaults;
@@ -850,8 +1329,13 @@ double FabMap2::getNewPlaceLikelihood(const Mat& queryImgDescriptor) {
 	CV_Assert(!trainingImgDescriptors.empty());
 
 	vector<IMatch> matches;
-	getIndexLikelihoods(queryImgDescriptor, trainingDefaults,
+	if (flags & INCREMENTAL) {
+		getIncrementalLikelihoods(queryImgDescriptor, trainingImgDescriptors,
+			trainingCache, matches);
+	} else {
+		getIndexLikelihoods(queryImgDescriptor, trainingDefaults,
 			trainingInvertedMap, matches);
+	}
 
 	double averageLogLikelihood = -DBL_MAX + matches.front().likelihood + 1;
 	for (size_t i = 0; i < matches.size(); i++) {
@@ -863,21 +1347,64 @@ double FabMap2::getNewPlaceLikelihood(const Mat& queryImgDescriptor) {
 
 }
 
+void FabMap2::updateLikelihoods(const vector<Mat>& testImgDescriptors,
+		const vector<int>& changedWords, const vector<uchar>& oldStates,
+		const vector<uchar>& newStates, vector<double>& likelihoods) {
+
+	map<int, vector<int> >* invertedMap;
+	if (&testImgDescriptors == &(this->testImgDescriptors)) {
+		invertedMap = &testInvertedMap;
+	} else if (&testImgDescriptors == &trainingImgDescriptors) {
+		invertedMap = &trainingInvertedMap;
+	} else {
+		FabMap::updateLikelihoods(testImgDescriptors, changedWords,
+			oldStates, newStates, likelihoods);
+		return;
+	}
+
+	// a word only contributes to the locations it was observed at
+	for (size_t j = 0; j < changedWords.size(); j++) {
+		int q = changedWords[j];
+		map<int, vector<int> >::const_iterator found = invertedMap->find(q);
+		if (found == invertedMap->end()) {
+			continue;
+		}
+		double change = wordLikelihood(q, newStates[q], true) -
+			wordLikelihood(q, oldStates[q], true);
+		const vector<int>& LwithQ = found->second;
+		for (size_t i = 0; i < LwithQ.size() &&
+			LwithQ[i] < (int)likelihoods.size(); i++) {
+			likelihoods[LwithQ[i]] += change;
+		}
+	}
+}
+
+double FabMap2::wordLikelihood(int q, int state, bool Lzq) {
+	// relative to the location default, rows 1-3 of d are indexed by the
+	// state (zq << 1 | zpq)
+	if (!Lzq) {
+		return 0;
+	}
+	return d.at<double>(0, q) + (state ? d.at<double>(state, q) : 0);
+}
+
 void FabMap2::addToIndex(const Mat& queryImgDescriptor,
 		vector<double>& defaults,
 		map<int, vector<int> >& invertedMap) {
+	const double *d1 = d.ptr<double>(0);
+	vector<int> words;
+	getPresentWords(queryImgDescriptor, words);
 	defaults.push_back(0);
-	for (int q = 0; q < clTree.cols; q++) {
+	for (size_t i = 0; i < words.size(); i++) {
+		int q = words[i];
 		// if zq exists at location L, add d1
 		// to default location log-likelihood 
-		if (queryImgDescriptor.at<float>(0,q) > 0) {
-			// if visual word zq is observed in the query image
-			// add log( P(zq=F|zpq=F, Lzq=T) / P(zq=F|zpq=F, Lzq=F) ) to the default
-			// likelihood of the new location
-			// then update? seems still need to substract this term ... so sad
-			defaults.back() += d1[q];
-			invertedMap[q].push_back((int)defaults.size()-1);
-		}
+		// if visual word zq is observed in the query image
+		// add log( P(zq=F|zpq=F, Lzq=T) / P(zq=F|zpq=F, Lzq=F) ) to the default
+		// likelihood of the new location
+		// then update? seems still need to substract this term ... so sad
+		defaults.back() += d1[q];
+		invertedMap[q].push_back((int)defaults.size()-1);
 	}
 }
 
@@ -886,7 +1413,10 @@ void FabMap2::getIndexLikelihoods(const Mat& queryImgDescriptor,
 		map<int, vector<int> >& invertedMap,
 		vector<IMatch>& matches) {
 
-	vector<int>::iterator LwithI, child;
+	vector<int>::iterator LwithI;
+	const int *child, *childEnd;
+	const double *d2 = d.ptr<double>(1), *d3 = d.ptr<double>(2),
+		*d4 = d.ptr<double>(3);
 
 	std::vector<double> likelihoods = defaults;
 
@@ -894,29 +1424,31 @@ void FabMap2::getIndexLikelihoods(const Mat& queryImgDescriptor,
 	    // d2: log( P(zq=F|zpq=T, Lzq=T) / P(zq=F|zpq=T, Lzq=F) ) - d1
 		// d3: log( P(zq=T|zpq=F, Lzq=T) / P(zq=T|zpq=F, Lzq=F) ) - d1
 	    // d4: log( P(zq=T|zpq=T, Lzq=T) / P(zq=T|zpq=T, Lzq=F) ) - d1
-	for (int q = 0; q < clTree.cols; q++) {
-		if (queryImgDescriptor.at<float>(0,q) > 0) {
-			for (LwithI = invertedMap[q].begin(); 
-				LwithI != invertedMap[q].end(); LwithI++) {
-
-				// update log( P(Li|Z^k) )
-				if (queryImgDescriptor.at<float>(0,pq(q)) > 0) {
-					// += log( P(zq=T|zpq=T, Lzq=T) / P(zq=T|zpq=T, Lzq=F) ) - log( P(zq=F|zpq=F, Lzq=T) / p(zq=F|zpq=F, Lzq=F) )
-					likelihoods[*LwithI] += d4[q];
-				} else {
-					// += log( P(zq=T|zpq=F, Lzq=T) / P(zq=T|zpq=F, Lzq=F) ) - log( P(zq=F|zpq=F, Lzq=T) / p(zq=F|zpq=F, Lzq=F) )
-					likelihoods[*LwithI] += d3[q];
-				}
+	vector<int> words;
+	getPresentWords(queryImgDescriptor, words);
+	for (size_t i = 0; i < words.size(); i++) {
+		int q = words[i];
+		for (LwithI = invertedMap[q].begin(); 
+			LwithI != invertedMap[q].end(); LwithI++) {
+
+			// update log( P(Li|Z^k) )
+			if (queryImgDescriptor.at<float>(0,pq(q)) > 0) {
+				// += log( P(zq=T|zpq=T, Lzq=T) / P(zq=T|zpq=T, Lzq=F) ) - log( P(zq=F|zpq=F, Lzq=T) / p(zq=F|zpq=F, Lzq=F) )
+				likelihoods[*LwithI] += d4[q];
+			} else {
+				// += log( P(zq=T|zpq=F, Lzq=T) / P(zq=T|zpq=F, Lzq=F) ) - log( P(zq=F|zpq=F, Lzq=T) / p(zq=F|zpq=F, Lzq=F) )
+				likelihoods[*LwithI] += d3[q];
 			}
-			for (child = children[q].begin(); child != children[q].end();
-				child++) {
+		}
+		child = childList.ptr<int>() + childIndex.at<int>(0, q);
+		childEnd = childList.ptr<int>() + childIndex.at<int>(0, q + 1);
+		for (; child != childEnd; child++) {
 
-				if (queryImgDescriptor.at<float>(0,*child) == 0) {
-					for (LwithI = invertedMap[*child].begin();
-						LwithI != invertedMap[*child].end(); LwithI++) {
+			if (queryImgDescriptor.at<float>(0,*child) == 0) {
+				for (LwithI = invertedMap[*child].begin();
+					LwithI != invertedMap[*child].end(); LwithI++) {
 
-						likelihoods[*LwithI] += d2[*child];
-					}
+					likelihoods[*LwithI] += d2[*child];
 				}
 			}
 		}
@@ -0,0 +1,341 @@
+/*------------------------------------------------------------------------
+ Copyright 2012 Arren Glover [aj.glover@qut.edu.au]
+                Will Maddern [w.maddern@qut.edu.au]
+
+ This file is part of OpenFABMAP. http://code.google.com/p/openfabmap/
+
+ OpenFABMAP is free software: you can redistribute it and/or modify it under
+ the terms of the GNU General Public License as published by the Free Software
+ Foundation, either version 3 of the License, or (at your option) any later
+ version.
+
+ OpenFABMAP is distributed in the hope that it will be useful, but WITHOUT ANY
+ WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ details.
+
+ For published work which uses all or part of OpenFABMAP, please cite:
+ http://ieeexplore.ieee.org/xpl/articleDetails.jsp?arnumber=6224843
+
+ Original Algorithm by Mark Cummins and Paul Newman:
+ http://ijr.sagepub.com/content/27/6/647.short
+ http://ieeexplore.ieee.org/xpl/articleDetails.jsp?arnumber=5613942
+ http://ijr.sagepub.com/content/30/9/1100.abstract
+
+ You should have received a copy of the GNU General Public License along with
+ OpenFABMAP. If not, see http://www.gnu.org/licenses/.
+------------------------------------------------------------------------*/
+
+#include "../include/openfabmap.hpp"
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using std::string;
+using cv::Mat;
+
+namespace of2 {
+
+/*
+	Layout of a compiled model file. The header is followed by the data
+	blocks at the given offsets, each aligned to a cache line so the mapped
+	tables can be used in place.
+*/
+struct FabMapModelHeader {
+	char magic[8];
+	int version;
+	int byteOrder;
+
+	int nWords;
+	int flags;
+	double PzGe;
+	double PzGNe;
+
+	int lutType;
+	int lutPrecision;
+	double lutScale;
+
+	// byte offsets from the start of the file
+	long long treeOffset;          // 4 x nWords CV_64F
+	long long lutOffset;           // nWords x 8 lutType
+	long long fboOffset;           // nWords x 8 CV_64F
+	long long fabmap2Offset;       // 4 x nWords CV_64F
+	long long childIndexOffset;    // nWords + 1 CV_32S
+	long long childListOffset;     // nWords CV_32S
+	long long fileSize;
+};
+
+static const char modelMagic[8] = {'O','F','2','M','O','D','E','L'};
+static const int modelVersion = 1;
+static const int modelByteOrder = 0x01020304;
+static const long long modelAlignment = 64;
+
+static long long alignOffset(long long offset) {
+	return (offset + modelAlignment - 1) / modelAlignment * modelAlignment;
+}
+
+FabMapModel::FabMapModel(const Mat& _clTree, double _PzGe, double _PzGNe,
+		int _flags, int _lutPrecision, int _lutTableType) :
+	PzGe(_PzGe), PzGNe(_PzGNe),
+	flags(_flags & (FabMap::NAIVE_BAYES | FabMap::CHOW_LIU)),
+	clTree(_clTree), lutPrecision(_lutPrecision), mappedData(NULL),
+	mappedSize(0), fileHandle(NULL), mapHandle(NULL) {
+
+	CV_Assert(flags);
+
+	// each method precomputes its own tables; they only need the Bayes
+	// method, and FabMap2 additionally requires the sampled option
+	int engineFlags = flags | FabMap::SAMPLED;
+
+	FabMapLUT lut(clTree, PzGe, PzGNe, engineFlags, 0, lutPrecision,
+		_lutTableType);
+	lutTable = lut.table;
+	lutScale = lut.tableScale;
+
+	FabMapFBO fbo(clTree, PzGe, PzGNe, engineFlags);
+	fboLogTable = fbo.logTable;
+
+	FabMap2 fabmap2(clTree, PzGe, PzGNe, engineFlags);
+	fabmap2Terms = fabmap2.d;
+	childIndex = fabmap2.childIndex;
+	childList = fabmap2.childList;
+}
+
+FabMapModel::FabMapModel(const string& filename) : lutScale(0),
+	mappedData(NULL), mappedSize(0), fileHandle(NULL), mapHandle(NULL) {
+
+#ifdef _WIN32
+	HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ,
+		FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		CV_Error(CV_StsObjectNotFound, filename + ": could not open model");
+	}
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size)) {
+		CloseHandle(file);
+		CV_Error(CV_StsError, filename + ": could not read model size");
+	}
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	void *data = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) :
+		NULL;
+	fileHandle = file;
+	mapHandle = mapping;
+	mappedData = data;
+	mappedSize = (size_t)size.QuadPart;
+	if (!data) {
+		unmap();
+		CV_Error(CV_StsError, filename + ": could not map model");
+	}
+#else
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0) {
+		CV_Error(CV_StsObjectNotFound, filename + ": could not open model");
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		CV_Error(CV_StsError, filename + ": could not read model size");
+	}
+	void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		CV_Error(CV_StsError, filename + ": could not map model");
+	}
+	mappedData = data;
+	mappedSize = (size_t)st.st_size;
+#endif
+
+	const FabMapModelHeader *header = (const FabMapModelHeader *)mappedData;
+	if (mappedSize < sizeof(FabMapModelHeader) ||
+		memcmp(header->magic, modelMagic, sizeof(modelMagic)) != 0 ||
+		header->version != modelVersion ||
+		header->byteOrder != modelByteOrder ||
+		header->fileSize != (long long)mappedSize) {
+		unmap();
+		CV_Error(CV_StsParseError, filename + ": not a compatible model");
+	}
+
+	// every table must lie within the mapped file
+	int lutType = header->lutType;
+	long long n = header->nWords;
+	bool valid = n > 0 && (lutType == CV_32S || lutType == CV_32F ||
+		lutType == CV_16S || lutType == CV_8S);
+	if (valid) {
+		long long offsets[] = {header->treeOffset, header->lutOffset,
+			header->fboOffset, header->fabmap2Offset,
+			header->childIndexOffset, header->childListOffset};
+		long long sizes[] = {4 * n * (long long)sizeof(double),
+			8 * n * (long long)CV_ELEM_SIZE(lutType),
+			8 * n * (long long)sizeof(double),
+			4 * n * (long long)sizeof(double),
+			(n + 1) * (long long)sizeof(int), n * (long long)sizeof(int)};
+		for (int i = 0; i < 6; i++) {
+			valid = valid && offsets[i] >= (long long)sizeof(*header) &&
+				offsets[i] % modelAlignment == 0 &&
+				sizes[i] <= header->fileSize - offsets[i];
+		}
+	}
+	if (!valid) {
+		unmap();
+		CV_Error(CV_StsParseError, filename + ": model is damaged");
+	}
+
+	PzGe = header->PzGe;
+	PzGNe = header->PzGNe;
+	flags = header->flags;
+	lutPrecision = header->lutPrecision;
+	lutScale = header->lutScale;
+
+	// the tables are read-only views of the mapped file
+	uchar *base = (uchar *)mappedData;
+	int nWords = header->nWords;
+	clTree = Mat(4, nWords, CV_64F, base + header->treeOffset);
+	lutTable = Mat(nWords, 8, header->lutType, base + header->lutOffset);
+	fboLogTable = Mat(nWords, 8, CV_64F, base + header->fboOffset);
+	fabmap2Terms = Mat(4, nWords, CV_64F, base + header->fabmap2Offset);
+	childIndex = Mat(1, nWords + 1, CV_32S, base + header->childIndexOffset);
+	childList = Mat(1, nWords, CV_32S, base + header->childListOffset);
+
+	// the engines index with the tree and child lists directly
+	if (!validTree()) {
+		unmap();
+		CV_Error(CV_StsParseError, filename + ": model is damaged");
+	}
+}
+
+// every parent is a word, and the children of each word are listed
+// between consecutive child indices, the root being its own child
+bool FabMapModel::validTree() const {
+	int nWords = clTree.cols;
+	const double *parents = clTree.ptr<double>(0);
+	for (int q = 0; q < nWords; q++) {
+		if (!(parents[q] >= 0 && parents[q] < nWords) ||
+			parents[q] != (int)parents[q]) {
+			return false;
+		}
+	}
+
+	const int *index = childIndex.ptr<int>();
+	const int *list = childList.ptr<int>();
+	if (index[0] != 0 || index[nWords] != nWords) {
+		return false;
+	}
+	for (int q = 0; q < nWords; q++) {
+		if (index[q + 1] < index[q] || index[q + 1] > nWords) {
+			return false;
+		}
+		for (int i = index[q]; i < index[q + 1]; i++) {
+			if (list[i] < 0 || list[i] >= nWords ||
+				(int)parents[list[i]] != q) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+FabMapModel::~FabMapModel() {
+	unmap();
+}
+
+bool FabMapModel::matchesTree(const Mat& _clTree) const {
+	if (_clTree.type() != CV_64F || _clTree.rows != clTree.rows ||
+		_clTree.cols != clTree.cols) {
+		return false;
+	}
+	for (int i = 0; i < clTree.rows; i++) {
+		if (memcmp(_clTree.ptr(i), clTree.ptr(i),
+			clTree.cols * sizeof(double)) != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void FabMapModel::unmap() {
+	if (mappedData) {
+#ifdef _WIN32
+		UnmapViewOfFile(mappedData);
+#else
+		munmap(mappedData, mappedSize);
+#endif
+	}
+#ifdef _WIN32
+	if (mapHandle) CloseHandle((HANDLE)mapHandle);
+	if (fileHandle) CloseHandle((HANDLE)fileHandle);
+#endif
+	mappedData = NULL;
+	mapHandle = NULL;
+	fileHandle = NULL;
+}
+
+static void writeBlock(std::ofstream& writer, const Mat& block,
+		long long offset) {
+	writer.seekp((std::streamoff)offset);
+	for (int i = 0; i < block.rows; i++) {
+		writer.write((const char *)block.ptr(i), block.cols * block.elemSize());
+	}
+}
+
+void FabMapModel::save(const string& filename) const {
+
+	int nWords = clTree.cols;
+
+	FabMapModelHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, modelMagic, sizeof(modelMagic));
+	header.version = modelVersion;
+	header.byteOrder = modelByteOrder;
+	header.nWords = nWords;
+	header.flags = flags;
+	header.PzGe = PzGe;
+	header.PzGNe = PzGNe;
+	header.lutType = lutTable.type();
+	header.lutPrecision = lutPrecision;
+	header.lutScale = lutScale;
+
+	header.treeOffset = alignOffset(sizeof(header));
+	header.lutOffset = alignOffset(header.treeOffset +
+		4 * nWords * (long long)sizeof(double));
+	header.fboOffset = alignOffset(header.lutOffset +
+		8 * nWords * (long long)lutTable.elemSize());
+	header.fabmap2Offset = alignOffset(header.fboOffset +
+		8 * nWords * (long long)sizeof(double));
+	header.childIndexOffset = alignOffset(header.fabmap2Offset +
+		4 * nWords * (long long)sizeof(double));
+	header.childListOffset = alignOffset(header.childIndexOffset +
+		(nWords + 1) * (long long)sizeof(int));
+	header.fileSize = header.childListOffset + nWords * (long long)sizeof(int);
+
+	std::ofstream writer(filename.c_str(), std::ios::out | std::ios::binary);
+	if (!writer.is_open()) {
+		CV_Error(CV_StsError, filename + ": could not write model");
+	}
+	writer.write((const char *)&header, sizeof(header));
+
+	CV_Assert(clTree.type() == CV_64F);
+	writeBlock(writer, clTree, header.treeOffset);
+	writeBlock(writer, lutTable, header.lutOffset);
+	writeBlock(writer, fboLogTable, header.fboOffset);
+	writeBlock(writer, fabmap2Terms, header.fabmap2Offset);
+	writeBlock(writer, childIndex, header.childIndexOffset);
+	writeBlock(writer, childList, header.childListOffset);
+	writer.close();
+
+	// a partly written model is not left to be mapped later
+	if (!writer) {
+		std::remove(filename.c_str());
+		CV_Error(CV_StsError, filename + ": could not write model");
+	}
+}
+
+}
@@ -0,0 +1,357 @@
+/*------------------------------------------------------------------------
+ Copyright 2012 Arren Glover [aj.glover@qut.edu.au]
+                Will Maddern [w.maddern@qut.edu.au]
+
+ This file is part of OpenFABMAP. http://code.google.com/p/openfabmap/
+
+ OpenFABMAP is free software: you can redistribute it and/or modify it under
+ the terms of the GNU General Public License as published by the Free Software
+ Foundation, either version 3 of the License, or (at your option) any later
+ version.
+
+ OpenFABMAP is distributed in the hope that it will be useful, but WITHOUT ANY
+ WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ details.
+
+ For published work which uses all or part of OpenFABMAP, please cite:
+ http://ieeexplore.ieee.org/xpl/articleDetails.jsp?arnumber=6224843
+
+ Original Algorithm by Mark Cummins and Paul Newman:
+ http://ijr.sagepub.com/content/27/6/647.short
+ http://ieeexplore.ieee.org/xpl/articleDetails.jsp?arnumber=5613942
+ http://ijr.sagepub.com/content/30/9/1100.abstract
+
+ You should have received a copy of the GNU General Public License along with
+ OpenFABMAP. If not, see http://www.gnu.org/licenses/.
+------------------------------------------------------------------------*/
+
+#include "../include/openfabmap.hpp"
+#include <algorithm>
+#include <cstring>
+
+using std::string;
+using cv::Mat;
+
+namespace of2 {
+
+/*
+	Layout of a matrix file. The file header is followed by each matrix in
+	turn, a block header then dataSize bytes of rows. A dense row is its
+	raw values; a sparse row is its count of non-zero entries, their
+	columns as ints, then their values. Every number in the file is
+	little-endian, swapped on the way in and out on big-endian machines.
+*/
+struct MatrixFileHeader {
+	char magic[8];
+	int version;
+	int byteOrder;
+};
+
+struct MatrixBlockHeader {
+	char name[64];
+	int rows;
+	int cols;
+	int type;
+	int sparse;
+	long long dataSize;
+};
+
+static const char matrixMagic[8] = {'O','F','2','M','A','T','R','X'};
+static const int matrixVersion = 1;
+static const int matrixByteOrder = 0x01020304;
+
+static bool bigEndian() {
+	const int one = 1;
+	return *(const char *)&one == 0;
+}
+
+// reverses the bytes of each of count values of elemSize bytes
+static void swapBytes(char *data, size_t elemSize, size_t count) {
+	if (elemSize < 2) {
+		return;
+	}
+	for (size_t i = 0; i < count; i++, data += elemSize) {
+		std::reverse(data, data + elemSize);
+	}
+}
+
+static void swapHeader(MatrixFileHeader& header) {
+	swapBytes((char *)&header.version, sizeof(int), 1);
+	swapBytes((char *)&header.byteOrder, sizeof(int), 1);
+}
+
+static void swapHeader(MatrixBlockHeader& header) {
+	swapBytes((char *)&header.rows, sizeof(int), 1);
+	swapBytes((char *)&header.cols, sizeof(int), 1);
+	swapBytes((char *)&header.type, sizeof(int), 1);
+	swapBytes((char *)&header.sparse, sizeof(int), 1);
+	swapBytes((char *)&header.dataSize, sizeof(long long), 1);
+}
+
+// writes count values of elemSize bytes little-endian, through buffer
+// when they need swapping
+static void writeValues(std::ofstream& out, const char *data,
+		size_t elemSize, size_t count, std::vector<char>& buffer) {
+	if (count == 0) {
+		return;
+	}
+	if (bigEndian() && elemSize > 1) {
+		buffer.assign(data, data + elemSize * count);
+		swapBytes(&buffer[0], elemSize, count);
+		data = &buffer[0];
+	}
+	out.write(data, elemSize * count);
+}
+
+// reads count little-endian values of elemSize bytes into data
+static void readValues(std::ifstream& in, char *data, size_t elemSize,
+		size_t count) {
+	in.read(data, elemSize * count);
+	if (bigEndian()) {
+		swapBytes(data, elemSize, count);
+	}
+}
+
+template <class Header>
+static void writeHeader(std::ofstream& out, Header header) {
+	if (bigEndian()) {
+		swapHeader(header);
+	}
+	out.write((const char *)&header, sizeof(header));
+}
+
+template <class Header>
+static bool readHeader(std::ifstream& in, Header& header) {
+	if (!in.read((char *)&header, sizeof(header))) {
+		return false;
+	}
+	if (bigEndian()) {
+		swapHeader(header);
+	}
+	return true;
+}
+
+MatrixFile::MatrixFile() : rows(0), cols(0), type(0), sparse(false),
+	rowsRead(0) {
+}
+
+MatrixFile::MatrixFile(const string& filename, int flags) : rows(0),
+	cols(0), type(0), sparse(false), rowsRead(0) {
+	open(filename, flags);
+}
+
+MatrixFile::~MatrixFile() {
+}
+
+bool MatrixFile::open(const string& filename, int flags) {
+
+	release();
+
+	if (flags == WRITE) {
+		out.open(filename.c_str(), std::ios::out | std::ios::binary);
+		if (!out.is_open()) {
+			return false;
+		}
+		MatrixFileHeader header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, matrixMagic, sizeof(matrixMagic));
+		header.version = matrixVersion;
+		header.byteOrder = matrixByteOrder;
+		writeHeader(out, header);
+		return true;
+	}
+
+	in.open(filename.c_str(), std::ios::in | std::ios::binary);
+	MatrixFileHeader header;
+	if (!readHeader(in, header) ||
+		memcmp(header.magic, matrixMagic, sizeof(matrixMagic)) != 0) {
+		in.close();
+		return false;
+	}
+	if (header.version != matrixVersion ||
+		header.byteOrder != matrixByteOrder) {
+		in.close();
+		CV_Error(CV_StsParseError, filename + ": not a compatible matrix file");
+	}
+	return true;
+}
+
+bool MatrixFile::isOpened() const {
+	return in.is_open() || out.is_open();
+}
+
+void MatrixFile::release() {
+	if (in.is_open()) {
+		in.close();
+	}
+	if (out.is_open()) {
+		out.close();
+	}
+	in.clear();
+	out.clear();
+	rows = cols = type = rowsRead = 0;
+	sparse = false;
+}
+
+bool MatrixFile::isMatrixFile(const string& filename) {
+	std::ifstream file(filename.c_str(), std::ios::in | std::ios::binary);
+	char magic[sizeof(matrixMagic)];
+	return file.read(magic, sizeof(magic)) &&
+		memcmp(magic, matrixMagic, sizeof(matrixMagic)) == 0;
+}
+
+void MatrixFile::write(const string& name, const Mat& mat, bool _sparse) {
+
+	CV_Assert(out.is_open());
+	CV_Assert(name.size() < sizeof(((MatrixBlockHeader *)0)->name));
+	CV_Assert(mat.channels() == 1);
+
+	MatrixBlockHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.name, name.c_str(), name.size());
+	header.rows = mat.rows;
+	header.cols = mat.cols;
+	header.type = mat.type();
+	header.sparse = _sparse;
+
+	// the data size is filled in once the rows are written
+	std::streampos headerStart = out.tellp();
+	writeHeader(out, header);
+	std::streampos dataStart = out.tellp();
+
+	size_t elemSize = mat.elemSize();
+	std::vector<char> zero(elemSize, 0), values, buffer;
+	std::vector<int> columns;
+	for (int i = 0; i < mat.rows; i++) {
+		const char *row = (const char *)mat.ptr(i);
+		if (!_sparse) {
+			writeValues(out, row, elemSize, mat.cols, buffer);
+			continue;
+		}
+		columns.clear();
+		values.clear();
+		for (int j = 0; j < mat.cols; j++) {
+			const char *value = row + j * elemSize;
+			if (memcmp(value, &zero[0], elemSize) != 0) {
+				columns.push_back(j);
+				values.insert(values.end(), value, value + elemSize);
+			}
+		}
+		int count = (int)columns.size();
+		writeValues(out, (const char *)&count, sizeof(int), 1, buffer);
+		if (count > 0) {
+			writeValues(out, (const char *)&columns[0], sizeof(int), count,
+				buffer);
+			writeValues(out, &values[0], elemSize, count, buffer);
+		}
+	}
+
+	std::streampos dataEnd = out.tellp();
+	header.dataSize = (long long)(dataEnd - dataStart);
+	out.seekp(headerStart);
+	writeHeader(out, header);
+	out.seekp(dataEnd);
+	if (!out) {
+		CV_Error(CV_StsError, name + ": could not write matrix");
+	}
+}
+
+// whether a block header describes a single channel matrix whose rows
+// fit its data, checked before anything is allocated or skipped from it
+static bool validHeader(const MatrixBlockHeader& header) {
+	if (header.rows < 0 || header.cols < 0 || header.dataSize < 0 ||
+		header.type != CV_MAT_DEPTH(header.type) || header.type > CV_64F) {
+		return false;
+	}
+	if (header.sparse) {
+		// at least the count of every row
+		return header.dataSize >= header.rows * (long long)sizeof(int);
+	}
+	return header.dataSize == header.rows * (long long)header.cols *
+		CV_ELEM_SIZE(header.type);
+}
+
+bool MatrixFile::find(const string& name, int& _rows, int& _cols,
+		int& _type) {
+
+	CV_Assert(in.is_open());
+	in.clear();
+	in.seekg(sizeof(MatrixFileHeader));
+	rows = cols = type = rowsRead = 0;
+
+	MatrixBlockHeader header;
+	while (readHeader(in, header)) {
+		header.name[sizeof(header.name) - 1] = '\0';
+		if (!validHeader(header)) {
+			CV_Error(CV_StsParseError, string(header.name) +
+				": matrix header is damaged");
+		}
+		if (name == header.name) {
+			rows = _rows = header.rows;
+			cols = _cols = header.cols;
+			type = _type = header.type;
+			sparse = header.sparse != 0;
+			return true;
+		}
+		in.seekg((std::streamoff)header.dataSize, std::ios::cur);
+	}
+	return false;
+}
+
+bool MatrixFile::readRows(Mat& mat, int maxRows) {
+
+	if (!in.is_open() || rowsRead >= rows) {
+		return false;
+	}
+
+	int chunkRows = std::min(maxRows, rows - rowsRead);
+	mat.create(chunkRows, cols, type);
+	size_t elemSize = mat.elemSize();
+
+	if (!sparse) {
+		// dense rows are read straight into the matrix
+		for (int i = 0; i < chunkRows; i++) {
+			readValues(in, (char *)mat.ptr(i), elemSize, cols);
+		}
+	} else {
+		mat = cv::Scalar::all(0);
+		std::vector<int> columns;
+		std::vector<char> values;
+		for (int i = 0; i < chunkRows && in; i++) {
+			int count = 0;
+			readValues(in, (char *)&count, sizeof(int), 1);
+			if (count < 0 || count > cols) {
+				CV_Error(CV_StsParseError, "sparse matrix row is damaged");
+			}
+			if (count == 0) {
+				continue;
+			}
+			columns.resize(count);
+			values.resize(count * elemSize);
+			readValues(in, (char *)&columns[0], sizeof(int), count);
+			readValues(in, &values[0], elemSize, count);
+			char *row = (char *)mat.ptr(i);
+			for (int j = 0; j < count; j++) {
+				CV_Assert(columns[j] >= 0 && columns[j] < cols);
+				memcpy(row + columns[j] * elemSize, &values[j * elemSize],
+					elemSize);
+			}
+		}
+	}
+	if (!in) {
+		CV_Error(CV_StsParseError, "matrix file ended early");
+	}
+	rowsRead += chunkRows;
+	return true;
+}
+
+void MatrixFile::read(const string& name, Mat& mat) {
+	mat.release();
+	int _rows, _cols, _type;
+	if (find(name, _rows, _cols, _type) && _rows > 0) {
+		readRows(mat, _rows);
+	}
+}
+
+}
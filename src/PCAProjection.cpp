@@ -0,0 +1,182 @@
+/*------------------------------------------------------------------------
+ Copyright 2012 Arren Glover [aj.glover@qut.edu.au]
+                Will Maddern [w.maddern@qut.edu.au]
+
+ This file is part of OpenFABMAP. http://code.google.com/p/openfabmap/
+
+ OpenFABMAP is free software: you can redistribute it and/or modify it under
+ the terms of the GNU General Public License as published by the Free Software
+ Foundation, either version 3 of the License, or (at your option) any later
+ version.
+
+ OpenFABMAP is distributed in the hope that it will be useful, but WITHOUT ANY
+ WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ details.
+
+ For published work which uses all or part of OpenFABMAP, please cite:
+ http://ieeexplore.ieee.org/xpl/articleDetails.jsp?arnumber=6224843
+
+ Original Algorithm by Mark Cummins and Paul Newman:
+ http://ijr.sagepub.com/content/27/6/647.short
+ http://ieeexplore.ieee.org/xpl/articleDetails.jsp?arnumber=5613942
+ http://ijr.sagepub.com/content/30/9/1100.abstract
+
+ You should have received a copy of the GNU General Public License along with
+ OpenFABMAP. If not, see http://www.gnu.org/licenses/.
+------------------------------------------------------------------------*/
+
+#include "../include/openfabmap.hpp"
+
+using cv::Mat;
+
+namespace of2 {
+
+PCAProjection::PCAProjection() {
+}
+
+PCAProjection::~PCAProjection() {
+}
+
+// the sum and the sum of the outer products of a chunk of descriptors
+static void addSamples(const Mat& chunk, Mat& sum, Mat& products) {
+	Mat chunkSum, chunkProducts;
+	cv::reduce(chunk, chunkSum, 0, CV_REDUCE_SUM, CV_64F);
+	cv::mulTransposed(chunk, chunkProducts, true, Mat(), 1, CV_64F);
+	if (sum.empty()) {
+		sum = chunkSum;
+		products = chunkProducts;
+	} else {
+		sum += chunkSum;
+		products += chunkProducts;
+	}
+}
+
+void PCAProjection::train(const Mat& descriptors, int dims) {
+	CV_Assert(descriptors.type() == CV_32F && descriptors.rows > 1);
+
+	Mat sum, products;
+	addSamples(descriptors, sum, products);
+	learn(sum, products, descriptors.rows, dims);
+}
+
+void PCAProjection::train(const std::vector<Mat>& descriptors, int dims) {
+	Mat sum, products;
+	int count = 0;
+	for (size_t i = 0; i < descriptors.size(); i++) {
+		CV_Assert(descriptors[i].type() == CV_32F);
+		if (descriptors[i].empty()) {
+			continue;
+		}
+		addSamples(descriptors[i], sum, products);
+		count += descriptors[i].rows;
+	}
+	CV_Assert(count > 1);
+	learn(sum, products, count, dims);
+}
+
+void PCAProjection::train(BOWDescriptorReader& reader, int dims,
+						  int chunkRows) {
+	CV_Assert(reader.isOpened() && reader.getRows() > 1);
+	CV_Assert(chunkRows > 0);
+
+	Mat chunk, sum, products;
+	reader.rewind();
+	while (reader.read(chunk, chunkRows)) {
+		addSamples(chunk, sum, products);
+	}
+	reader.rewind();
+	learn(sum, products, reader.getRows(), dims);
+}
+
+// the components are the leading eigenvectors of the covariance
+void PCAProjection::learn(const Mat& sum, const Mat& products, int count,
+						  int dims) {
+	CV_Assert(dims > 0 && dims <= sum.cols);
+
+	Mat mean64 = sum / count;
+	Mat covariance = products / count - mean64.t() * mean64;
+	Mat eigenvalues, eigenvectors;
+	cv::eigen(covariance, eigenvalues, eigenvectors);
+
+	mean64.convertTo(mean, CV_32F);
+	eigenvectors.rowRange(0, dims).convertTo(components, CV_32F);
+	cv::gemm(mean, components, 1, Mat(), 0, offset, cv::GEMM_2_T);
+}
+
+bool PCAProjection::empty() const {
+	return components.empty();
+}
+
+int PCAProjection::getInputDims() const {
+	return components.cols;
+}
+
+int PCAProjection::getDims() const {
+	return components.rows;
+}
+
+void PCAProjection::project(const Mat& descriptors, Mat& projected) const {
+	CV_Assert(!empty());
+	CV_Assert(descriptors.type() == CV_32F &&
+		descriptors.cols == components.cols);
+
+	if (descriptors.empty()) {
+		projected.create(0, components.rows, CV_32F);
+		return;
+	}
+	cv::gemm(descriptors, components, 1, Mat(), 0, projected,
+		cv::GEMM_2_T);
+	const float *o = offset.ptr<float>();
+	for (int i = 0; i < projected.rows; i++) {
+		float *z = projected.ptr<float>(i);
+		for (int k = 0; k < projected.cols; k++) {
+			z[k] -= o[k];
+		}
+	}
+}
+
+void PCAProjection::write(cv::FileStorage& fs) const {
+	fs << "PCAProjection" << "{";
+	fs << "Mean" << mean;
+	fs << "Components" << components;
+	fs << "}";
+}
+
+void PCAProjection::read(const cv::FileNode& fn) {
+	cv::FileNode projection = fn["PCAProjection"];
+	mean.release();
+	components.release();
+	offset.release();
+	if (projection.empty()) {
+		return;
+	}
+
+	projection["Mean"] >> mean;
+	projection["Components"] >> components;
+	CV_Assert(mean.type() == CV_32F && components.type() == CV_32F);
+	CV_Assert(mean.rows == 1 && mean.cols == components.cols);
+	cv::gemm(mean, components, 1, Mat(), 0, offset, cv::GEMM_2_T);
+}
+
+void PCAProjection::write(MatrixFile& file) const {
+	file.write("PCAProjection.Mean", mean);
+	file.write("PCAProjection.Components", components);
+}
+
+void PCAProjection::read(MatrixFile& file) {
+	file.read("PCAProjection.Mean", mean);
+	file.read("PCAProjection.Components", components);
+	offset.release();
+	if (mean.empty() || components.empty()) {
+		mean.release();
+		components.release();
+		return;
+	}
+
+	CV_Assert(mean.type() == CV_32F && components.type() == CV_32F);
+	CV_Assert(mean.rows == 1 && mean.cols == components.cols);
+	cv::gemm(mean, components, 1, Mat(), 0, offset, cv::GEMM_2_T);
+}
+
+}
@@ -0,0 +1,260 @@
+/*------------------------------------------------------------------------
+ Copyright 2012 Arren Glover [aj.glover@qut.edu.au]
+                Will Maddern [w.maddern@qut.edu.au]
+
+ This file is part of OpenFABMAP. http://code.google.com/p/openfabmap/
+
+ OpenFABMAP is free software: you can redistribute it and/or modify it under
+ the terms of the GNU General Public License as published by the Free Software
+ Foundation, either version 3 of the License, or (at your option) any later
+ version.
+
+ OpenFABMAP is distributed in the hope that it will be useful, but WITHOUT ANY
+ WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ details.
+
+ For published work which uses all or part of OpenFABMAP, please cite:
+ http://ieeexplore.ieee.org/xpl/articleDetails.jsp?arnumber=6224843
+
+ Original Algorithm by Mark Cummins and Paul Newman:
+ http://ijr.sagepub.com/content/27/6/647.short
+ http://ieeexplore.ieee.org/xpl/articleDetails.jsp?arnumber=5613942
+ http://ijr.sagepub.com/content/30/9/1100.abstract
+
+ You should have received a copy of the GNU General Public License along with
+ OpenFABMAP. If not, see http://www.gnu.org/licenses/.
+------------------------------------------------------------------------*/
+
+#include "../include/openfabmap.hpp"
+#include <cstring>
+
+using std::vector;
+using cv::Mat;
+
+namespace of2 {
+
+VocabularyTree::VocabularyTree() : vocabularySize(0) {
+}
+
+VocabularyTree::VocabularyTree(const Mat& vocabulary, int branching) :
+	vocabularySize(0) {
+	build(vocabulary, branching);
+}
+
+VocabularyTree::~VocabularyTree() {
+}
+
+// split the words into at most branching clusters. Words k-means cannot
+// separate, such as duplicates, are split in order
+static void splitWords(const Mat& vocabulary, const vector<int>& words,
+					   int branching, vector<vector<int> >& groups) {
+	Mat data((int)words.size(), vocabulary.cols, CV_32F);
+	for (size_t i = 0; i < words.size(); i++) {
+		Mat row = data.row((int)i);
+		vocabulary.row(words[i]).copyTo(row);
+	}
+	Mat labels, centres;
+	cv::kmeans(data, branching, labels,
+		cv::TermCriteria(cv::TermCriteria::COUNT + cv::TermCriteria::EPS,
+		20, 1e-4), 1, cv::KMEANS_PP_CENTERS, centres);
+
+	groups.assign(branching, vector<int>());
+	for (size_t i = 0; i < words.size(); i++) {
+		groups[labels.at<int>((int)i)].push_back(words[i]);
+	}
+	vector<vector<int> > split;
+	for (size_t g = 0; g < groups.size(); g++) {
+		if (!groups[g].empty()) {
+			split.push_back(vector<int>());
+			split.back().swap(groups[g]);
+		}
+	}
+	if (split.size() < 2) {
+		split.assign(branching, vector<int>());
+		for (size_t i = 0; i < words.size(); i++) {
+			split[i * branching / words.size()].push_back(words[i]);
+		}
+	}
+	groups.swap(split);
+}
+
+// the tree is laid out breadth first, so the children of each node are
+// contiguous
+void VocabularyTree::build(const Mat& vocabulary, int branching) {
+
+	CV_Assert(!vocabulary.empty());
+	CV_Assert(vocabulary.type() == CV_32F);
+	CV_Assert(branching >= 2);
+
+	vocabularySize = vocabulary.rows;
+	centres = Mat::zeros(1, vocabulary.cols, CV_32F);
+	firstChild.assign(1, -1);
+	childCount.assign(1, 0);
+	nodeWords.assign(1, -1);
+
+	vector<vector<int> > nodeMembers(1);
+	for (int q = 0; q < vocabulary.rows; q++) {
+		nodeMembers[0].push_back(q);
+	}
+
+	vector<vector<int> > groups;
+	for (size_t n = 0; n < nodeMembers.size(); n++) {
+		vector<int> members;
+		members.swap(nodeMembers[n]);
+		if (n > 0 && members.size() == 1) {
+			nodeWords[n] = members[0];
+			continue;
+		}
+
+		if ((int)members.size() <= branching) {
+			groups.assign(members.size(), vector<int>());
+			for (size_t i = 0; i < members.size(); i++) {
+				groups[i].push_back(members[i]);
+			}
+		} else {
+			splitWords(vocabulary, members, branching, groups);
+		}
+
+		// each child is centred on the mean of its words
+		firstChild[n] = (int)nodeMembers.size();
+		childCount[n] = (int)groups.size();
+		for (size_t g = 0; g < groups.size(); g++) {
+			Mat centre = Mat::zeros(1, vocabulary.cols, CV_32F);
+			for (size_t i = 0; i < groups[g].size(); i++) {
+				centre += vocabulary.row(groups[g][i]);
+			}
+			centre /= (double)groups[g].size();
+			centres.push_back(centre);
+			nodeMembers.push_back(groups[g]);
+			firstChild.push_back(-1);
+			childCount.push_back(0);
+			nodeWords.push_back(-1);
+		}
+	}
+}
+
+bool VocabularyTree::empty() const {
+	return vocabularySize == 0;
+}
+
+int VocabularyTree::getVocabularySize() const {
+	return vocabularySize;
+}
+
+// each leaf is centred on its one word, so a tree built from the vocabulary
+// has every word as the centre of the leaf that holds it
+bool VocabularyTree::matches(const Mat& vocabulary) const {
+	if (empty() || vocabulary.type() != CV_32F ||
+		vocabulary.rows != vocabularySize || vocabulary.cols != centres.cols) {
+		return false;
+	}
+	vector<bool> found(vocabularySize, false);
+	for (size_t n = 0; n < nodeWords.size(); n++) {
+		int q = nodeWords[n];
+		if (q < 0) {
+			continue;
+		}
+		if (q >= vocabularySize || found[q] ||
+			memcmp(centres.ptr((int)n), vocabulary.ptr(q),
+			centres.cols * sizeof(float)) != 0) {
+			return false;
+		}
+		found[q] = true;
+	}
+	return std::find(found.begin(), found.end(), false) == found.end();
+}
+
+void VocabularyTree::permuteWords(const WordOrder& order) {
+	const vector<int>& oldToNew = order.getOldToNew();
+	CV_Assert((int)oldToNew.size() == vocabularySize);
+	for (size_t n = 0; n < nodeWords.size(); n++) {
+		if (nodeWords[n] >= 0) {
+			nodeWords[n] = oldToNew[nodeWords[n]];
+		}
+	}
+}
+
+int VocabularyTree::nearestChild(int node, const float *descriptor) const {
+	int nearest = firstChild[node];
+	float minDist = FLT_MAX;
+	for (int c = firstChild[node]; c < firstChild[node] + childCount[node];
+		c++) {
+		const float *centre = centres.ptr<float>(c);
+		float dist = 0;
+		for (int k = 0; k < centres.cols; k++) {
+			float d = descriptor[k] - centre[k];
+			dist += d * d;
+		}
+		if (dist < minDist) {
+			minDist = dist;
+			nearest = c;
+		}
+	}
+	return nearest;
+}
+
+void VocabularyTree::quantise(const Mat& descriptors,
+							  vector<int>& words) const {
+	CV_Assert(!empty());
+	CV_Assert(descriptors.empty() || (descriptors.type() == CV_32F &&
+		descriptors.cols == centres.cols));
+
+	words.resize(descriptors.rows);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int i = 0; i < descriptors.rows; i++) {
+		const float *z = descriptors.ptr<float>(i);
+		int node = 0;
+		while (nodeWords[node] < 0) {
+			node = nearestChild(node, z);
+		}
+		words[i] = nodeWords[node];
+	}
+}
+
+void VocabularyTree::compute(const Mat& descriptors,
+							 Mat& imgDescriptor) const {
+	vector<int> words;
+	quantise(descriptors, words);
+
+	imgDescriptor = Mat::zeros(1, vocabularySize, CV_32F);
+	for (size_t i = 0; i < words.size(); i++) {
+		imgDescriptor.at<float>(0, words[i])++;
+	}
+	if (!words.empty()) {
+		imgDescriptor /= (double)words.size();
+	}
+}
+
+void VocabularyTree::write(cv::FileStorage& fs) const {
+	fs << "VocabularyTree" << "{";
+	fs << "VocabularySize" << vocabularySize;
+	fs << "Centres" << centres;
+	fs << "FirstChild" << Mat(firstChild);
+	fs << "ChildCount" << Mat(childCount);
+	fs << "NodeWords" << Mat(nodeWords);
+	fs << "}";
+}
+
+void VocabularyTree::read(const cv::FileNode& fn) {
+	cv::FileNode tree = fn["VocabularyTree"];
+	Mat nodes;
+
+	vocabularySize = (int)tree["VocabularySize"];
+	tree["Centres"] >> centres;
+	CV_Assert(centres.type() == CV_32F);
+
+	tree["FirstChild"] >> nodes;
+	CV_Assert(nodes.type() == CV_32S && (int)nodes.total() == centres.rows);
+	firstChild.assign(nodes.ptr<int>(), nodes.ptr<int>() + nodes.total());
+	tree["ChildCount"] >> nodes;
+	CV_Assert(nodes.type() == CV_32S && (int)nodes.total() == centres.rows);
+	childCount.assign(nodes.ptr<int>(), nodes.ptr<int>() + nodes.total());
+	tree["NodeWords"] >> nodes;
+	CV_Assert(nodes.type() == CV_32S && (int)nodes.total() == centres.rows);
+	nodeWords.assign(nodes.ptr<int>(), nodes.ptr<int>() + nodes.total());
+}
+
+}
@@ -0,0 +1,174 @@
+/*------------------------------------------------------------------------
+ Copyright 2012 Arren Glover [aj.glover@qut.edu.au]
+                Will Maddern [w.maddern@qut.edu.au]
+
+ This file is part of OpenFABMAP. http://code.google.com/p/openfabmap/
+
+ OpenFABMAP is free software: you can redistribute it and/or modify it under
+ the terms of the GNU General Public License as published by the Free Software
+ Foundation, either version 3 of the License, or (at your option) any later
+ version.
+
+ OpenFABMAP is distributed in the hope that it will be useful, but WITHOUT ANY
+ WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ details.
+
+ For published work which uses all or part of OpenFABMAP, please cite:
+ http://ieeexplore.ieee.org/xpl/articleDetails.jsp?arnumber=6224843
+
+ Original Algorithm by Mark Cummins and Paul Newman:
+ http://ijr.sagepub.com/content/27/6/647.short
+ http://ieeexplore.ieee.org/xpl/articleDetails.jsp?arnumber=5613942
+ http://ijr.sagepub.com/content/30/9/1100.abstract
+
+ You should have received a copy of the GNU General Public License along with
+ OpenFABMAP. If not, see http://www.gnu.org/licenses/.
+------------------------------------------------------------------------*/
+
+#include "../include/openfabmap.hpp"
+
+using std::vector;
+using cv::Mat;
+
+namespace of2 {
+
+WordOrder::WordOrder() {
+}
+
+WordOrder::WordOrder(const Mat& clTree, int order) {
+
+	CV_Assert(clTree.type() == CV_64FC1 && clTree.rows == 4);
+	CV_Assert(order == BREADTH_FIRST || order == DEPTH_FIRST);
+
+	int nWords = clTree.cols;
+
+	// children of each word in increasing word order. Roots are their own
+	// parents
+	vector<vector<int> > children(nWords);
+	vector<int> roots;
+	for (int q = 0; q < nWords; q++) {
+		int pq = (int)clTree.at<double>(0, q);
+		if (pq == q) {
+			roots.push_back(q);
+		} else {
+			children[pq].push_back(q);
+		}
+	}
+	CV_Assert(!roots.empty());
+
+	newToOld.reserve(nWords);
+	if (order == BREADTH_FIRST) {
+		newToOld.insert(newToOld.end(), roots.begin(), roots.end());
+		for (size_t i = 0; i < newToOld.size(); i++) {
+			const vector<int>& c = children[newToOld[i]];
+			newToOld.insert(newToOld.end(), c.begin(), c.end());
+		}
+	} else {
+		// pre-order, so every subtree is contiguous
+		vector<int> stack(roots.rbegin(), roots.rend());
+		while (!stack.empty()) {
+			int q = stack.back();
+			stack.pop_back();
+			newToOld.push_back(q);
+			stack.insert(stack.end(), children[q].rbegin(), 
+				children[q].rend());
+		}
+	}
+	CV_Assert((int)newToOld.size() == nWords);
+
+	oldToNew.resize(nWords);
+	for (int i = 0; i < nWords; i++) {
+		oldToNew[newToOld[i]] = i;
+	}
+}
+
+WordOrder::~WordOrder() {
+}
+
+Mat WordOrder::permuteTree(const Mat& clTree) const {
+	CV_Assert(clTree.type() == CV_64FC1 && clTree.rows == 4);
+	CV_Assert(clTree.cols == (int)newToOld.size());
+
+	Mat permuted(4, clTree.cols, CV_64FC1);
+	for (int i = 0; i < clTree.cols; i++) {
+		int q = newToOld[i];
+		permuted.at<double>(0, i) = oldToNew[(int)clTree.at<double>(0, q)];
+		permuted.at<double>(1, i) = clTree.at<double>(1, q);
+		permuted.at<double>(2, i) = clTree.at<double>(2, q);
+		permuted.at<double>(3, i) = clTree.at<double>(3, q);
+	}
+	return permuted;
+}
+
+Mat WordOrder::permuteVocabulary(const Mat& vocabulary) const {
+	CV_Assert(vocabulary.rows == (int)newToOld.size());
+
+	Mat permuted(vocabulary.rows, vocabulary.cols, vocabulary.type());
+	for (int i = 0; i < vocabulary.rows; i++) {
+		Mat row = permuted.row(i);
+		vocabulary.row(newToOld[i]).copyTo(row);
+	}
+	return permuted;
+}
+
+Mat WordOrder::permuteImgDescriptors(const Mat& imgDescriptors) const {
+	CV_Assert(imgDescriptors.cols == (int)newToOld.size());
+	CV_Assert(imgDescriptors.type() == CV_32F);
+
+	Mat permuted(imgDescriptors.rows, imgDescriptors.cols, CV_32F);
+	for (int j = 0; j < imgDescriptors.rows; j++) {
+		const float *src = imgDescriptors.ptr<float>(j);
+		float *dst = permuted.ptr<float>(j);
+		for (int i = 0; i < imgDescriptors.cols; i++) {
+			dst[i] = src[newToOld[i]];
+		}
+	}
+	return permuted;
+}
+
+const vector<int>& WordOrder::getNewToOld() const {
+	return newToOld;
+}
+
+const vector<int>& WordOrder::getOldToNew() const {
+	return oldToNew;
+}
+
+void WordOrder::write(cv::FileStorage& fs) const {
+	fs << "WordOrder" << Mat(newToOld);
+}
+
+void WordOrder::read(const cv::FileNode& fn) {
+	Mat order;
+	fn["WordOrder"] >> order;
+	CV_Assert(order.type() == CV_32S);
+
+	newToOld.assign(order.ptr<int>(), order.ptr<int>() + order.total());
+	oldToNew.resize(newToOld.size());
+	for (size_t i = 0; i < newToOld.size(); i++) {
+		oldToNew[newToOld[i]] = (int)i;
+	}
+}
+
+void WordOrder::write(MatrixFile& file) const {
+	file.write("WordOrder", Mat(newToOld));
+}
+
+bool WordOrder::read(MatrixFile& file) {
+	Mat order;
+	file.read("WordOrder", order);
+	if (order.empty()) {
+		return false;
+	}
+	CV_Assert(order.type() == CV_32S);
+
+	newToOld.assign(order.ptr<int>(), order.ptr<int>() + order.total());
+	oldToNew.resize(newToOld.size());
+	for (size_t i = 0; i < newToOld.size(); i++) {
+		oldToNew[newToOld[i]] = (int)i;
+	}
+	return true;
+}
+
+}
@@ -0,0 +1,137 @@
+/*------------------------------------------------------------------------
+ Copyright 2012 Arren Glover [aj.glover@qut.edu.au]
+                Will Maddern [w.maddern@qut.edu.au]
+
+ This file is part of OpenFABMAP. http://code.google.com/p/openfabmap/
+
+ OpenFABMAP is free software: you can redistribute it and/or modify it under
+ the terms of the GNU General Public License as published by the Free Software
+ Foundation, either version 3 of the License, or (at your option) any later
+ version.
+
+ OpenFABMAP is distributed in the hope that it will be useful, but WITHOUT ANY
+ WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ details.
+
+ For published work which uses all or part of OpenFABMAP, please cite:
+ http://ieeexplore.ieee.org/xpl/articleDetails.jsp?arnumber=6224843
+
+ Original Algorithm by Mark Cummins and Paul Newman:
+ http://ijr.sagepub.com/content/27/6/647.short
+ http://ieeexplore.ieee.org/xpl/articleDetails.jsp?arnumber=5613942
+ http://ijr.sagepub.com/content/30/9/1100.abstract
+
+ You should have received a copy of the GNU General Public License along with
+ OpenFABMAP. If not, see http://www.gnu.org/licenses/.
+------------------------------------------------------------------------*/
+
+#include "testUtils.hpp"
+#include <cfloat>
+#include <cstdio>
+
+/*
+	Modified sequential clustering must find the vocabulary of the original
+	algorithm, which compared every descriptor with every centre one at a
+	time, whatever the number of threads and however the descriptors are
+	given to it.
+*/
+
+static const char *descriptorFilename = "testBOWMSCTrainer.bin";
+
+//the original calculation: each descriptor further than clusterSize from
+//every centre so far becomes a centre, then every descriptor is assigned
+//to its nearest centre, the first on ties, and each word is the mean of
+//the descriptors assigned to it
+static cv::Mat referenceVocabulary(const cv::Mat& descriptors,
+		double clusterSize) {
+
+	std::vector<int> centres(1, 0);
+	for (int i = 1; i < descriptors.rows; i++) {
+		double minDist = DBL_MAX;
+		for (size_t j = 0; j < centres.size(); j++) {
+			minDist = std::min(minDist, cv::norm(descriptors.row(i),
+				descriptors.row(centres[j])));
+		}
+		if (minDist > clusterSize) {
+			centres.push_back(i);
+		}
+	}
+
+	cv::Mat sums = cv::Mat::zeros((int)centres.size(), descriptors.cols,
+		CV_64F);
+	std::vector<int> counts(centres.size(), 0);
+	for (int i = 0; i < descriptors.rows; i++) {
+		int index = 0;
+		double minDist = DBL_MAX;
+		for (size_t j = 0; j < centres.size(); j++) {
+			double dist = cv::norm(descriptors.row(i),
+				descriptors.row(centres[j]));
+			if (dist < minDist) {
+				minDist = dist;
+				index = (int)j;
+			}
+		}
+		for (int k = 0; k < descriptors.cols; k++) {
+			sums.at<double>(index, k) += descriptors.at<float>(i, k);
+		}
+		counts[index]++;
+	}
+
+	cv::Mat vocabulary(sums.rows, sums.cols, CV_32F);
+	for (int j = 0; j < sums.rows; j++) {
+		for (int k = 0; k < sums.cols; k++) {
+			vocabulary.at<float>(j, k) =
+				(float)(sums.at<double>(j, k) / counts[j]);
+		}
+	}
+	return vocabulary;
+}
+
+static void testClustering(const cv::Mat& descriptors, double clusterSize,
+		int minWords) {
+
+	// the means may differ in the last bits from the order of summation
+	const double tolerance = 1e-5;
+	cv::Mat reference = referenceVocabulary(descriptors, clusterSize);
+	TEST_CHECK(reference.rows >= minWords);
+
+	cv::Mat single = of2::BOWMSCTrainer(clusterSize, 1).cluster(descriptors);
+	TEST_CHECK(maxDifference(single, reference) < tolerance);
+
+	// the threads share the comparisons, the vocabulary does not change
+	cv::Mat parallel = of2::BOWMSCTrainer(clusterSize, 4).cluster(
+		descriptors);
+	TEST_CHECK(maxDifference(parallel, single) == 0);
+
+	// in batches
+	std::vector<cv::Mat> batches;
+	for (int i = 0; i < descriptors.rows; i += 700) {
+		batches.push_back(descriptors.rowRange(i, std::min(i + 700,
+			descriptors.rows)));
+	}
+	of2::BOWMSCTrainer trainer(clusterSize, 4);
+	TEST_CHECK(maxDifference(trainer.cluster(batches), single) == 0);
+	trainer.add(descriptors.rowRange(0, 1000));
+	trainer.add(descriptors.rowRange(1000, descriptors.rows));
+	TEST_CHECK(maxDifference(trainer.cluster(), single) == 0);
+
+	// streamed from disk
+	{
+		of2::MatrixFile file(descriptorFilename, of2::MatrixFile::WRITE);
+		file.write("Descriptors", descriptors);
+	}
+	of2::BOWDescriptorReader reader(descriptorFilename, "Descriptors");
+	TEST_CHECK(maxDifference(trainer.cluster(reader, 999), single) == 0);
+	std::remove(descriptorFilename);
+}
+
+int main() {
+	// a few dozen words from 16 dimensional descriptors
+	testClustering(testDescriptors(3000, 16, 1), 0.9, 20);
+	// enough words that the centres are indexed in a vantage point tree,
+	// which is rebuilt as more are found
+	testClustering(testDescriptors(8000, 8, 2), 0.5, 600);
+
+	return testResult("testBOWMSCTrainer");
+}
@@ -0,0 +1,157 @@
+/*------------------------------------------------------------------------
+ Copyright 2012 Arren Glover [aj.glover@qut.edu.au]
+                Will Maddern [w.maddern@qut.edu.au]
+
+ This file is part of OpenFABMAP. http://code.google.com/p/openfabmap/
+
+ OpenFABMAP is free software: you can redistribute it and/or modify it under
+ the terms of the GNU General Public License as published by the Free Software
+ Foundation, either version 3 of the License, or (at your option) any later
+ version.
+
+ OpenFABMAP is distributed in the hope that it will be useful, but WITHOUT ANY
+ WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ details.
+
+ For published work which uses all or part of OpenFABMAP, please cite:
+ http://ieeexplore.ieee.org/xpl/articleDetails.jsp?arnumber=6224843
+
+ Original Algorithm by Mark Cummins and Paul Newman:
+ http://ijr.sagepub.com/content/27/6/647.short
+ http://ieeexplore.ieee.org/xpl/articleDetails.jsp?arnumber=5613942
+ http://ijr.sagepub.com/content/30/9/1100.abstract
+
+ You should have received a copy of the GNU General Public License along with
+ OpenFABMAP. If not, see http://www.gnu.org/licenses/.
+------------------------------------------------------------------------*/
+
+#include "testUtils.hpp"
+#include <cfloat>
+#include <climits>
+
+/*
+	The blocked quantiser must find the word a brute force search over the
+	whole vocabulary finds, as the descriptor matcher of the original
+	bag-of-words extraction did, for float and binary vocabularies.
+*/
+
+//how many descriptors the quantiser gave a word further than the nearest,
+//allowing for rounding in the expanded distance
+static int fartherWords(const cv::Mat& vocabulary, const cv::Mat& descriptors,
+		const std::vector<int>& words) {
+	int farther = 0;
+	for (int i = 0; i < descriptors.rows; i++) {
+		double nearest = DBL_MAX, given = DBL_MAX;
+		for (int q = 0; q < vocabulary.rows; q++) {
+			double distSq = 0;
+			for (int k = 0; k < vocabulary.cols; k++) {
+				double d = descriptors.at<float>(i, k) -
+					vocabulary.at<float>(q, k);
+				distSq += d * d;
+			}
+			nearest = std::min(nearest, distSq);
+			if (q == words[i]) {
+				given = distSq;
+			}
+		}
+		farther += given > nearest + 1e-5 * (1 + nearest);
+	}
+	return farther;
+}
+
+static void testFloat() {
+	// a last panel only partly filled
+	cv::Mat vocabulary = testDescriptors(500, 64, 1);
+	cv::Mat descriptors = testDescriptors(300, 64, 2);
+	of2::BOWQuantiser quantiser(vocabulary);
+	TEST_CHECK(quantiser.getVocabularySize() == 500);
+
+	std::vector<int> words;
+	quantiser.quantise(descriptors, words);
+	TEST_CHECK((int)words.size() == descriptors.rows);
+	TEST_CHECK(fartherWords(vocabulary, descriptors, words) == 0);
+
+	// every word is its own nearest word
+	quantiser.quantise(vocabulary, words);
+	int ownWord = 0;
+	for (int q = 0; q < vocabulary.rows; q++) {
+		ownWord += words[q] == q;
+	}
+	TEST_CHECK(ownWord == vocabulary.rows);
+
+	// ties go to the lower word
+	cv::Mat repeated = vocabulary.clone();
+	repeated.push_back(vocabulary.rowRange(0, 20));
+	of2::BOWQuantiser repeatedQuantiser(repeated);
+	repeatedQuantiser.quantise(repeated.rowRange(500, 520), words);
+	for (int q = 0; q < 20; q++) {
+		TEST_CHECK(words[q] == q);
+	}
+
+	// the image descriptors count each word over the descriptors
+	cv::Mat imgDescriptor, wordList;
+	quantiser.quantise(descriptors, words);
+	quantiser.compute(descriptors, imgDescriptor);
+	quantiser.computeWordList(descriptors, wordList);
+	cv::Mat counts = cv::Mat::zeros(1, vocabulary.rows, CV_32F);
+	for (size_t i = 0; i < words.size(); i++) {
+		counts.at<float>(0, words[i]) += 1.f / descriptors.rows;
+	}
+	TEST_CHECK(maxDifference(imgDescriptor, counts) < 1e-6);
+	std::vector<int> present;
+	for (int q = 0; q < vocabulary.rows; q++) {
+		if (counts.at<float>(0, q) > 0) {
+			present.push_back(q);
+		}
+	}
+	TEST_CHECK(wordList.type() == CV_32S &&
+		wordList.total() == present.size() &&
+		std::equal(present.begin(), present.end(), wordList.ptr<int>()));
+}
+
+static void testBinary() {
+	cv::Mat vocabulary(300, 32, CV_8U), descriptors(200, 32, CV_8U);
+	testSeed = 3;
+	for (int q = 0; q < vocabulary.rows; q++) {
+		for (int k = 0; k < vocabulary.cols; k++) {
+			vocabulary.at<uchar>(q, k) = (uchar)(testUniform() * 256);
+		}
+	}
+	for (int i = 0; i < descriptors.rows; i++) {
+		for (int k = 0; k < descriptors.cols; k++) {
+			descriptors.at<uchar>(i, k) = (uchar)(testUniform() * 256);
+		}
+	}
+	of2::BOWQuantiser quantiser(vocabulary);
+	std::vector<int> words;
+	quantiser.quantise(descriptors, words);
+
+	// hamming distances are exact, so the word must be the first nearest
+	int differ = 0;
+	for (int i = 0; i < descriptors.rows; i++) {
+		int nearest = -1, minDist = INT_MAX;
+		for (int q = 0; q < vocabulary.rows; q++) {
+			int dist = 0;
+			for (int k = 0; k < vocabulary.cols; k++) {
+				uchar x = descriptors.at<uchar>(i, k) ^
+					vocabulary.at<uchar>(q, k);
+				for (; x; x &= x - 1) {
+					dist++;
+				}
+			}
+			if (dist < minDist) {
+				minDist = dist;
+				nearest = q;
+			}
+		}
+		differ += words[i] != nearest;
+	}
+	TEST_CHECK(differ == 0);
+}
+
+int main() {
+	testFloat();
+	testBinary();
+	return testResult("testBOWQuantiser");
+}
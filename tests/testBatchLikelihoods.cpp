@@ -0,0 +1,96 @@
+/*------------------------------------------------------------------------
+ Copyright 2012 Arren Glover [aj.glover@qut.edu.au]
+                Will Maddern [w.maddern@qut.edu.au]
+
+ This file is part of OpenFABMAP. http://code.google.com/p/openfabmap/
+
+ OpenFABMAP is free software: you can redistribute it and/or modify it under
+ the terms of the GNU General Public License as published by the Free Software
+ Foundation, either version 3 of the License, or (at your option) any later
+ version.
+
+ OpenFABMAP is distributed in the hope that it will be useful, but WITHOUT ANY
+ WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ details.
+
+ For published work which uses all or part of OpenFABMAP, please cite:
+ http://ieeexplore.ieee.org/xpl/articleDetails.jsp?arnumber=6224843
+
+ Original Algorithm by Mark Cummins and Paul Newman:
+ http://ijr.sagepub.com/content/27/6/647.short
+ http://ieeexplore.ieee.org/xpl/articleDetails.jsp?arnumber=5613942
+ http://ijr.sagepub.com/content/30/9/1100.abstract
+
+ You should have received a copy of the GNU General Public License along with
+ OpenFABMAP. If not, see http://www.gnu.org/licenses/.
+------------------------------------------------------------------------*/
+
+#include "testUtils.hpp"
+
+/*
+	Several independent queries are scored together, which FabMapLUT does
+	in cache blocks of queries against test images. The matches must be
+	those of scoring each query on its own, for every table type.
+*/
+
+//the matches of each query scored on its own, numbered as a batch
+static std::vector<of2::IMatch> singleMatches(of2::FabMap& fabmap,
+		const std::vector<cv::Mat>& queries,
+		const std::vector<cv::Mat>& testImgs) {
+	std::vector<of2::IMatch> matches;
+	for (size_t i = 0; i < queries.size(); i++) {
+		std::vector<of2::IMatch> queryMatches;
+		fabmap.compare(queries[i], testImgs, queryMatches);
+		for (size_t j = 0; j < queryMatches.size(); j++) {
+			queryMatches[j].queryIdx = (int)i;
+		}
+		matches.insert(matches.end(), queryMatches.begin(),
+			queryMatches.end());
+	}
+	return matches;
+}
+
+static double batchDifference(of2::FabMap& fabmap,
+		const std::vector<cv::Mat>& queries,
+		const std::vector<cv::Mat>& testImgs) {
+	std::vector<of2::IMatch> batchMatches;
+	fabmap.compare(queries, testImgs, batchMatches);
+	return maxDifference(batchMatches,
+		singleMatches(fabmap, queries, testImgs));
+}
+
+int main() {
+	// enough words and images to span several blocks
+	const int nWords = 2100;
+	cv::Mat training = testImgDescriptors(150, nWords, 0.05, 1);
+	of2::ChowLiuTree tree;
+	tree.add(training);
+	cv::Mat clTree = tree.make();
+	std::vector<cv::Mat> queries = testRows(
+		testImgDescriptors(70, nWords, 0.05, 2));
+	std::vector<cv::Mat> testImgs = testRows(
+		testImgDescriptors(75, nWords, 0.05, 3));
+
+	const double tolerance = 1e-9;
+	int tableTypes[] = {CV_32S, CV_32F, CV_16S, CV_8S};
+	int methods[] = {of2::FabMap::CHOW_LIU, of2::FabMap::NAIVE_BAYES};
+	for (int m = 0; m < 2; m++) {
+		int flags = of2::FabMap::MEAN_FIELD | methods[m];
+		for (int t = 0; t < 4; t++) {
+			of2::FabMapLUT lut(clTree, 0.39, 0, flags, 0, 6, tableTypes[t]);
+			TEST_CHECK(batchDifference(lut, queries, testImgs) < tolerance);
+		}
+		// the other engines score a batch a query at a time
+		of2::FabMap1 fabmap1(clTree, 0.39, 0, flags);
+		TEST_CHECK(batchDifference(fabmap1, queries, testImgs) < tolerance);
+	}
+
+	// a single query is not batched
+	of2::FabMapLUT lut(clTree, 0.39, 0,
+		of2::FabMap::MEAN_FIELD | of2::FabMap::CHOW_LIU);
+	std::vector<cv::Mat> oneQuery(1, queries[0]);
+	TEST_CHECK(batchDifference(lut, oneQuery, testImgs) < tolerance);
+
+	return testResult("testBatchLikelihoods");
+}
@@ -0,0 +1,287 @@
+/*------------------------------------------------------------------------
+ Copyright 2012 Arren Glover [aj.glover@qut.edu.au]
+                Will Maddern [w.maddern@qut.edu.au]
+
+ This file is part of OpenFABMAP. http://code.google.com/p/openfabmap/
+
+ OpenFABMAP is free software: you can redistribute it and/or modify it under
+ the terms of the GNU General Public License as published by the Free Software
+ Foundation, either version 3 of the License, or (at your option) any later
+ version.
+
+ OpenFABMAP is distributed in the hope that it will be useful, but WITHOUT ANY
+ WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ details.
+
+ For published work which uses all or part of OpenFABMAP, please cite:
+ http://ieeexplore.ieee.org/xpl/articleDetails.jsp?arnumber=6224843
+
+ Original Algorithm by Mark Cummins and Paul Newman:
+ http://ijr.sagepub.com/content/27/6/647.short
+ http://ieeexplore.ieee.org/xpl/articleDetails.jsp?arnumber=5613942
+ http://ijr.sagepub.com/content/30/9/1100.abstract
+
+ You should have received a copy of the GNU General Public License along with
+ OpenFABMAP. If not, see http://www.gnu.org/licenses/.
+------------------------------------------------------------------------*/
+
+#include "testUtils.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <list>
+
+/*
+	The Chow-Liu tree learned from running co-occurrence counts must be the
+	tree of the original algorithm, which scored every pair of words from
+	the descriptors themselves and reduced the complete graph with
+	Kruskal's algorithm, however the descriptors are counted.
+*/
+
+static const char *descriptorFilename = "testChowLiuTree.bin";
+
+//whether the parents of a Chow-Liu tree link every word to a single root
+static bool isTree(const cv::Mat& clTree) {
+	int nWords = clTree.cols, roots = 0;
+	for (int q = 0; q < nWords; q++) {
+		int pq = (int)clTree.at<double>(0, q);
+		if (pq < 0 || pq >= nWords) {
+			return false;
+		}
+		roots += pq == q;
+		for (int row = 1; row < 4; row++) {
+			double p = clTree.at<double>(row, q);
+			if (!(p > 0 && p < 1)) {
+				return false;
+			}
+		}
+	}
+	if (roots != 1) {
+		return false;
+	}
+	// every word reaches the root within nWords steps
+	for (int q = 0; q < nWords; q++) {
+		int word = q, steps = 0;
+		while ((int)clTree.at<double>(0, word) != word && steps < nWords) {
+			word = (int)clTree.at<double>(0, word);
+			steps++;
+		}
+		if (steps == nWords) {
+			return false;
+		}
+	}
+	return true;
+}
+
+//the original calculation, straight from the descriptors
+class ReferenceTree {
+public:
+	ReferenceTree(const cv::Mat& descriptors) :
+		nImages(descriptors.rows), nWords(descriptors.cols),
+		present(descriptors.rows, std::vector<bool>(descriptors.cols)) {
+		for (int i = 0; i < nImages; i++) {
+			for (int q = 0; q < nWords; q++) {
+				present[i][q] = descriptors.at<float>(i, q) > 0;
+			}
+		}
+	}
+
+	//empty if no spanning tree has every link above the threshold
+	cv::Mat make(double infoThreshold = 0) {
+
+		std::list<Edge> edges;
+		for (int word1 = 0; word1 < nWords; word1++) {
+			for (int word2 = word1 + 1; word2 < nWords; word2++) {
+				Edge edge = {(float)mutualInfo(word1, word2), word1, word2};
+				if (edge.score >= infoThreshold) {
+					edges.push_back(edge);
+				}
+			}
+		}
+		edges.sort(moreInfo);
+
+		// Kruskal's algorithm
+		std::vector<int> groups(nWords);
+		for (int q = 0; q < nWords; q++) {
+			groups[q] = q;
+		}
+		std::list<Edge>::iterator edge = edges.begin();
+		while (edge != edges.end()) {
+			int group1 = groups[edge->word1], group2 = groups[edge->word2];
+			if (group1 == group2) {
+				edge = edges.erase(edge);
+				continue;
+			}
+			std::replace(groups.begin(), groups.end(), group2, group1);
+			edge++;
+		}
+		if ((int)edges.size() != nWords - 1) {
+			return cv::Mat();
+		}
+
+		// rooted at the most informative edge
+		int root = edges.front().word1;
+		cv::Mat clTree(4, nWords, CV_64F);
+		clTree.at<double>(0, root) = root;
+		clTree.at<double>(1, root) = P(root);
+		clTree.at<double>(2, root) = P(root);
+		clTree.at<double>(3, root) = P(root);
+		std::vector<int> order(1, root);
+		std::vector<bool> added(nWords, false);
+		added[root] = true;
+		for (size_t i = 0; i < order.size(); i++) {
+			int pq = order[i];
+			for (edge = edges.begin(); edge != edges.end(); edge++) {
+				int q = edge->word1 == pq ? edge->word2 :
+					edge->word2 == pq ? edge->word1 : -1;
+				if (q < 0 || added[q]) {
+					continue;
+				}
+				added[q] = true;
+				order.push_back(q);
+				clTree.at<double>(0, q) = pq;
+				clTree.at<double>(1, q) = P(q);
+				clTree.at<double>(2, q) = CP(q, pq, true);
+				clTree.at<double>(3, q) = CP(q, pq, false);
+			}
+		}
+		return clTree;
+	}
+
+private:
+	struct Edge {
+		float score;
+		int word1;
+		int word2;
+	};
+
+	static bool moreInfo(const Edge& first, const Edge& second) {
+		return first.score > second.score;
+	}
+
+	double P(int a) {
+		int count = 0;
+		for (int i = 0; i < nImages; i++) {
+			count += present[i][a];
+		}
+		return (0.98 * count / nImages) + 0.01;
+	}
+
+	double JP(int a, bool za, int b, bool zb) {
+		int count = 0;
+		for (int i = 0; i < nImages; i++) {
+			count += present[i][a] == za && present[i][b] == zb;
+		}
+		return count / (double)nImages;
+	}
+
+	//P(a = true | b = zb)
+	double CP(int a, int b, bool zb) {
+		int count = 0, total = 0;
+		for (int i = 0; i < nImages; i++) {
+			if (present[i][b] == zb) {
+				total++;
+				count += present[i][a];
+			}
+		}
+		return total ? (double)(0.98 * count) / total + 0.01 : 0.01;
+	}
+
+	double mutualInfo(int a, int b) {
+		double info = 0;
+		for (int za = 0; za < 2; za++) {
+			for (int zb = 0; zb < 2; zb++) {
+				double joint = JP(a, za != 0, b, zb != 0);
+				double pa = za ? P(a) : 1 - P(a);
+				double pb = zb ? P(b) : 1 - P(b);
+				if (joint) {
+					info += joint * log(joint / (pa * pb));
+				}
+			}
+		}
+		return info;
+	}
+
+	int nImages;
+	int nWords;
+	std::vector<std::vector<bool> > present;
+};
+
+int main() {
+	cv::Mat descriptors = testImgDescriptors(300, 40, 0.15, 1);
+	cv::Mat reference = ReferenceTree(descriptors).make();
+	TEST_CHECK(!reference.empty());
+
+	// all at once, on one thread and on several
+	for (int threads = 1; threads <= 4; threads += 3) {
+		of2::ChowLiuTree tree;
+		tree.add(descriptors);
+		TEST_CHECK(maxDifference(tree.make(0, threads), reference) == 0);
+	}
+
+	// counted a few descriptors at a time
+	of2::ChowLiuTree batches;
+	for (int i = 0; i < descriptors.rows; i += 70) {
+		batches.add(descriptors.rowRange(i, std::min(i + 70,
+			descriptors.rows)));
+		batches.updateStatistics();
+	}
+	TEST_CHECK(maxDifference(batches.make(), reference) == 0);
+
+	// counted one descriptor at a time
+	of2::ChowLiuTree rows;
+	rows.add(testRows(descriptors));
+	TEST_CHECK(maxDifference(rows.make(), reference) == 0);
+
+	// counted on shards and merged
+	of2::ChowLiuTree shard1, shard2, merged;
+	shard1.add(descriptors.rowRange(0, 120));
+	shard1.updateStatistics();
+	shard2.add(descriptors.rowRange(120, descriptors.rows));
+	merged.merge(shard1);
+	merged.merge(shard2);
+	TEST_CHECK(maxDifference(merged.make(), reference) == 0);
+
+	// streamed from disk
+	{
+		of2::MatrixFile file(descriptorFilename, of2::MatrixFile::WRITE);
+		file.write("BOWImageDescs", descriptors, true);
+	}
+	of2::BOWDescriptorReader reader(descriptorFilename);
+	of2::ChowLiuTree streamed;
+	streamed.updateStatistics(reader, 37);
+	TEST_CHECK(maxDifference(streamed.make(), reference) == 0);
+
+	// Prim's algorithm keeps to the links above an information threshold
+	// as Kruskal's does, and fails where no spanning tree has them all
+	cv::Mat thresholded = ReferenceTree(descriptors).make(1e-4);
+	TEST_CHECK(!thresholded.empty());
+	of2::ChowLiuTree threshold;
+	threshold.add(descriptors);
+	TEST_CHECK(maxDifference(threshold.make(1e-4), thresholded) == 0);
+	TEST_CHECK(ReferenceTree(descriptors).make(1).empty());
+	bool connected = true;
+	try {
+		of2::ChowLiuTree unlinked;
+		unlinked.add(descriptors);
+		unlinked.make(1);
+	} catch (const cv::Exception&) {
+		connected = false;
+	}
+	TEST_CHECK(!connected);
+
+	// counting every partner of every word gives the exact tree, here
+	// where the tree only links words seen together
+	of2::ChowLiuTree allPartners(descriptors.cols);
+	allPartners.add(descriptors);
+	TEST_CHECK(maxDifference(allPartners.make(), reference) == 0);
+
+	// a few partners per word still span the vocabulary
+	of2::ChowLiuTree fewPartners(3);
+	fewPartners.add(descriptors);
+	TEST_CHECK(isTree(fewPartners.make()));
+	TEST_CHECK(isTree(reference));
+
+	std::remove(descriptorFilename);
+	return testResult("testChowLiuTree");
+}
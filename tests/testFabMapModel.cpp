@@ -0,0 +1,155 @@
+/*------------------------------------------------------------------------
+ Copyright 2012 Arren Glover [aj.glover@qut.edu.au]
+                Will Maddern [w.maddern@qut.edu.au]
+
+ This file is part of OpenFABMAP. http://code.google.com/p/openfabmap/
+
+ OpenFABMAP is free software: you can redistribute it and/or modify it under
+ the terms of the GNU General Public License as published by the Free Software
+ Foundation, either version 3 of the License, or (at your option) any later
+ version.
+
+ OpenFABMAP is distributed in the hope that it will be useful, but WITHOUT ANY
+ WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ details.
+
+ For published work which uses all or part of OpenFABMAP, please cite:
+ http://ieeexplore.ieee.org/xpl/articleDetails.jsp?arnumber=6224843
+
+ Original Algorithm by Mark Cummins and Paul Newman:
+ http://ijr.sagepub.com/content/27/6/647.short
+ http://ieeexplore.ieee.org/xpl/articleDetails.jsp?arnumber=5613942
+ http://ijr.sagepub.com/content/30/9/1100.abstract
+
+ You should have received a copy of the GNU General Public License along with
+ OpenFABMAP. If not, see http://www.gnu.org/licenses/.
+------------------------------------------------------------------------*/
+
+#include "testUtils.hpp"
+#include <cstdio>
+#include <cstdlib>
+
+/*
+	A compiled model saved and mapped back gives every engine the same
+	likelihoods as building the engine from the Chow-Liu tree, and damaged
+	model files are refused.
+*/
+
+static const char *modelFilename = "testFabMapModel.bin";
+
+static const double PzGe = 0.39;
+static const double PzGNe = 0;
+
+//the matches of each query against the training images, with the same
+//samples drawn for the sampled new place likelihood
+static std::vector<of2::IMatch> compare(of2::FabMap& fabmap,
+		const cv::Mat& training, const cv::Mat& queries) {
+	fabmap.addTraining(training);
+	fabmap.add(training.rowRange(0, 40));
+	std::vector<of2::IMatch> matches;
+	srand(7);
+	fabmap.compare(queries, matches);
+	return matches;
+}
+
+static void testEngines(const cv::Mat& clTree, const cv::Mat& training,
+		const cv::Mat& queries, int flags) {
+
+	{
+		of2::FabMapModel model(clTree, PzGe, PzGNe, flags, 6, CV_16S);
+		model.save(modelFilename);
+	}
+	cv::Ptr<of2::FabMapModel> model = new of2::FabMapModel(modelFilename);
+	TEST_CHECK(model->matchesTree(clTree));
+	TEST_CHECK(model->getPzGe() == PzGe && model->getPzGNe() == PzGNe);
+	TEST_CHECK(model->getLUTPrecision() == 6);
+	TEST_CHECK(model->getLUTTableType() == CV_16S);
+	TEST_CHECK(maxDifference(model->getTree(), clTree) == 0);
+
+	of2::FabMap1 fabmap1(clTree, PzGe, PzGNe, flags, 20);
+	of2::FabMap1 modelFabmap1(model, flags, 20);
+	TEST_CHECK(maxDifference(compare(fabmap1, training, queries),
+		compare(modelFabmap1, training, queries)) == 0);
+
+	of2::FabMapLUT lut(clTree, PzGe, PzGNe, flags, 20, 6, CV_16S);
+	of2::FabMapLUT modelLut(model, flags, 20);
+	TEST_CHECK(maxDifference(compare(lut, training, queries),
+		compare(modelLut, training, queries)) == 0);
+
+	of2::FabMapFBO fbo(clTree, PzGe, PzGNe, flags, 20, 1e-6, 1e-6);
+	of2::FabMapFBO modelFbo(model, flags, 20, 1e-6, 1e-6);
+	TEST_CHECK(maxDifference(compare(fbo, training, queries),
+		compare(modelFbo, training, queries)) == 0);
+
+	// FabMap2 samples the new place likelihood only
+	if (!(flags & of2::FabMap::SAMPLED)) {
+		return;
+	}
+	of2::FabMap2 fabmap2(clTree, PzGe, PzGNe, flags);
+	of2::FabMap2 modelFabmap2(model, flags);
+	TEST_CHECK(maxDifference(compare(fabmap2, training, queries),
+		compare(modelFabmap2, training, queries)) == 0);
+}
+
+static bool loads(const std::string& data) {
+	{
+		std::ofstream out(modelFilename, std::ios::out | std::ios::binary);
+		out.write(data.data(), data.size());
+	}
+	try {
+		of2::FabMapModel model(modelFilename);
+	} catch (const cv::Exception&) {
+		return false;
+	}
+	return true;
+}
+
+static void testDamage(const cv::Mat& clTree) {
+
+	{
+		of2::FabMapModel model(clTree, PzGe, PzGNe, of2::FabMap::CHOW_LIU);
+		model.save(modelFilename);
+	}
+	std::ifstream in(modelFilename, std::ios::in | std::ios::binary);
+	std::string data((std::istreambuf_iterator<char>(in)),
+		std::istreambuf_iterator<char>());
+	in.close();
+
+	TEST_CHECK(loads(data));
+	TEST_CHECK(!loads(data.substr(0, data.size() / 2)));
+	TEST_CHECK(!loads(data.substr(0, 16)));
+
+	// a parent outside the vocabulary, read from the offset of the tree
+	// in the header
+	long long treeOffset;
+	memcpy(&treeOffset, &data[56], sizeof(treeOffset));
+	std::string damaged = data;
+	double parent = 1e6;
+	memcpy(&damaged[(size_t)treeOffset + sizeof(double)], &parent,
+		sizeof(parent));
+	TEST_CHECK(!loads(damaged));
+
+	// a model of another tree
+	cv::Mat otherTree = clTree.clone();
+	otherTree.at<double>(1, 3) += 0.01;
+	of2::FabMapModel model(clTree, PzGe, PzGNe, of2::FabMap::CHOW_LIU);
+	TEST_CHECK(!model.matchesTree(otherTree));
+}
+
+int main() {
+	cv::Mat training = testImgDescriptors(200, 40, 0.2, 1);
+	cv::Mat queries = testImgDescriptors(20, 40, 0.2, 2);
+	of2::ChowLiuTree tree;
+	tree.add(training);
+	cv::Mat clTree = tree.make();
+
+	testEngines(clTree, training, queries,
+		of2::FabMap::SAMPLED | of2::FabMap::CHOW_LIU);
+	testEngines(clTree, training, queries,
+		of2::FabMap::MEAN_FIELD | of2::FabMap::NAIVE_BAYES);
+	testDamage(clTree);
+
+	std::remove(modelFilename);
+	return testResult("testFabMapModel");
+}
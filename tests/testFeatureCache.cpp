@@ -0,0 +1,192 @@
+/*------------------------------------------------------------------------
+ Copyright 2012 Arren Glover [aj.glover@qut.edu.au]
+                Will Maddern [w.maddern@qut.edu.au]
+
+ This file is part of OpenFABMAP. http://code.google.com/p/openfabmap/
+
+ OpenFABMAP is free software: you can redistribute it and/or modify it under
+ the terms of the GNU General Public License as published by the Free Software
+ Foundation, either version 3 of the License, or (at your option) any later
+ version.
+
+ OpenFABMAP is distributed in the hope that it will be useful, but WITHOUT ANY
+ WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ details.
+
+ For published work which uses all or part of OpenFABMAP, please cite:
+ http://ieeexplore.ieee.org/xpl/articleDetails.jsp?arnumber=6224843
+
+ Original Algorithm by Mark Cummins and Paul Newman:
+ http://ijr.sagepub.com/content/27/6/647.short
+ http://ieeexplore.ieee.org/xpl/articleDetails.jsp?arnumber=5613942
+ http://ijr.sagepub.com/content/30/9/1100.abstract
+
+ You should have received a copy of the GNU General Public License along with
+ OpenFABMAP. If not, see http://www.gnu.org/licenses/.
+------------------------------------------------------------------------*/
+
+/*
+	Round trips through the per-frame feature cache of openFABMAPcli: the
+	keypoints and descriptors written for each frame are read back as they
+	were, and damaged or incomplete cache files are refused. The cache
+	functions are private to the command line tool, so its source is
+	compiled in with its main renamed.
+*/
+
+#define main openFABMAPcli
+#include "../samples/openFABMAPcli.cpp"
+#undef main
+
+#include "testUtils.hpp"
+#include <cstdio>
+#include <iterator>
+
+static const char *cacheFilename = "testFeatureCache.bin";
+
+static std::vector<cv::KeyPoint> testKeyPoints(int count, int frame) {
+	std::vector<cv::KeyPoint> kpts;
+	for (int i = 0; i < count; i++) {
+		kpts.push_back(cv::KeyPoint(i * 1.5f, frame + 0.25f, 7.f + i,
+			(float)(i * 10 % 360), 0.01f * i, i % 4, frame));
+	}
+	return kpts;
+}
+
+static bool sameKeyPoints(const std::vector<cv::KeyPoint>& a,
+		const std::vector<cv::KeyPoint>& b) {
+	if (a.size() != b.size()) {
+		return false;
+	}
+	for (size_t i = 0; i < a.size(); i++) {
+		if (a[i].pt.x != b[i].pt.x || a[i].pt.y != b[i].pt.y ||
+			a[i].size != b[i].size || a[i].angle != b[i].angle ||
+			a[i].response != b[i].response || a[i].octave != b[i].octave ||
+			a[i].class_id != b[i].class_id) {
+			return false;
+		}
+	}
+	return true;
+}
+
+//a cache of frames float descriptors, a frame without features and frames
+//binary descriptors, recording recordedFrames in its header
+static std::string writeCache(int frames, int recordedFrames,
+		std::vector<std::vector<cv::KeyPoint> >& kpts,
+		std::vector<cv::Mat>& descs) {
+	kpts.clear();
+	descs.clear();
+	for (int f = 0; f < frames; f++) {
+		int count = f == 1 ? 0 : 5 + f;
+		kpts.push_back(testKeyPoints(count, f));
+		cv::Mat frameDescs;
+		if (count > 0 && f % 2 == 0) {
+			frameDescs = testDescriptors(count, 64, f + 1);
+		} else if (count > 0) {
+			frameDescs.create(count, 32, CV_8U);
+			for (int i = 0; i < count; i++) {
+				for (int j = 0; j < 32; j++) {
+					frameDescs.at<uchar>(i, j) = (uchar)(f * 17 + i * 32 + j);
+				}
+			}
+		}
+		descs.push_back(frameDescs);
+	}
+
+	{
+		std::ofstream out(cacheFilename, std::ios::out | std::ios::binary);
+		out.write(FEATURE_CACHE_MAGIC, 8);
+		out.write((const char *)&recordedFrames, sizeof(recordedFrames));
+		for (int f = 0; f < frames; f++) {
+			writeFeatures(out, kpts[f], descs[f]);
+		}
+		int end[4] = {-1, 0, 0, 0};
+		out.write((const char *)end, sizeof(end));
+	}
+	std::ifstream in(cacheFilename, std::ios::in | std::ios::binary);
+	return std::string((std::istreambuf_iterator<char>(in)),
+		std::istreambuf_iterator<char>());
+}
+
+//whether a cache file passes its check and every frame then reads back
+static bool readsBack(const std::string& data) {
+	{
+		std::ofstream out(cacheFilename, std::ios::out | std::ios::binary);
+		out.write(data.data(), data.size());
+	}
+	std::ifstream in(cacheFilename, std::ios::in | std::ios::binary);
+	int frameCount = -1;
+	if (!checkFeatureCache(in, frameCount)) {
+		return false;
+	}
+	std::vector<cv::KeyPoint> kpts;
+	cv::Mat descs;
+	int frames = 0, read;
+	while ((read = readFeatures(in, kpts, descs)) > 0) {
+		frames++;
+	}
+	return read == 0 && frames == frameCount;
+}
+
+static void testRoundTrip() {
+	std::vector<std::vector<cv::KeyPoint> > kpts;
+	std::vector<cv::Mat> descs;
+	writeCache(6, 6, kpts, descs);
+
+	std::ifstream in(cacheFilename, std::ios::in | std::ios::binary);
+	int frameCount = -1;
+	TEST_CHECK(checkFeatureCache(in, frameCount));
+	TEST_CHECK(frameCount == 6);
+	std::vector<cv::KeyPoint> readKpts;
+	cv::Mat readDescs;
+	for (int f = 0; f < frameCount; f++) {
+		TEST_CHECK(readFeatures(in, readKpts, readDescs) == 1);
+		TEST_CHECK(sameKeyPoints(readKpts, kpts[f]));
+		if (descs[f].empty()) {
+			TEST_CHECK(readDescs.empty());
+		} else {
+			TEST_CHECK(readDescs.type() == descs[f].type());
+			TEST_CHECK(maxDifference(readDescs, descs[f]) == 0);
+		}
+	}
+	TEST_CHECK(readFeatures(in, readKpts, readDescs) == 0);
+}
+
+static void testDamage() {
+	std::vector<std::vector<cv::KeyPoint> > kpts;
+	std::vector<cv::Mat> descs;
+	std::string data = writeCache(5, 5, kpts, descs);
+	TEST_CHECK(readsBack(data));
+
+	// fewer or more frames than the header records
+	TEST_CHECK(!readsBack(writeCache(5, 6, kpts, descs)));
+	TEST_CHECK(!readsBack(writeCache(5, 4, kpts, descs)));
+
+	// cut short, or without its end marker
+	TEST_CHECK(!readsBack(data.substr(0, data.size() - 30)));
+	TEST_CHECK(!readsBack(data.substr(0, data.size() - 16)));
+	TEST_CHECK(!readsBack(data.substr(0, 10)));
+
+	// the first frame header with too many keypoints, negative columns
+	// and an unknown descriptor type
+	const size_t firstFrame = 8 + sizeof(int);
+	int values[3] = {1 << 30, -4, 77};
+	for (int field = 0; field < 3; field++) {
+		std::string damaged = data;
+		size_t offset = firstFrame + (field == 0 ? 0 : field + 1) * sizeof(int);
+		memcpy(&damaged[offset], &values[field], sizeof(int));
+		TEST_CHECK(!readsBack(damaged));
+	}
+
+	// another kind of file
+	std::string other = data;
+	other[0] = 'X';
+	TEST_CHECK(!readsBack(other));
+}
+
+int main() {
+	testRoundTrip();
+	testDamage();
+	std::remove(cacheFilename);
+	return testResult("testFeatureCache");
+}
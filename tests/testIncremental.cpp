@@ -0,0 +1,122 @@
+/*------------------------------------------------------------------------
+ Copyright 2012 Arren Glover [aj.glover@qut.edu.au]
+                Will Maddern [w.maddern@qut.edu.au]
+
+ This file is part of OpenFABMAP. http://code.google.com/p/openfabmap/
+
+ OpenFABMAP is free software: you can redistribute it and/or modify it under
+ the terms of the GNU General Public License as published by the Free Software
+ Foundation, either version 3 of the License, or (at your option) any later
+ version.
+
+ OpenFABMAP is distributed in the hope that it will be useful, but WITHOUT ANY
+ WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ details.
+
+ For published work which uses all or part of OpenFABMAP, please cite:
+ http://ieeexplore.ieee.org/xpl/articleDetails.jsp?arnumber=6224843
+
+ Original Algorithm by Mark Cummins and Paul Newman:
+ http://ijr.sagepub.com/content/27/6/647.short
+ http://ieeexplore.ieee.org/xpl/articleDetails.jsp?arnumber=5613942
+ http://ijr.sagepub.com/content/30/9/1100.abstract
+
+ You should have received a copy of the GNU General Public License along with
+ OpenFABMAP. If not, see http://www.gnu.org/licenses/.
+------------------------------------------------------------------------*/
+
+#include "testUtils.hpp"
+
+/*
+	INCREMENTAL scoring corrects the likelihoods of the last query for the
+	words that changed. Over a stream of consecutive frames, with each query
+	added to the map as it is scored, it must give the matches of scoring
+	every location from scratch.
+*/
+
+static const int nWords = 60;
+
+//frames that each change a few words of the last, with a cut to an
+//unrelated frame every 25 so scoring falls back to the full calculation
+static cv::Mat testStream(int frames) {
+	cv::Mat stream = testImgDescriptors(1, nWords, 0.2, 3);
+	testSeed = 9;
+	for (int k = 1; k < frames; k++) {
+		cv::Mat frame = stream.row(k - 1).clone();
+		for (int q = 0; q < nWords; q++) {
+			if (testUniform() < 0.03) {
+				frame.at<float>(0, q) = frame.at<float>(0, q) > 0 ? 0.f : 1.f;
+			}
+		}
+		if (k % 25 == 0) {
+			frame = testImgDescriptors(1, nWords, 0.2, 100 + k);
+		}
+		stream.push_back(frame);
+	}
+	return stream;
+}
+
+//the largest difference between the matches of full and incremental
+//scoring over the stream
+static double streamDifference(of2::FabMap& full, of2::FabMap& incremental,
+		const cv::Mat& training, const cv::Mat& stream) {
+	full.addTraining(training);
+	incremental.addTraining(training);
+	double difference = 0;
+	for (int k = 0; k < stream.rows; k++) {
+		std::vector<of2::IMatch> fullMatches, incrementalMatches;
+		full.compare(stream.row(k), fullMatches, true);
+		incremental.compare(stream.row(k), incrementalMatches, true);
+		difference = std::max(difference,
+			maxDifference(fullMatches, incrementalMatches));
+	}
+	return difference;
+}
+
+int main() {
+	cv::Mat training = testImgDescriptors(200, nWords, 0.2, 1);
+	of2::ChowLiuTree tree;
+	tree.add(training);
+	cv::Mat clTree = tree.make();
+	cv::Mat stream = testStream(80);
+
+	const double tolerance = 1e-6;
+	int methods[] = {of2::FabMap::CHOW_LIU, of2::FabMap::NAIVE_BAYES};
+	for (int m = 0; m < 2; m++) {
+		int flags = of2::FabMap::MEAN_FIELD | methods[m];
+		int incrementalFlags = flags | of2::FabMap::INCREMENTAL;
+
+		of2::FabMap1 fabmap1(clTree, 0.39, 0, flags);
+		of2::FabMap1 incrementalFabmap1(clTree, 0.39, 0, incrementalFlags);
+		TEST_CHECK(streamDifference(fabmap1, incrementalFabmap1, training,
+			stream) < tolerance);
+
+		of2::FabMapLUT lut(clTree, 0.39, 0, flags);
+		of2::FabMapLUT incrementalLut(clTree, 0.39, 0, incrementalFlags);
+		TEST_CHECK(streamDifference(lut, incrementalLut, training,
+			stream) < tolerance);
+
+		// FabMap2 samples the new place likelihood over the training
+		// images, which it also scores incrementally
+		flags = of2::FabMap::SAMPLED | methods[m];
+		incrementalFlags = flags | of2::FabMap::INCREMENTAL;
+		of2::FabMap2 fabmap2(clTree, 0.39, 0, flags);
+		of2::FabMap2 incrementalFabmap2(clTree, 0.39, 0, incrementalFlags);
+		TEST_CHECK(streamDifference(fabmap2, incrementalFabmap2, training,
+			stream) < tolerance);
+	}
+
+	// a threshold of 0 scores every query in full, 1 corrects every query
+	int flags = of2::FabMap::MEAN_FIELD | of2::FabMap::CHOW_LIU;
+	for (int t = 0; t < 2; t++) {
+		of2::FabMapLUT lut(clTree, 0.39, 0, flags);
+		of2::FabMapLUT incrementalLut(clTree, 0.39, 0,
+			flags | of2::FabMap::INCREMENTAL);
+		incrementalLut.setIncrementalThreshold(t);
+		TEST_CHECK(streamDifference(lut, incrementalLut, training,
+			stream) < tolerance);
+	}
+
+	return testResult("testIncremental");
+}
@@ -0,0 +1,181 @@
+/*------------------------------------------------------------------------
+ Copyright 2012 Arren Glover [aj.glover@qut.edu.au]
+                Will Maddern [w.maddern@qut.edu.au]
+
+ This file is part of OpenFABMAP. http://code.google.com/p/openfabmap/
+
+ OpenFABMAP is free software: you can redistribute it and/or modify it under
+ the terms of the GNU General Public License as published by the Free Software
+ Foundation, either version 3 of the License, or (at your option) any later
+ version.
+
+ OpenFABMAP is distributed in the hope that it will be useful, but WITHOUT ANY
+ WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ details.
+
+ For published work which uses all or part of OpenFABMAP, please cite:
+ http://ieeexplore.ieee.org/xpl/articleDetails.jsp?arnumber=6224843
+
+ Original Algorithm by Mark Cummins and Paul Newman:
+ http://ijr.sagepub.com/content/27/6/647.short
+ http://ieeexplore.ieee.org/xpl/articleDetails.jsp?arnumber=5613942
+ http://ijr.sagepub.com/content/30/9/1100.abstract
+
+ You should have received a copy of the GNU General Public License along with
+ OpenFABMAP. If not, see http://www.gnu.org/licenses/.
+------------------------------------------------------------------------*/
+
+#include "testUtils.hpp"
+#include <cstdio>
+
+/*
+	Round trips through MatrixFile: dense, sparse and byte matrices, rows
+	read a chunk at a time, the training artifacts stored in matrix files,
+	and the little-endian layout of the file header.
+*/
+
+static const char *matrixFilename = "testMatrixFile.bin";
+
+static void testMatrices() {
+
+	cv::Mat dense(37, 13, CV_64F);
+	for (int i = 0; i < dense.rows; i++) {
+		for (int j = 0; j < dense.cols; j++) {
+			dense.at<double>(i, j) = i * 0.5 - j / 3.0;
+		}
+	}
+	cv::Mat bow = testImgDescriptors(200, 300, 0.05, 1);
+	bow.row(7).setTo(0);
+	cv::Mat bytes(20, 32, CV_8U);
+	for (int i = 0; i < bytes.rows; i++) {
+		for (int j = 0; j < bytes.cols; j++) {
+			bytes.at<uchar>(i, j) = (uchar)(i * 31 + j);
+		}
+	}
+	cv::Mat empty;
+
+	{
+		of2::MatrixFile file(matrixFilename, of2::MatrixFile::WRITE);
+		TEST_CHECK(file.isOpened());
+		file.write("Dense", dense);
+		file.write("BOWImageDescs", bow, true);
+		file.write("Bytes", bytes);
+		file.write("Empty", empty);
+	}
+	TEST_CHECK(of2::MatrixFile::isMatrixFile(matrixFilename));
+
+	// the header is little-endian whatever the machine
+	std::ifstream raw(matrixFilename, std::ios::in | std::ios::binary);
+	unsigned char header[16];
+	raw.read((char *)header, sizeof(header));
+	TEST_CHECK(raw && std::string((char *)header, 8) == "OF2MATRX");
+	TEST_CHECK(header[8] == 1 && header[9] == 0 && header[10] == 0 &&
+		header[11] == 0);
+	TEST_CHECK(header[12] == 4 && header[13] == 3 && header[14] == 2 &&
+		header[15] == 1);
+	raw.close();
+
+	of2::MatrixFile file(matrixFilename, of2::MatrixFile::READ);
+	TEST_CHECK(file.isOpened());
+	cv::Mat readBytes, readDense, readBow, readEmpty, missing;
+	file.read("Bytes", readBytes);
+	file.read("Dense", readDense);
+	file.read("BOWImageDescs", readBow);
+	file.read("Empty", readEmpty);
+	file.read("Missing", missing);
+	TEST_CHECK(readDense.type() == CV_64F && maxDifference(readDense, dense) == 0);
+	TEST_CHECK(readBow.type() == CV_32F && maxDifference(readBow, bow) == 0);
+	TEST_CHECK(readBytes.type() == CV_8U && maxDifference(readBytes, bytes) == 0);
+	TEST_CHECK(readEmpty.empty());
+	TEST_CHECK(missing.empty());
+
+	// the sparse matrix a chunk at a time
+	int rows, cols, type;
+	TEST_CHECK(file.find("BOWImageDescs", rows, cols, type));
+	TEST_CHECK(rows == bow.rows && cols == bow.cols && type == CV_32F);
+	cv::Mat chunk;
+	int rowsRead = 0;
+	while (file.readRows(chunk, 64)) {
+		TEST_CHECK(maxDifference(chunk,
+			bow.rowRange(rowsRead, rowsRead + chunk.rows)) == 0);
+		rowsRead += chunk.rows;
+	}
+	TEST_CHECK(rowsRead == bow.rows);
+	TEST_CHECK(!file.find("Missing", rows, cols, type));
+	file.release();
+
+	// and through the descriptor reader, twice
+	of2::BOWDescriptorReader reader(matrixFilename);
+	TEST_CHECK(reader.isOpened());
+	TEST_CHECK(reader.getRows() == bow.rows && reader.getCols() == bow.cols);
+	for (int pass = 0; pass < 2; pass++) {
+		rowsRead = 0;
+		while (reader.read(chunk, 50)) {
+			TEST_CHECK(maxDifference(chunk,
+				bow.rowRange(rowsRead, rowsRead + chunk.rows)) == 0);
+			rowsRead += chunk.rows;
+		}
+		TEST_CHECK(rowsRead == bow.rows);
+		reader.rewind();
+	}
+}
+
+static void testArtifacts() {
+
+	cv::Mat bow = testImgDescriptors(150, 40, 0.2, 2);
+	of2::ChowLiuTree statistics;
+	statistics.add(bow);
+	statistics.updateStatistics();
+	cv::Mat clTree = statistics.make();
+
+	of2::WordOrder order(clTree, of2::WordOrder::DEPTH_FIRST);
+
+	cv::Mat descriptors = testDescriptors(300, 16, 3);
+	of2::PCAProjection projection;
+	projection.train(descriptors, 4);
+
+	{
+		of2::MatrixFile file(matrixFilename, of2::MatrixFile::WRITE);
+		statistics.write(file);
+		order.write(file);
+		projection.write(file);
+	}
+
+	of2::MatrixFile file(matrixFilename, of2::MatrixFile::READ);
+
+	// the reloaded statistics make the same tree, and go on counting as
+	// the originals do
+	of2::ChowLiuTree readStatistics;
+	TEST_CHECK(readStatistics.read(file));
+	TEST_CHECK(maxDifference(readStatistics.make(), clTree) == 0);
+	cv::Mat more = testImgDescriptors(50, 40, 0.2, 4);
+	statistics.add(more);
+	readStatistics.add(more);
+	TEST_CHECK(maxDifference(readStatistics.make(), statistics.make()) == 0);
+
+	// statistics counted with another maxPartners are refused
+	of2::ChowLiuTree partnerStatistics(5);
+	TEST_CHECK(!partnerStatistics.read(file));
+
+	of2::WordOrder readOrder;
+	TEST_CHECK(readOrder.read(file));
+	TEST_CHECK(readOrder.getNewToOld() == order.getNewToOld());
+	TEST_CHECK(readOrder.getOldToNew() == order.getOldToNew());
+
+	of2::PCAProjection readProjection;
+	readProjection.read(file);
+	TEST_CHECK(readProjection.getDims() == 4 &&
+		readProjection.getInputDims() == 16);
+	cv::Mat projected, readProjected;
+	projection.project(descriptors, projected);
+	readProjection.project(descriptors, readProjected);
+	TEST_CHECK(maxDifference(projected, readProjected) == 0);
+}
+
+int main() {
+	testMatrices();
+	testArtifacts();
+	std::remove(matrixFilename);
+	return testResult("testMatrixFile");
+}
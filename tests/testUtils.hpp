@@ -0,0 +1,151 @@
+/*------------------------------------------------------------------------
+ Copyright 2012 Arren Glover [aj.glover@qut.edu.au]
+                Will Maddern [w.maddern@qut.edu.au]
+
+ This file is part of OpenFABMAP. http://code.google.com/p/openfabmap/
+
+ OpenFABMAP is free software: you can redistribute it and/or modify it under
+ the terms of the GNU General Public License as published by the Free Software
+ Foundation, either version 3 of the License, or (at your option) any later
+ version.
+
+ OpenFABMAP is distributed in the hope that it will be useful, but WITHOUT ANY
+ WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ details.
+
+ For published work which uses all or part of OpenFABMAP, please cite:
+ http://ieeexplore.ieee.org/xpl/articleDetails.jsp?arnumber=6224843
+
+ Original Algorithm by Mark Cummins and Paul Newman:
+ http://ijr.sagepub.com/content/27/6/647.short
+ http://ieeexplore.ieee.org/xpl/articleDetails.jsp?arnumber=5613942
+ http://ijr.sagepub.com/content/30/9/1100.abstract
+
+ You should have received a copy of the GNU General Public License along with
+ OpenFABMAP. If not, see http://www.gnu.org/licenses/.
+------------------------------------------------------------------------*/
+
+#ifndef OPENFABMAP_TEST_UTILS_H_
+#define OPENFABMAP_TEST_UTILS_H_
+
+#include "../include/openfabmap.hpp"
+#include <iostream>
+#include <cmath>
+
+/*
+	Helpers shared by the test programs. Each test runs its checks, reports
+	every one that fails and returns the number failed, so ctest sees a
+	nonzero exit status.
+*/
+
+static int testFailures = 0;
+
+#define TEST_CHECK(condition) \
+	do { \
+		if (!(condition)) { \
+			std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " \
+				<< #condition << std::endl; \
+			testFailures++; \
+		} \
+	} while (0)
+
+//a repeatable uniform number in [0, 1), the same on every platform
+static unsigned int testSeed = 1;
+inline double testUniform() {
+	testSeed = testSeed * 1664525u + 1013904223u;
+	return (testSeed >> 8) / 16777216.0;
+}
+
+//images x nWords CV_32F bag-of-words descriptors. Each word is present with
+//probability p, except that every odd word follows the word before it with
+//probability 0.7, so the Chow-Liu tree has dependencies to find
+inline cv::Mat testImgDescriptors(int images, int nWords, double p,
+		unsigned int seed) {
+	testSeed = seed;
+	cv::Mat descriptors(images, nWords, CV_32F, cv::Scalar(0));
+	for (int i = 0; i < images; i++) {
+		for (int q = 0; q < nWords; q++) {
+			double pq = p;
+			if (q % 2 && descriptors.at<float>(i, q - 1) > 0) {
+				pq = 0.7;
+			}
+			if (testUniform() < pq) {
+				descriptors.at<float>(i, q) =
+					(float)(1 + (int)(testUniform() * 3));
+			}
+		}
+	}
+	return descriptors;
+}
+
+//rows x cols CV_32F values uniform in [0, 1)
+inline cv::Mat testDescriptors(int rows, int cols, unsigned int seed) {
+	testSeed = seed;
+	cv::Mat descriptors(rows, cols, CV_32F);
+	for (int i = 0; i < rows; i++) {
+		for (int j = 0; j < cols; j++) {
+			descriptors.at<float>(i, j) = (float)testUniform();
+		}
+	}
+	return descriptors;
+}
+
+inline std::vector<cv::Mat> testRows(const cv::Mat& descriptors) {
+	std::vector<cv::Mat> rows;
+	for (int i = 0; i < descriptors.rows; i++) {
+		rows.push_back(descriptors.row(i));
+	}
+	return rows;
+}
+
+//the largest absolute difference between two matrices of the same size,
+//infinite if their sizes differ
+inline double maxDifference(const cv::Mat& a, const cv::Mat& b) {
+	if (a.rows != b.rows || a.cols != b.cols || a.channels() != 1 ||
+		b.channels() != 1) {
+		return HUGE_VAL;
+	}
+	cv::Mat a64, b64;
+	a.convertTo(a64, CV_64F);
+	b.convertTo(b64, CV_64F);
+	double difference = 0;
+	for (int i = 0; i < a64.rows; i++) {
+		for (int j = 0; j < a64.cols; j++) {
+			difference = std::max(difference,
+				std::fabs(a64.at<double>(i, j) - b64.at<double>(i, j)));
+		}
+	}
+	return difference;
+}
+
+//the largest difference in likelihood or probability between two sets of
+//matches of the same queries and images, infinite if they differ otherwise
+inline double maxDifference(const std::vector<of2::IMatch>& a,
+		const std::vector<of2::IMatch>& b) {
+	if (a.size() != b.size()) {
+		return HUGE_VAL;
+	}
+	double difference = 0;
+	for (size_t i = 0; i < a.size(); i++) {
+		if (a[i].queryIdx != b[i].queryIdx || a[i].imgIdx != b[i].imgIdx) {
+			return HUGE_VAL;
+		}
+		difference = std::max(difference,
+			std::fabs(a[i].likelihood - b[i].likelihood));
+		difference = std::max(difference, std::fabs(a[i].match - b[i].match));
+	}
+	return difference;
+}
+
+inline int testResult(const char *name) {
+	if (testFailures) {
+		std::cerr << name << ": " << testFailures << " checks failed" <<
+			std::endl;
+	} else {
+		std::cout << name << ": all checks passed" << std::endl;
+	}
+	return testFailures;
+}
+
+#endif /* OPENFABMAP_TEST_UTILS_H_ */